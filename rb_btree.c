@@ -0,0 +1,541 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* For posix_memalign */
+#define _POSIX_C_SOURCE 200112L
+
+#include "rb_btree.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** The maximum depth of a B+-tree
+ *
+ * Every node but the root has at least RB_BTREE_MIN_KEYS + 1 children so
+ * this is far more than can fit in memory.
+ */
+#define RB_BTREE_MAX_DEPTH 32
+
+struct rb_btree_path {
+    struct rb_btree_node *node[RB_BTREE_MAX_DEPTH];
+    unsigned index[RB_BTREE_MAX_DEPTH];
+    unsigned depth;
+};
+
+static struct rb_btree_node *
+rb_btree_node_alloc(void)
+{
+    void *ptr;
+    if (posix_memalign(&ptr, RB_BTREE_NODE_ALIGN,
+                       sizeof(struct rb_btree_node)) != 0)
+        return NULL;
+    return ptr;
+}
+
+void
+rb_btree_init(struct rb_btree *T)
+{
+    T->root = NULL;
+}
+
+static void
+rb_btree_node_free_all(struct rb_btree_node *n)
+{
+    if (!n->leaf) {
+        for (unsigned i = 0; i <= n->count; i++)
+            rb_btree_node_free_all(n->u.children[i]);
+    }
+    free(n);
+}
+
+void
+rb_btree_finish(struct rb_btree *T)
+{
+    if (T->root)
+        rb_btree_node_free_all(T->root);
+    T->root = NULL;
+}
+
+/* Walk from the root to the leaf which would hold key, recording which
+ * child was taken at each level.  The leaf is the last node on the path.
+ */
+static void
+rb_btree_find_path(const struct rb_btree *T, uint64_t key,
+                   struct rb_btree_path *path)
+{
+    struct rb_btree_node *n = T->root;
+    path->depth = 0;
+    while (true) {
+        assert(path->depth < RB_BTREE_MAX_DEPTH);
+        path->node[path->depth] = n;
+        if (n->leaf)
+            break;
+
+        unsigned i = rb_btree_node_rank_le(n, key);
+        path->index[path->depth] = i;
+        path->depth++;
+        n = n->u.children[i];
+    }
+}
+
+static void
+rb_btree_leaf_insert_at(struct rb_btree_node *n, unsigned i,
+                        uint64_t key, void *value)
+{
+    assert(n->count < RB_BTREE_MAX_KEYS);
+    memmove(&n->keys[i + 1], &n->keys[i],
+            (n->count - i) * sizeof(n->keys[0]));
+    memmove(&n->u.leaf.values[i + 1], &n->u.leaf.values[i],
+            (n->count - i) * sizeof(n->u.leaf.values[0]));
+    n->keys[i] = key;
+    n->u.leaf.values[i] = value;
+    n->count++;
+}
+
+/* Insert key with child to its right at position i of an interior node */
+static void
+rb_btree_interior_insert_at(struct rb_btree_node *n, unsigned i,
+                            uint64_t key, struct rb_btree_node *child)
+{
+    assert(n->count < RB_BTREE_MAX_KEYS);
+    memmove(&n->keys[i + 1], &n->keys[i],
+            (n->count - i) * sizeof(n->keys[0]));
+    memmove(&n->u.children[i + 2], &n->u.children[i + 1],
+            (n->count - i) * sizeof(n->u.children[0]));
+    n->keys[i] = key;
+    n->u.children[i + 1] = child;
+    n->count++;
+}
+
+/* Split a full leaf while inserting key at position i
+ *
+ * The upper half goes into right, which is linked in after n.  Returns the
+ * separator for the parent.
+ */
+static uint64_t
+rb_btree_leaf_split(struct rb_btree_node *n, struct rb_btree_node *right,
+                    unsigned i, uint64_t key, void *value)
+{
+    uint64_t keys[RB_BTREE_MAX_KEYS + 1];
+    void *values[RB_BTREE_MAX_KEYS + 1];
+
+    assert(n->count == RB_BTREE_MAX_KEYS);
+    memcpy(keys, n->keys, i * sizeof(keys[0]));
+    memcpy(values, n->u.leaf.values, i * sizeof(values[0]));
+    keys[i] = key;
+    values[i] = value;
+    memcpy(&keys[i + 1], &n->keys[i],
+           (RB_BTREE_MAX_KEYS - i) * sizeof(keys[0]));
+    memcpy(&values[i + 1], &n->u.leaf.values[i],
+           (RB_BTREE_MAX_KEYS - i) * sizeof(values[0]));
+
+    const unsigned left_count = (RB_BTREE_MAX_KEYS + 1) / 2;
+    const unsigned right_count = RB_BTREE_MAX_KEYS + 1 - left_count;
+
+    memcpy(n->keys, keys, left_count * sizeof(keys[0]));
+    memcpy(n->u.leaf.values, values, left_count * sizeof(values[0]));
+    n->count = left_count;
+
+    right->leaf = true;
+    memcpy(right->keys, &keys[left_count], right_count * sizeof(keys[0]));
+    memcpy(right->u.leaf.values, &values[left_count],
+           right_count * sizeof(values[0]));
+    right->count = right_count;
+
+    right->u.leaf.prev = n;
+    right->u.leaf.next = n->u.leaf.next;
+    if (n->u.leaf.next)
+        n->u.leaf.next->u.leaf.prev = right;
+    n->u.leaf.next = right;
+
+    return right->keys[0];
+}
+
+/* Split a full interior node while inserting key with child to its right
+ * at position i
+ *
+ * The upper half goes into right.  Returns the separator for the parent,
+ * which is no longer in either node.
+ */
+static uint64_t
+rb_btree_interior_split(struct rb_btree_node *n, struct rb_btree_node *right,
+                        unsigned i, uint64_t key,
+                        struct rb_btree_node *child)
+{
+    uint64_t keys[RB_BTREE_MAX_KEYS + 1];
+    struct rb_btree_node *children[RB_BTREE_MAX_KEYS + 2];
+
+    assert(n->count == RB_BTREE_MAX_KEYS);
+    memcpy(keys, n->keys, i * sizeof(keys[0]));
+    keys[i] = key;
+    memcpy(&keys[i + 1], &n->keys[i],
+           (RB_BTREE_MAX_KEYS - i) * sizeof(keys[0]));
+    memcpy(children, n->u.children, (i + 1) * sizeof(children[0]));
+    children[i + 1] = child;
+    memcpy(&children[i + 2], &n->u.children[i + 1],
+           (RB_BTREE_MAX_KEYS - i) * sizeof(children[0]));
+
+    /* One key moves up to the parent */
+    const unsigned left_count = RB_BTREE_MAX_KEYS / 2;
+    const unsigned right_count = RB_BTREE_MAX_KEYS - left_count;
+
+    memcpy(n->keys, keys, left_count * sizeof(keys[0]));
+    memcpy(n->u.children, children, (left_count + 1) * sizeof(children[0]));
+    n->count = left_count;
+
+    right->leaf = false;
+    memcpy(right->keys, &keys[left_count + 1],
+           right_count * sizeof(keys[0]));
+    memcpy(right->u.children, &children[left_count + 1],
+           (right_count + 1) * sizeof(children[0]));
+    right->count = right_count;
+
+    return keys[left_count];
+}
+
+bool
+rb_btree_insert(struct rb_btree *T, uint64_t key, void *value)
+{
+    if (T->root == NULL) {
+        struct rb_btree_node *leaf = rb_btree_node_alloc();
+        if (leaf == NULL)
+            return false;
+
+        leaf->leaf = true;
+        leaf->count = 1;
+        leaf->keys[0] = key;
+        leaf->u.leaf.values[0] = value;
+        leaf->u.leaf.prev = NULL;
+        leaf->u.leaf.next = NULL;
+        T->root = leaf;
+        return true;
+    }
+
+    struct rb_btree_path path;
+    rb_btree_find_path(T, key, &path);
+
+    struct rb_btree_node *leaf = path.node[path.depth];
+    unsigned i = rb_btree_node_rank_lt(leaf, key);
+    if (i < leaf->count && leaf->keys[i] == key) {
+        leaf->u.leaf.values[i] = value;
+        return true;
+    }
+
+    if (leaf->count < RB_BTREE_MAX_KEYS) {
+        rb_btree_leaf_insert_at(leaf, i, key, value);
+        return true;
+    }
+
+    /* Every full node on the path from the leaf up splits.  If that goes
+     * all the way to the root, we also need a new root.  Allocate all of
+     * the nodes up-front so that we can fail without touching the tree.
+     */
+    unsigned num_splits = 1;
+    while (num_splits <= path.depth &&
+           path.node[path.depth - num_splits]->count == RB_BTREE_MAX_KEYS)
+        num_splits++;
+    const unsigned num_new = num_splits + (num_splits > path.depth);
+
+    struct rb_btree_node *new_nodes[RB_BTREE_MAX_DEPTH + 1];
+    for (unsigned n = 0; n < num_new; n++) {
+        new_nodes[n] = rb_btree_node_alloc();
+        if (new_nodes[n] == NULL) {
+            for (unsigned m = 0; m < n; m++)
+                free(new_nodes[m]);
+            return false;
+        }
+    }
+
+    struct rb_btree_node *right = new_nodes[0];
+    uint64_t sep = rb_btree_leaf_split(leaf, right, i, key, value);
+
+    unsigned d = path.depth;
+    for (unsigned s = 1; s < num_splits; s++) {
+        d--;
+        struct rb_btree_node *n = path.node[d];
+        struct rb_btree_node *new_right = new_nodes[s];
+        sep = rb_btree_interior_split(n, new_right, path.index[d], sep, right);
+        right = new_right;
+    }
+
+    if (d == 0) {
+        struct rb_btree_node *root = new_nodes[num_splits];
+        root->leaf = false;
+        root->count = 1;
+        root->keys[0] = sep;
+        root->u.children[0] = T->root;
+        root->u.children[1] = right;
+        T->root = root;
+    } else {
+        d--;
+        rb_btree_interior_insert_at(path.node[d], path.index[d], sep, right);
+    }
+
+    return true;
+}
+
+static void
+rb_btree_leaf_remove_at(struct rb_btree_node *n, unsigned i)
+{
+    memmove(&n->keys[i], &n->keys[i + 1],
+            (n->count - i - 1) * sizeof(n->keys[0]));
+    memmove(&n->u.leaf.values[i], &n->u.leaf.values[i + 1],
+            (n->count - i - 1) * sizeof(n->u.leaf.values[0]));
+    n->count--;
+}
+
+/* Remove key i and the child to its right from an interior node */
+static void
+rb_btree_interior_remove_at(struct rb_btree_node *n, unsigned i)
+{
+    memmove(&n->keys[i], &n->keys[i + 1],
+            (n->count - i - 1) * sizeof(n->keys[0]));
+    memmove(&n->u.children[i + 1], &n->u.children[i + 2],
+            (n->count - i - 1) * sizeof(n->u.children[0]));
+    n->count--;
+}
+
+/* Move one entry from the end of left to the start of n, its right
+ * sibling, where sep is the separator between them in the parent.
+ */
+static void
+rb_btree_borrow_left(struct rb_btree_node *n, struct rb_btree_node *left,
+                     uint64_t *sep)
+{
+    if (n->leaf) {
+        rb_btree_leaf_insert_at(n, 0, left->keys[left->count - 1],
+                                left->u.leaf.values[left->count - 1]);
+        left->count--;
+        *sep = n->keys[0];
+    } else {
+        memmove(&n->keys[1], &n->keys[0], n->count * sizeof(n->keys[0]));
+        memmove(&n->u.children[1], &n->u.children[0],
+                (n->count + 1) * sizeof(n->u.children[0]));
+        n->keys[0] = *sep;
+        n->u.children[0] = left->u.children[left->count];
+        n->count++;
+        *sep = left->keys[left->count - 1];
+        left->count--;
+    }
+}
+
+/* Move one entry from the start of right to the end of n, its left
+ * sibling, where sep is the separator between them in the parent.
+ */
+static void
+rb_btree_borrow_right(struct rb_btree_node *n, struct rb_btree_node *right,
+                      uint64_t *sep)
+{
+    if (n->leaf) {
+        n->keys[n->count] = right->keys[0];
+        n->u.leaf.values[n->count] = right->u.leaf.values[0];
+        n->count++;
+        rb_btree_leaf_remove_at(right, 0);
+        *sep = right->keys[0];
+    } else {
+        n->keys[n->count] = *sep;
+        n->u.children[n->count + 1] = right->u.children[0];
+        n->count++;
+        *sep = right->keys[0];
+        memmove(&right->keys[0], &right->keys[1],
+                (right->count - 1) * sizeof(right->keys[0]));
+        memmove(&right->u.children[0], &right->u.children[1],
+                right->count * sizeof(right->u.children[0]));
+        right->count--;
+    }
+}
+
+/* Merge right into left, its left sibling, and free right.  sep is the
+ * separator between them in the parent, which the caller removes.
+ */
+static void
+rb_btree_merge(struct rb_btree_node *left, struct rb_btree_node *right,
+               uint64_t sep)
+{
+    if (left->leaf) {
+        assert(left->count + right->count <= RB_BTREE_MAX_KEYS);
+        memcpy(&left->keys[left->count], right->keys,
+               right->count * sizeof(right->keys[0]));
+        memcpy(&left->u.leaf.values[left->count], right->u.leaf.values,
+               right->count * sizeof(right->u.leaf.values[0]));
+        left->count += right->count;
+
+        left->u.leaf.next = right->u.leaf.next;
+        if (right->u.leaf.next)
+            right->u.leaf.next->u.leaf.prev = left;
+    } else {
+        assert(left->count + right->count + 1 <= RB_BTREE_MAX_KEYS);
+        left->keys[left->count] = sep;
+        memcpy(&left->keys[left->count + 1], right->keys,
+               right->count * sizeof(right->keys[0]));
+        memcpy(&left->u.children[left->count + 1], right->u.children,
+               (right->count + 1) * sizeof(right->u.children[0]));
+        left->count += right->count + 1;
+    }
+    free(right);
+}
+
+bool
+rb_btree_remove(struct rb_btree *T, uint64_t key)
+{
+    if (T->root == NULL)
+        return false;
+
+    struct rb_btree_path path;
+    rb_btree_find_path(T, key, &path);
+
+    struct rb_btree_node *leaf = path.node[path.depth];
+    unsigned i = rb_btree_node_rank_lt(leaf, key);
+    if (i >= leaf->count || leaf->keys[i] != key)
+        return false;
+
+    /* Separators in interior nodes only need to bound the keys on either
+     * side so there's no need to update one which equals the removed key.
+     */
+    rb_btree_leaf_remove_at(leaf, i);
+
+    unsigned d = path.depth;
+    while (d > 0 && path.node[d]->count < RB_BTREE_MIN_KEYS) {
+        struct rb_btree_node *n = path.node[d];
+        struct rb_btree_node *parent = path.node[d - 1];
+        unsigned idx = path.index[d - 1];
+
+        struct rb_btree_node *left =
+            idx > 0 ? parent->u.children[idx - 1] : NULL;
+        struct rb_btree_node *right =
+            idx < parent->count ? parent->u.children[idx + 1] : NULL;
+
+        if (left && left->count > RB_BTREE_MIN_KEYS) {
+            rb_btree_borrow_left(n, left, &parent->keys[idx - 1]);
+            return true;
+        } else if (right && right->count > RB_BTREE_MIN_KEYS) {
+            rb_btree_borrow_right(n, right, &parent->keys[idx]);
+            return true;
+        } else if (left) {
+            rb_btree_merge(left, n, parent->keys[idx - 1]);
+            rb_btree_interior_remove_at(parent, idx - 1);
+        } else {
+            assert(right);
+            rb_btree_merge(n, right, parent->keys[idx]);
+            rb_btree_interior_remove_at(parent, idx);
+        }
+        d--;
+    }
+
+    struct rb_btree_node *root = T->root;
+    if (root->count == 0) {
+        if (root->leaf) {
+            T->root = NULL;
+        } else {
+            T->root = root->u.children[0];
+        }
+        free(root);
+    }
+
+    return true;
+}
+
+struct rb_btree_iter
+rb_btree_first(const struct rb_btree *T)
+{
+    struct rb_btree_iter it = { NULL, 0 };
+    struct rb_btree_node *n = T->root;
+    if (n == NULL)
+        return it;
+
+    while (!n->leaf)
+        n = n->u.children[0];
+
+    it.node = n;
+    return it;
+}
+
+struct rb_btree_iter
+rb_btree_last(const struct rb_btree *T)
+{
+    struct rb_btree_iter it = { NULL, 0 };
+    struct rb_btree_node *n = T->root;
+    if (n == NULL)
+        return it;
+
+    while (!n->leaf)
+        n = n->u.children[n->count];
+
+    it.node = n;
+    it.index = n->count - 1;
+    return it;
+}
+
+static void
+rb_btree_validate_node(const struct rb_btree_node *n, bool is_root,
+                       bool has_lo, uint64_t lo, bool has_hi, uint64_t hi,
+                       unsigned depth, unsigned *leaf_depth,
+                       const struct rb_btree_node **prev_leaf)
+{
+    assert(((uintptr_t)n & (RB_BTREE_NODE_ALIGN - 1)) == 0);
+    assert(n->count <= RB_BTREE_MAX_KEYS);
+    assert(is_root ? n->count >= 1 : n->count >= RB_BTREE_MIN_KEYS);
+    (void)is_root;
+
+    for (unsigned i = 0; i < n->count; i++) {
+        assert(!has_lo || n->keys[i] >= lo);
+        assert(!has_hi || n->keys[i] < hi);
+        assert(i == 0 || n->keys[i - 1] < n->keys[i]);
+    }
+
+    if (n->leaf) {
+        if (*leaf_depth == UINT32_MAX)
+            *leaf_depth = depth;
+        assert(depth == *leaf_depth);
+
+        assert(n->u.leaf.prev == *prev_leaf);
+        if (*prev_leaf)
+            assert((*prev_leaf)->u.leaf.next == n);
+        *prev_leaf = n;
+        return;
+    }
+
+    for (unsigned i = 0; i <= n->count; i++) {
+        bool child_has_lo = i > 0 ? true : has_lo;
+        uint64_t child_lo = i > 0 ? n->keys[i - 1] : lo;
+        bool child_has_hi = i < n->count ? true : has_hi;
+        uint64_t child_hi = i < n->count ? n->keys[i] : hi;
+        rb_btree_validate_node(n->u.children[i], false,
+                               child_has_lo, child_lo,
+                               child_has_hi, child_hi,
+                               depth + 1, leaf_depth, prev_leaf);
+    }
+}
+
+void
+rb_btree_validate(const struct rb_btree *T)
+{
+    if (T->root == NULL)
+        return;
+
+    unsigned leaf_depth = UINT32_MAX;
+    const struct rb_btree_node *prev_leaf = NULL;
+    rb_btree_validate_node(T->root, true, false, 0, false, 0,
+                           0, &leaf_depth, &prev_leaf);
+    assert(prev_leaf->u.leaf.next == NULL);
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_BTREE_H
+#define RB_BTREE_H
+
+/** \file rb_btree.h
+ *
+ * B+-trees with cache-line-aligned nodes
+ *
+ * Every level of a red-black tree search is a dependent cache miss.  A
+ * B+-tree packs many keys into each node, keeping them together at the
+ * start of the node, so a search touches a handful of cache lines per level
+ * and has a quarter of the levels.  This is an ordered map from uint64_t
+ * keys to void pointer values with the same operations as rb_tree.h.
+ *
+ * Unlike rb_tree, this isn't invasive: the tree allocates its own nodes
+ * and stores copies of the keys.  Each key appears at most once.
+ *
+ * All of the values live in the leaves, which are linked together so
+ * iteration never has to go back up the tree.  Positions in the tree are
+ * represented by a struct rb_btree_iter, which is invalidated by any
+ * change to the tree.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The maximum number of keys in a node
+ *
+ * This is chosen so that a node fits in four cache lines with the keys in
+ * the first two.
+ */
+#define RB_BTREE_MAX_KEYS 14
+
+/** The minimum number of keys in any node but the root */
+#define RB_BTREE_MIN_KEYS (RB_BTREE_MAX_KEYS / 2)
+
+/** The alignment of nodes, which is the size of a cache line */
+#define RB_BTREE_NODE_ALIGN 64
+
+/** A B+-tree node
+ *
+ * The keys come first so that searching a node only touches the first two
+ * cache lines.  In an interior node, keys[i] separates the subtrees on
+ * either side of it: every key in children[i] is less than keys[i] and
+ * every key in children[i + 1] is greater than or equal to it.
+ */
+struct rb_btree_node {
+    uint64_t keys[RB_BTREE_MAX_KEYS];
+    uint16_t count;
+    bool leaf;
+
+    union {
+        struct rb_btree_node *children[RB_BTREE_MAX_KEYS + 1];
+
+        struct {
+            void *values[RB_BTREE_MAX_KEYS];
+            struct rb_btree_node *prev;
+            struct rb_btree_node *next;
+        } leaf;
+    } u;
+};
+
+/** A B+-tree */
+struct rb_btree {
+    struct rb_btree_node *root;
+};
+
+/** A position in a B+-tree
+ *
+ * A NULL node means the position is past the end of the tree, the
+ * equivalent of a NULL rb_node.
+ */
+struct rb_btree_iter {
+    struct rb_btree_node *node;
+    unsigned index;
+};
+
+/** Initialize a B+-tree */
+void rb_btree_init(struct rb_btree *T);
+
+/** Free all of the nodes of a B+-tree
+ *
+ * The values are left alone.  The tree is left empty.
+ */
+void rb_btree_finish(struct rb_btree *T);
+
+/** Returns true if the B+-tree is empty */
+static inline bool
+rb_btree_is_empty(const struct rb_btree *T)
+{
+    return T->root == NULL;
+}
+
+/** Returns true if an iterator points at an element */
+static inline bool
+rb_btree_iter_valid(struct rb_btree_iter it)
+{
+    return it.node != NULL;
+}
+
+/** Get the key an iterator points at */
+static inline uint64_t
+rb_btree_iter_key(struct rb_btree_iter it)
+{
+    return it.node->keys[it.index];
+}
+
+/** Get the value an iterator points at */
+static inline void *
+rb_btree_iter_value(struct rb_btree_iter it)
+{
+    return it.node->u.leaf.values[it.index];
+}
+
+/** Set the value an iterator points at */
+static inline void
+rb_btree_iter_set_value(struct rb_btree_iter it, void *value)
+{
+    it.node->u.leaf.values[it.index] = value;
+}
+
+/** Count the keys in a node which are less than or equal to key
+ *
+ * This looks at every key in the node instead of branching on each one.
+ * The node is small enough that this is as fast as a binary search and
+ * the compiler can vectorize it.
+ */
+static inline unsigned
+rb_btree_node_rank_le(const struct rb_btree_node *n, uint64_t key)
+{
+    unsigned rank = 0;
+    for (unsigned i = 0; i < n->count; i++)
+        rank += n->keys[i] <= key;
+    return rank;
+}
+
+/** Count the keys in a node which are less than key */
+static inline unsigned
+rb_btree_node_rank_lt(const struct rb_btree_node *n, uint64_t key)
+{
+    unsigned rank = 0;
+    for (unsigned i = 0; i < n->count; i++)
+        rank += n->keys[i] < key;
+    return rank;
+}
+
+/** Find the leaf which would hold a key */
+static inline struct rb_btree_node *
+rb_btree_find_leaf(const struct rb_btree *T, uint64_t key)
+{
+    struct rb_btree_node *n = T->root;
+    while (n != NULL && !n->leaf)
+        n = n->u.children[rb_btree_node_rank_le(n, key)];
+    return n;
+}
+
+/** Insert a key into a B+-tree
+ *
+ * If \p key is already in the tree, its value is replaced.
+ *
+ * \param   T       The B+-tree into which to insert the key
+ *
+ * \param   key     The key to insert
+ *
+ * \param   value   The value to associate with \p key
+ *
+ * \return  True on success, false if memory could not be allocated in
+ *          which case the tree is not modified
+ */
+bool rb_btree_insert(struct rb_btree *T, uint64_t key, void *value);
+
+/** Remove a key from a B+-tree
+ *
+ * \param   T       The B+-tree from which to remove the key
+ *
+ * \param   key     The key to remove
+ *
+ * \return  True if \p key was removed, false if it wasn't in the tree
+ */
+bool rb_btree_remove(struct rb_btree *T, uint64_t key);
+
+/** Search a B+-tree for a key
+ *
+ * Returns the position of \p key or an invalid iterator if \p key isn't
+ * in the tree.
+ *
+ * \param   T       The B+-tree to search
+ *
+ * \param   key     The key to search for
+ */
+static inline struct rb_btree_iter
+rb_btree_search(const struct rb_btree *T, uint64_t key)
+{
+    struct rb_btree_iter it = { NULL, 0 };
+    struct rb_btree_node *leaf = rb_btree_find_leaf(T, key);
+    if (leaf != NULL) {
+        unsigned i = rb_btree_node_rank_lt(leaf, key);
+        if (i < leaf->count && leaf->keys[i] == key) {
+            it.node = leaf;
+            it.index = i;
+        }
+    }
+    return it;
+}
+
+/** Find the first element whose key is not less than a key
+ *
+ * Returns an invalid iterator if every key is less than \p key.
+ *
+ * \param   T       The B+-tree to search
+ *
+ * \param   key     The key to search for
+ */
+static inline struct rb_btree_iter
+rb_btree_lower_bound(const struct rb_btree *T, uint64_t key)
+{
+    struct rb_btree_iter it = { NULL, 0 };
+    struct rb_btree_node *leaf = rb_btree_find_leaf(T, key);
+    if (leaf != NULL) {
+        unsigned i = rb_btree_node_rank_lt(leaf, key);
+        if (i < leaf->count) {
+            it.node = leaf;
+            it.index = i;
+        } else if (leaf->u.leaf.next != NULL) {
+            /* Leaves other than the root are never empty */
+            it.node = leaf->u.leaf.next;
+            it.index = 0;
+        }
+    }
+    return it;
+}
+
+/** Sloppily search a B+-tree for a key
+ *
+ * If \p key is in the tree, its position is returned.  Otherwise, the
+ * position of one of the keys on either side of where \p key would be is
+ * returned.  If the tree is empty, an invalid iterator is returned.
+ *
+ * \param   T       The B+-tree to search
+ *
+ * \param   key     The key to search for
+ */
+static inline struct rb_btree_iter
+rb_btree_search_sloppy(const struct rb_btree *T, uint64_t key)
+{
+    struct rb_btree_iter it = { NULL, 0 };
+    struct rb_btree_node *leaf = rb_btree_find_leaf(T, key);
+    if (leaf != NULL && leaf->count > 0) {
+        unsigned i = rb_btree_node_rank_lt(leaf, key);
+        it.node = leaf;
+        it.index = i < leaf->count ? i : leaf->count - 1u;
+    }
+    return it;
+}
+
+/** Get the position of the first (smallest) key or an invalid iterator */
+struct rb_btree_iter rb_btree_first(const struct rb_btree *T);
+
+/** Get the position of the last (largest) key or an invalid iterator */
+struct rb_btree_iter rb_btree_last(const struct rb_btree *T);
+
+/** Get the next position (to the right) or an invalid iterator */
+static inline struct rb_btree_iter
+rb_btree_next(struct rb_btree_iter it)
+{
+    if (it.index + 1 < it.node->count) {
+        it.index++;
+    } else {
+        it.node = it.node->u.leaf.next;
+        it.index = 0;
+    }
+    return it;
+}
+
+/** Get the previous position (to the left) or an invalid iterator */
+static inline struct rb_btree_iter
+rb_btree_prev(struct rb_btree_iter it)
+{
+    if (it.index > 0) {
+        it.index--;
+    } else {
+        it.node = it.node->u.leaf.prev;
+        it.index = it.node ? it.node->count - 1 : 0;
+    }
+    return it;
+}
+
+/** Iterate over the elements of a B+-tree in order
+ *
+ * \param   T       The B+-tree
+ *
+ * \param   it      The variable name for the current position; this will
+ *                  be declared as a struct rb_btree_iter
+ */
+#define rb_btree_foreach(T, it) \
+   for (struct rb_btree_iter it = rb_btree_first(T); \
+        rb_btree_iter_valid(it); it = rb_btree_next(it))
+
+/** Iterate over the elements of a B+-tree in reverse order
+ *
+ * \param   T       The B+-tree
+ *
+ * \param   it      The variable name for the current position; this will
+ *                  be declared as a struct rb_btree_iter
+ */
+#define rb_btree_foreach_rev(T, it) \
+   for (struct rb_btree_iter it = rb_btree_last(T); \
+        rb_btree_iter_valid(it); it = rb_btree_prev(it))
+
+/** Validate a B+-tree
+ *
+ * This function walks the tree and validates that this is a valid B+-tree.
+ * If anything is wrong, it will assert-fail.
+ */
+void rb_btree_validate(const struct rb_btree *T);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RB_BTREE_H */
@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* For posix_memalign */
+#define _POSIX_C_SOURCE 200112L
+
+#include "rb_frozen_tree.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#define B RB_FROZEN_TREE_BLOCK_SIZE
+
+/* Keys are stored with their top bit flipped so that signed comparisons,
+ * which are all SSE and AVX have for 64-bit integers, order them the same
+ * way as unsigned comparisons of the original keys.
+ */
+static inline int64_t
+rb_frozen_key(uint64_t key)
+{
+    return (int64_t)(key ^ (UINT64_C(1) << 63));
+}
+
+/* Returns the number of keys in a block which are less than x */
+static inline unsigned
+rb_frozen_block_rank(const int64_t *keys, int64_t x)
+{
+#if defined(__AVX2__)
+    __m256i xv = _mm256_set1_epi64x(x);
+    __m256i lo = _mm256_cmpgt_epi64(xv, _mm256_load_si256((const __m256i *)keys));
+    __m256i hi = _mm256_cmpgt_epi64(xv, _mm256_load_si256((const __m256i *)keys + 1));
+    unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+                    _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+    return __builtin_popcount(mask);
+#elif defined(__SSE4_2__)
+    __m128i xv = _mm_set1_epi64x(x);
+    unsigned mask = 0;
+    for (unsigned i = 0; i < B / 2; i++) {
+        __m128i k = _mm_load_si128((const __m128i *)keys + i);
+        __m128i c = _mm_cmpgt_epi64(xv, k);
+        mask |= _mm_movemask_pd(_mm_castsi128_pd(c)) << (2 * i);
+    }
+    return __builtin_popcount(mask);
+#else
+    unsigned rank = 0;
+    for (unsigned i = 0; i < B; i++)
+        rank += keys[i] < x;
+    return rank;
+#endif
+}
+
+/* Returns the first slot whose key is not less than key or SIZE_MAX */
+static inline size_t
+rb_frozen_tree_lower_bound_slot(const struct rb_frozen_tree *F, uint64_t key)
+{
+    const int64_t x = rb_frozen_key(key);
+    size_t slot = SIZE_MAX;
+    size_t k = 0;
+    while (k < F->num_blocks) {
+        unsigned i = rb_frozen_block_rank(&F->keys[k * B], x);
+
+        /* If every key in the block is less than x, the answer is the one
+         * we found a level up.  Otherwise, it's this key or one in the
+         * subtree to its left, which we visit next.
+         */
+        slot = i < B ? k * B + i : slot;
+        k = k * (B + 1) + i + 1;
+    }
+    return slot;
+}
+
+struct rb_node *
+rb_frozen_tree_lower_bound(const struct rb_frozen_tree *F, uint64_t key)
+{
+    size_t slot = rb_frozen_tree_lower_bound_slot(F, key);
+    return slot == SIZE_MAX ? NULL : F->nodes[slot];
+}
+
+struct rb_node *
+rb_frozen_tree_upper_bound(const struct rb_frozen_tree *F, uint64_t key)
+{
+    if (key == UINT64_MAX)
+        return NULL;
+
+    return rb_frozen_tree_lower_bound(F, key + 1);
+}
+
+struct rb_node *
+rb_frozen_tree_search(const struct rb_frozen_tree *F, uint64_t key)
+{
+    size_t slot = rb_frozen_tree_lower_bound_slot(F, key);
+    if (slot == SIZE_MAX || F->keys[slot] != rb_frozen_key(key))
+        return NULL;
+
+    /* Padding has the largest possible key but no node */
+    return F->nodes[slot];
+}
+
+struct rb_freeze_state {
+    struct rb_frozen_tree *F;
+    struct rb_node *next;
+    uint64_t (*key)(const struct rb_node *);
+};
+
+/* Fill in block k and all of its descendants in order */
+static void
+rb_frozen_tree_fill(struct rb_freeze_state *s, size_t k)
+{
+    struct rb_frozen_tree *F = s->F;
+    if (k >= F->num_blocks)
+        return;
+
+    for (unsigned i = 0; i <= B; i++) {
+        rb_frozen_tree_fill(s, k * (B + 1) + i + 1);
+        if (i == B)
+            break;
+
+        size_t slot = k * B + i;
+        if (s->next) {
+            F->keys[slot] = rb_frozen_key(s->key(s->next));
+            F->nodes[slot] = s->next;
+            s->next = rb_node_next(s->next);
+        } else {
+            F->keys[slot] = INT64_MAX;
+            F->nodes[slot] = NULL;
+        }
+    }
+}
+
+bool
+rb_tree_freeze(struct rb_frozen_tree *F, struct rb_tree *T,
+               uint64_t (*key)(const struct rb_node *))
+{
+    size_t count = 0;
+    for (struct rb_node *n = rb_tree_first(T); n; n = rb_node_next(n))
+        count++;
+
+    F->count = count;
+    F->num_blocks = (count + B - 1) / B;
+    F->keys = NULL;
+    F->nodes = NULL;
+    if (count == 0)
+        return true;
+
+    void *keys;
+    if (posix_memalign(&keys, B * sizeof(int64_t),
+                       F->num_blocks * B * sizeof(int64_t)) != 0)
+        return false;
+
+    F->keys = keys;
+    F->nodes = malloc(F->num_blocks * B * sizeof(*F->nodes));
+    if (F->nodes == NULL) {
+        free(F->keys);
+        F->keys = NULL;
+        return false;
+    }
+
+    struct rb_freeze_state s = {
+        .F = F,
+        .next = rb_tree_first(T),
+        .key = key,
+    };
+    rb_frozen_tree_fill(&s, 0);
+    assert(s.next == NULL);
+
+    return true;
+}
+
+void
+rb_frozen_tree_finish(struct rb_frozen_tree *F)
+{
+    free(F->keys);
+    free(F->nodes);
+    F->keys = NULL;
+    F->nodes = NULL;
+    F->count = 0;
+    F->num_blocks = 0;
+}
+
+static void
+rb_frozen_tree_validate_block(struct rb_freeze_state *s, size_t k)
+{
+    const struct rb_frozen_tree *F = s->F;
+    if (k >= F->num_blocks)
+        return;
+
+    for (unsigned i = 0; i <= B; i++) {
+        rb_frozen_tree_validate_block(s, k * (B + 1) + i + 1);
+        if (i == B)
+            break;
+
+        assert(F->nodes[k * B + i] == s->next);
+        if (s->next) {
+            assert(F->keys[k * B + i] == rb_frozen_key(s->key(s->next)));
+            s->next = rb_node_next(s->next);
+        } else {
+            assert(F->keys[k * B + i] == INT64_MAX);
+        }
+    }
+}
+
+void
+rb_frozen_tree_validate(const struct rb_frozen_tree *F, struct rb_tree *T,
+                        uint64_t (*key)(const struct rb_node *))
+{
+    assert(F->num_blocks == (F->count + B - 1) / B);
+    assert(((uintptr_t)F->keys & (B * sizeof(int64_t) - 1)) == 0);
+
+    uint64_t prev_key = 0;
+    size_t count = 0;
+    for (struct rb_node *n = rb_tree_first(T); n; n = rb_node_next(n)) {
+        uint64_t k = key(n);
+        assert(count == 0 || prev_key <= k);
+        prev_key = k;
+        count++;
+    }
+    (void)prev_key;
+    assert(count == F->count);
+
+    struct rb_freeze_state s = {
+        .F = (struct rb_frozen_tree *)F,
+        .next = rb_tree_first(T),
+        .key = key,
+    };
+    rb_frozen_tree_validate_block(&s, 0);
+    assert(s.next == NULL);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_FROZEN_TREE_H
+#define RB_FROZEN_TREE_H
+
+/** \file rb_frozen_tree.h
+ *
+ * Read-only search indices for red-black trees
+ *
+ * Many trees are built once and then only searched.  Freezing such a tree
+ * copies its keys into an implicit search tree laid out in one array
+ * which, unlike the red-black tree, needs no pointers to walk.  The array
+ * is split into blocks of RB_FROZEN_TREE_BLOCK_SIZE keys, each of which
+ * fills one cache line.  Each block acts as a node of a B-tree with
+ * RB_FROZEN_TREE_BLOCK_SIZE + 1 children, and block k's children are the
+ * blocks from k * (RB_FROZEN_TREE_BLOCK_SIZE + 1) + 1 on.  A search
+ * touches one cache line per level, compares all of a block's keys at once
+ * with SIMD instructions when they are available and takes no
+ * data-dependent branches.
+ *
+ * Frozen trees only handle integer keys: every node must have a uint64_t
+ * key, as returned by a callback, and the order of the keys must match
+ * the order of the tree.  The index refers to the tree's nodes but does
+ * not track later changes to the tree.  If the tree is modified, it has to
+ * be frozen again.
+ */
+
+#include "rb_tree.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The number of keys in each block of a frozen tree */
+#define RB_FROZEN_TREE_BLOCK_SIZE 8
+
+/** A frozen tree */
+struct rb_frozen_tree {
+    /** The keys, with their top bits flipped, and padded to a whole
+     * number of blocks
+     */
+    int64_t *keys;
+
+    /** The node for each key in keys */
+    struct rb_node **nodes;
+
+    size_t count;
+    size_t num_blocks;
+};
+
+/** Build a frozen index of a red-black tree
+ *
+ * \param   F       The frozen tree to initialize
+ *
+ * \param   T       The red-black tree to freeze
+ *
+ * \param   key     A callback which returns the key of a node.  Keys must
+ *                  not decrease from one node of \p T to the next.
+ *
+ * \return  True on success, false if memory could not be allocated
+ */
+bool rb_tree_freeze(struct rb_frozen_tree *F, struct rb_tree *T,
+                    uint64_t (*key)(const struct rb_node *));
+
+/** Free the memory used by a frozen tree
+ *
+ * The nodes of the red-black tree are not touched.
+ */
+void rb_frozen_tree_finish(struct rb_frozen_tree *F);
+
+/** Search a frozen tree for a node
+ *
+ * If a node with a matching key exists, the first such node in the order
+ * of the tree is returned.  Otherwise NULL is returned.
+ *
+ * \param   F       The frozen tree to search
+ *
+ * \param   key     The key to search for
+ */
+struct rb_node *rb_frozen_tree_search(const struct rb_frozen_tree *F,
+                                      uint64_t key);
+
+/** Get the first node whose key is not less than a key or NULL */
+struct rb_node *rb_frozen_tree_lower_bound(const struct rb_frozen_tree *F,
+                                           uint64_t key);
+
+/** Get the first node whose key is greater than a key or NULL */
+struct rb_node *rb_frozen_tree_upper_bound(const struct rb_frozen_tree *F,
+                                           uint64_t key);
+
+/** Validate a frozen tree
+ *
+ * This function walks the frozen tree and checks that it is a valid index
+ * of \p T, which must not have changed since it was frozen.  If anything
+ * is wrong, it will assert-fail.
+ */
+void rb_frozen_tree_validate(const struct rb_frozen_tree *F,
+                             struct rb_tree *T,
+                             uint64_t (*key)(const struct rb_node *));
+
+#endif /* RB_FROZEN_TREE_H */
@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_interval_tree.h"
+#include "rb_tree_augmented.h"
+
+/** \file rb_interval_tree.c
+ *
+ * An interval tree built on top of the augmented red-black tree
+ *
+ * This is the augmented tree described in section 14.3 of "Introduction
+ * to Algorithms".  The overlap search is arranged so that it finds the
+ * left-most overlapping interval first and each subsequent overlap in
+ * order, which is what makes iteration O(log n + k) rather than
+ * O(k log n).
+ */
+
+#include <assert.h>
+
+static struct rb_interval_node *
+rb_interval_node(struct rb_node *n)
+{
+    return rb_node_data(struct rb_interval_node, n, node);
+}
+
+static uint64_t
+rb_interval_node_compute_last(struct rb_interval_node *n)
+{
+    uint64_t last = n->last;
+    if (n->node.left && rb_interval_node(n->node.left)->subtree_last > last)
+        last = rb_interval_node(n->node.left)->subtree_last;
+    if (n->node.right && rb_interval_node(n->node.right)->subtree_last > last)
+        last = rb_interval_node(n->node.right)->subtree_last;
+    return last;
+}
+
+RB_DECLARE_CALLBACKS(static, rb_interval_callbacks, struct rb_interval_node,
+                     node, uint64_t, subtree_last,
+                     rb_interval_node_compute_last);
+
+void
+rb_interval_tree_insert(struct rb_tree *T, struct rb_interval_node *node)
+{
+    assert(node->start <= node->last);
+
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    bool left = false;
+    while (x != NULL) {
+        y = x;
+        left = node->start < rb_interval_node(x)->start;
+        if (left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+
+    rb_tree_insert_at_augmented(T, y, &node->node, left,
+                                &rb_interval_callbacks);
+}
+
+void
+rb_interval_tree_remove(struct rb_tree *T, struct rb_interval_node *node)
+{
+    rb_tree_remove_augmented(T, &node->node, &rb_interval_callbacks);
+}
+
+/**
+ * Find the left-most interval in the subtree rooted at n which overlaps
+ * [start, last]
+ *
+ * The caller must ensure that start <= n->subtree_last.
+ */
+static struct rb_interval_node *
+rb_interval_subtree_search(struct rb_interval_node *n,
+                           uint64_t start, uint64_t last)
+{
+    while (true) {
+        /* If anything in the left subtree ends at or after start then
+         * that's where the left-most overlap is, if there is one.
+         * Everything in the left subtree starts no later than n does so,
+         * if none of them overlap, n and its right subtree can't either.
+         */
+        if (n->node.left) {
+            struct rb_interval_node *left = rb_interval_node(n->node.left);
+            if (start <= left->subtree_last) {
+                n = left;
+                continue;
+            }
+        }
+
+        if (n->start > last)
+            return NULL;
+
+        if (start <= n->last)
+            return n;
+
+        if (n->node.right == NULL)
+            return NULL;
+
+        n = rb_interval_node(n->node.right);
+        if (start > n->subtree_last)
+            return NULL;
+    }
+}
+
+struct rb_interval_node *
+rb_interval_tree_iter_first(struct rb_tree *T, uint64_t start, uint64_t last)
+{
+    if (T->root == NULL)
+        return NULL;
+
+    struct rb_interval_node *root = rb_interval_node(T->root);
+    if (start > root->subtree_last)
+        return NULL;
+
+    return rb_interval_subtree_search(root, start, last);
+}
+
+struct rb_interval_node *
+rb_interval_tree_iter_next(struct rb_interval_node *node,
+                           uint64_t start, uint64_t last)
+{
+    struct rb_node *right = node->node.right;
+    while (true) {
+        /* Everything in the right subtree comes after node */
+        if (right) {
+            struct rb_interval_node *r = rb_interval_node(right);
+            if (start <= r->subtree_last)
+                return rb_interval_subtree_search(r, start, last);
+        }
+
+        /* Crawl back up until we come up from a left child.  That parent
+         * is the next node in order.
+         */
+        struct rb_node *prev;
+        do {
+            struct rb_node *p = rb_node_parent(&node->node);
+            if (p == NULL)
+                return NULL;
+            prev = &node->node;
+            node = rb_interval_node(p);
+            right = node->node.right;
+        } while (prev == right);
+
+        /* Everything from here on starts after the range */
+        if (node->start > last)
+            return NULL;
+
+        if (start <= node->last)
+            return node;
+    }
+}
+
+static void
+validate_rb_interval_node(struct rb_interval_node *n)
+{
+    if (n->node.left) {
+        struct rb_interval_node *left = rb_interval_node(n->node.left);
+        assert(left->start <= n->start);
+        validate_rb_interval_node(left);
+    }
+    if (n->node.right) {
+        struct rb_interval_node *right = rb_interval_node(n->node.right);
+        assert(right->start >= n->start);
+        validate_rb_interval_node(right);
+    }
+
+    assert(n->start <= n->last);
+    assert(n->subtree_last == rb_interval_node_compute_last(n));
+}
+
+void
+rb_interval_tree_validate(struct rb_tree *T)
+{
+    rb_tree_validate(T);
+
+    if (T->root)
+        validate_rb_interval_node(rb_interval_node(T->root));
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_INTERVAL_TREE_H
+#define RB_INTERVAL_TREE_H
+
+#include "rb_tree.h"
+
+/** An interval tree node
+ *
+ * An interval tree is a red-black tree of closed intervals [start, last]
+ * sorted by start.  Each node also tracks the largest value of last in its
+ * subtree which lets overlap queries skip entire subtrees, so finding all
+ * k intervals which overlap a given range takes O(log n + k) time.
+ *
+ * Interval trees must only be modified with rb_interval_tree_insert and
+ * rb_interval_tree_remove.  Regular iteration works as usual on the
+ * embedded rb_node.
+ */
+struct rb_interval_node {
+    struct rb_node node;
+
+    /** The first value in the interval */
+    uint64_t start;
+
+    /** The last value in the interval (inclusive) */
+    uint64_t last;
+
+    /** The largest value of last in the subtree rooted at this node */
+    uint64_t subtree_last;
+};
+
+/** Insert a node into an interval tree
+ *
+ * The start and last fields of \p node must be filled out before calling
+ * this function.  Intervals with the same start are kept in the order in
+ * which they are inserted.
+ *
+ * \param   T       The interval tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ */
+void rb_interval_tree_insert(struct rb_tree *T,
+                             struct rb_interval_node *node);
+
+/** Remove a node from an interval tree
+ *
+ * \param   T       The interval tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_interval_tree_remove(struct rb_tree *T,
+                             struct rb_interval_node *node);
+
+/** Get the first interval overlapping a range or NULL
+ *
+ * Returns the interval with the lowest start which overlaps the closed
+ * range [start, last].  A stabbing query for a single point p is just
+ * the range [p, p].
+ *
+ * \param   T       The interval tree to search
+ *
+ * \param   start   The first value in the range
+ *
+ * \param   last    The last value in the range (inclusive)
+ */
+struct rb_interval_node *
+rb_interval_tree_iter_first(struct rb_tree *T, uint64_t start, uint64_t last);
+
+/** Get the next interval overlapping a range or NULL
+ *
+ * \param   node    The previous interval returned by
+ *                  rb_interval_tree_iter_first or
+ *                  rb_interval_tree_iter_next for the same range
+ *
+ * \param   start   The first value in the range
+ *
+ * \param   last    The last value in the range (inclusive)
+ */
+struct rb_interval_node *
+rb_interval_tree_iter_next(struct rb_interval_node *node,
+                           uint64_t start, uint64_t last);
+
+/** Validate an interval tree
+ *
+ * This does everything rb_tree_validate does and also checks that the
+ * nodes are sorted by start and that subtree_last is correct everywhere.
+ */
+void rb_interval_tree_validate(struct rb_tree *T);
+
+#endif /* RB_INTERVAL_TREE_H */
@@ -0,0 +1,321 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_LATCH_TREE_H
+#define RB_LATCH_TREE_H
+
+/** \file rb_latch_tree.h
+ *
+ * Red-black trees with lock-free lookups
+ *
+ * A latch tree keeps two copies of the tree, each element being linked
+ * into both through a pair of rb_nodes, and a sequence counter.  The
+ * writer modifies one copy at a time, bumping the sequence counter before
+ * each, while readers search whichever copy the low bit of the counter
+ * says isn't being modified.  A reader which finds that the counter
+ * changed while it was searching just tries again.  This is the same
+ * scheme as the latch_tree in the Linux kernel.
+ *
+ * Readers never write to shared memory, so lookups scale with the number
+ * of threads, but there are a few rules:
+ *
+ *  - Writers must be serialized by the caller, for instance with a mutex.
+ *    Writers may use rb_latch_tree_first and friends to walk the tree.
+ *
+ *  - An element which has been removed may still be looked at by readers
+ *    which started before the removal.  It must not be freed or re-used
+ *    until all such readers are done, using RCU, epochs or some other
+ *    scheme.
+ *
+ *  - The comparison functions may be called on elements in the middle of
+ *    being inserted or removed and must cope with that, which is usually
+ *    just a matter of the keys being immutable while an element is in the
+ *    tree.
+ *
+ * A reader which started before the writer switched copies may still be
+ * walking the copy being modified.  It will throw away whatever it finds
+ * but it must not crash or get lost in the meantime so, like the kernel's
+ * RCU-safe trees, new nodes are fully initialized before a release store
+ * links them in and every link is read and written atomically.  Readers
+ * also bound the length of each search so that they can't get stuck going
+ * around a rotation in progress.
+ */
+
+#include "rb_tree_augmented.h"
+
+/** The longest path a reader will follow before starting over
+ *
+ * A red-black tree can't be deeper than twice the number of bits in a
+ * pointer.  A reader going further than this must be in a copy of the tree
+ * which is being modified.
+ */
+#define RB_LATCH_TREE_MAX_DEPTH (2 * 8 * sizeof(void *))
+
+/** A node in a latch tree */
+struct rb_latch_node {
+    struct rb_node node[2];
+};
+
+/** A latch tree */
+struct rb_latch_tree {
+    /** The sequence counter; the low bit selects the tree readers use */
+    unsigned seq;
+
+    struct rb_tree tree[2];
+};
+
+/** Retrieve the latch node containing one of its two rb_nodes */
+static inline struct rb_latch_node *
+rb_latch_node_from_rb(const struct rb_node *n, unsigned idx)
+{
+    return (struct rb_latch_node *)(n - idx);
+}
+
+/** Initialize a latch tree */
+static inline void
+rb_latch_tree_init(struct rb_latch_tree *T)
+{
+    T->seq = 0;
+    rb_tree_init(&T->tree[0]);
+    rb_tree_init(&T->tree[1]);
+}
+
+/* Switch readers over to the other copy of the tree
+ *
+ * The release fences make sure that a reader which sees any of the
+ * changes made after this has also seen the new sequence number, and
+ * that one which sees the new sequence number also sees all of the
+ * changes made to the copy it's switching to.
+ */
+static inline void
+rb_latch_tree_write_latch(struct rb_latch_tree *T)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&T->seq, T->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Link a node into one copy of the tree
+ *
+ * This is rb_tree_insert_at except that the node is published with a
+ * release store so that a reader which finds it also sees its null
+ * children rather than whatever was in memory before.  Rotations done by
+ * the fixup only move nodes which readers could already see.
+ */
+static inline void
+rb_latch_tree_link_idx(struct rb_tree *T, struct rb_node *parent,
+                       struct rb_node *node, bool insert_left)
+{
+    RB_TREE_STAT_INC(inserts);
+
+    /* This sets null children, parent, and a color of red */
+    memset(node, 0, sizeof(*node));
+    rb_node_set_parent(node, parent);
+
+    struct rb_node **link;
+    if (parent == NULL)
+        link = &T->root;
+    else if (insert_left)
+        link = &parent->left;
+    else
+        link = &parent->right;
+    assert(*link == NULL);
+    __atomic_store_n(link, node, __ATOMIC_RELEASE);
+
+    rb_tree_insert_fixup(T, node, NULL);
+    rb_node_set_black(T->root);
+}
+
+static inline void
+rb_latch_tree_insert_idx(struct rb_latch_tree *T,
+                         struct rb_latch_node *node, unsigned idx,
+                         int (*cmp)(const struct rb_latch_node *,
+                                    const struct rb_latch_node *))
+{
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->tree[idx].root;
+    bool left = false;
+    while (x != NULL) {
+        y = x;
+        left = cmp(rb_latch_node_from_rb(x, idx), node) < 0;
+        if (left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+
+    rb_latch_tree_link_idx(&T->tree[idx], y, &node->node[idx], left);
+}
+
+/** Insert a node into a latch tree
+ *
+ * Writers must be serialized by the caller.
+ *
+ * \param   T       The latch tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_latch_tree_insert(struct rb_latch_tree *T, struct rb_latch_node *node,
+                     int (*cmp)(const struct rb_latch_node *,
+                                const struct rb_latch_node *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    rb_latch_tree_write_latch(T);
+    rb_latch_tree_insert_idx(T, node, 0, cmp);
+    rb_latch_tree_write_latch(T);
+    rb_latch_tree_insert_idx(T, node, 1, cmp);
+}
+
+/** Remove a node from a latch tree
+ *
+ * Writers must be serialized by the caller.  Readers may still be looking
+ * at \p node after this returns.
+ *
+ * \param   T       The latch tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+static inline void
+rb_latch_tree_remove(struct rb_latch_tree *T, struct rb_latch_node *node)
+{
+    rb_latch_tree_write_latch(T);
+    rb_tree_remove(&T->tree[0], &node->node[0]);
+    rb_latch_tree_write_latch(T);
+    rb_tree_remove(&T->tree[1], &node->node[1]);
+}
+
+/* Search one copy of the tree, returning false if it looks like it's
+ * being modified underneath us.
+ */
+static inline bool
+rb_latch_tree_search_idx(struct rb_latch_tree *T, unsigned idx,
+                         const void *key,
+                         int (*cmp)(const struct rb_latch_node *,
+                                    const void *),
+                         struct rb_latch_node **found)
+{
+    /* Consume pairs with the release store which published each node, as
+     * with the kernel's rcu_dereference.  Compilers implement it as
+     * acquire, which is a plain load on x86.
+     */
+    struct rb_node *x = __atomic_load_n(&T->tree[idx].root, __ATOMIC_CONSUME);
+    for (unsigned depth = 0; x != NULL; depth++) {
+        if (depth >= RB_LATCH_TREE_MAX_DEPTH)
+            return false;
+
+        int c = cmp(rb_latch_node_from_rb(x, idx), key);
+        if (c < 0)
+            x = __atomic_load_n(&x->left, __ATOMIC_CONSUME);
+        else if (c > 0)
+            x = __atomic_load_n(&x->right, __ATOMIC_CONSUME);
+        else
+            break;
+    }
+
+    *found = x ? rb_latch_node_from_rb(x, idx) : NULL;
+    return true;
+}
+
+/** Search a latch tree for a node
+ *
+ * This may be called concurrently with other searches and with a writer.
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.
+ *
+ * \param   T       The latch tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline struct rb_latch_node *
+rb_latch_tree_search(struct rb_latch_tree *T, const void *key,
+                     int (*cmp)(const struct rb_latch_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_latch_node *node;
+    unsigned seq;
+    bool complete;
+    do {
+        seq = __atomic_load_n(&T->seq, __ATOMIC_ACQUIRE);
+        complete = rb_latch_tree_search_idx(T, seq & 1, key, cmp, &node);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (!complete || __atomic_load_n(&T->seq, __ATOMIC_RELAXED) != seq);
+
+    return node;
+}
+
+/** Get the first (left-most) node in a latch tree or NULL
+ *
+ * This and the other iteration functions must only be called by a writer.
+ */
+static inline struct rb_latch_node *
+rb_latch_tree_first(struct rb_latch_tree *T)
+{
+    struct rb_node *n = rb_tree_first(&T->tree[0]);
+    return n ? rb_latch_node_from_rb(n, 0) : NULL;
+}
+
+/** Get the last (right-most) node in a latch tree or NULL */
+static inline struct rb_latch_node *
+rb_latch_tree_last(struct rb_latch_tree *T)
+{
+    struct rb_node *n = rb_tree_last(&T->tree[0]);
+    return n ? rb_latch_node_from_rb(n, 0) : NULL;
+}
+
+/** Get the next node (to the right) in a latch tree or NULL */
+static inline struct rb_latch_node *
+rb_latch_node_next(struct rb_latch_node *node)
+{
+    struct rb_node *n = rb_node_next(&node->node[0]);
+    return n ? rb_latch_node_from_rb(n, 0) : NULL;
+}
+
+/** Get the previous node (to the left) in a latch tree or NULL */
+static inline struct rb_latch_node *
+rb_latch_node_prev(struct rb_latch_node *node)
+{
+    struct rb_node *n = rb_node_prev(&node->node[0]);
+    return n ? rb_latch_node_from_rb(n, 0) : NULL;
+}
+
+/** Validate a latch tree
+ *
+ * This validates both copies of the tree and must only be called by a
+ * writer.
+ */
+static inline void
+rb_latch_tree_validate(struct rb_latch_tree *T)
+{
+    rb_tree_validate(&T->tree[0]);
+    rb_tree_validate(&T->tree[1]);
+}
+
+#endif /* RB_LATCH_TREE_H */
@@ -0,0 +1,148 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* For posix_memalign */
+#define _POSIX_C_SOURCE 200112L
+
+#include "rb_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct rb_pool_slab {
+    struct rb_pool_slab *next;
+};
+
+/* The usable part of a slab starts this far into it so that it stays
+ * aligned to RB_POOL_ALIGN.  Slabs themselves are allocated with that
+ * alignment.
+ */
+#define RB_POOL_SLAB_HEADER_SIZE \
+    ((sizeof(struct rb_pool_slab) + RB_POOL_ALIGN - 1) & ~(RB_POOL_ALIGN - 1))
+
+struct rb_pool_free_entry {
+    struct rb_pool_free_entry *next;
+};
+
+static inline unsigned
+rb_pool_size_class(size_t size)
+{
+    assert(size > 0 && size <= RB_POOL_MAX_SIZE);
+    return (size - 1) / RB_POOL_ALIGN;
+}
+
+static void
+rb_pool_use_slab(struct rb_pool *pool, struct rb_pool_slab *slab)
+{
+    pool->slab = slab;
+    pool->next = (char *)slab + RB_POOL_SLAB_HEADER_SIZE;
+    pool->end = pool->next + RB_POOL_SLAB_SIZE;
+}
+
+void
+rb_pool_init(struct rb_pool *pool)
+{
+    pool->first_slab = NULL;
+    pool->slab = NULL;
+    pool->next = NULL;
+    pool->end = NULL;
+    for (unsigned i = 0; i < RB_POOL_NUM_SIZE_CLASSES; i++)
+        pool->free_list[i] = NULL;
+}
+
+void
+rb_pool_finish(struct rb_pool *pool)
+{
+    struct rb_pool_slab *slab = pool->first_slab;
+    while (slab) {
+        struct rb_pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+}
+
+void
+rb_pool_reset(struct rb_pool *pool)
+{
+    for (unsigned i = 0; i < RB_POOL_NUM_SIZE_CLASSES; i++)
+        pool->free_list[i] = NULL;
+
+    if (pool->first_slab) {
+        rb_pool_use_slab(pool, pool->first_slab);
+    } else {
+        pool->next = NULL;
+        pool->end = NULL;
+    }
+}
+
+void *
+rb_pool_alloc(struct rb_pool *pool, size_t size)
+{
+    unsigned size_class = rb_pool_size_class(size);
+
+    struct rb_pool_free_entry *entry = pool->free_list[size_class];
+    if (entry) {
+        pool->free_list[size_class] = entry->next;
+        return entry;
+    }
+
+    size_t alloc_size = (size_t)(size_class + 1) * RB_POOL_ALIGN;
+    if ((size_t)(pool->end - pool->next) < alloc_size) {
+        /* Any space left in the current slab is wasted.  It's at most
+         * RB_POOL_MAX_SIZE bytes.
+         */
+        if (pool->slab && pool->slab->next) {
+            /* Re-use a slab left over from before the last reset */
+            rb_pool_use_slab(pool, pool->slab->next);
+        } else {
+            void *mem;
+            if (posix_memalign(&mem, RB_POOL_ALIGN,
+                               RB_POOL_SLAB_HEADER_SIZE +
+                               RB_POOL_SLAB_SIZE) != 0)
+                return NULL;
+
+            struct rb_pool_slab *slab = mem;
+            slab->next = NULL;
+            if (pool->slab)
+                pool->slab->next = slab;
+            else
+                pool->first_slab = slab;
+            rb_pool_use_slab(pool, slab);
+        }
+    }
+
+    void *ptr = pool->next;
+    pool->next += alloc_size;
+    return ptr;
+}
+
+void
+rb_pool_free(struct rb_pool *pool, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+
+    unsigned size_class = rb_pool_size_class(size);
+    struct rb_pool_free_entry *entry = ptr;
+    entry->next = pool->free_list[size_class];
+    pool->free_list[size_class] = entry;
+}
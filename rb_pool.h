@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_POOL_H
+#define RB_POOL_H
+
+/** \file rb_pool.h
+ *
+ * A pool allocator for tree nodes
+ *
+ * Trees which are built up and thrown away as a whole spend much of their
+ * time in malloc and free.  A pool carves the data structures containing
+ * the nodes out of large slabs and keeps a free list for each size class
+ * so that individual frees are cheap to recycle.  Everything in a pool is
+ * released at once with rb_pool_reset or rb_pool_finish, which combined
+ * with rb_tree_init or rb_tree_destroy with a NULL callback, means a tree
+ * can be thrown away without visiting its nodes one at a time in the
+ * allocator.
+ *
+ * A pool isn't thread-safe.
+ */
+
+#include <stddef.h>
+
+/** The granularity and alignment of allocations from a pool */
+#define RB_POOL_ALIGN 16
+
+/** The largest allocation which can be made from a pool */
+#define RB_POOL_MAX_SIZE 512
+
+/** The number of size classes in a pool */
+#define RB_POOL_NUM_SIZE_CLASSES (RB_POOL_MAX_SIZE / RB_POOL_ALIGN)
+
+/** The number of bytes of each slab handed out by a pool */
+#define RB_POOL_SLAB_SIZE (64 * 1024)
+
+struct rb_pool_slab;
+
+/** A pool allocator */
+struct rb_pool {
+    /** The slabs owned by the pool in the order they were allocated */
+    struct rb_pool_slab *first_slab;
+
+    /** The slab new allocations are currently carved out of */
+    struct rb_pool_slab *slab;
+
+    /** The unused part of the current slab */
+    char *next, *end;
+
+    /** Freed allocations for each size class */
+    void *free_list[RB_POOL_NUM_SIZE_CLASSES];
+};
+
+/** Initialize a pool */
+void rb_pool_init(struct rb_pool *pool);
+
+/** Free all of the memory owned by a pool
+ *
+ * Everything allocated from the pool is freed.  The pool must be
+ * re-initialized before it can be used again.
+ */
+void rb_pool_finish(struct rb_pool *pool);
+
+/** Release everything allocated from a pool but keep its slabs
+ *
+ * This takes time proportional to the number of slabs, not the number of
+ * allocations.  The slabs are re-used by later allocations so a pool
+ * reset between building trees of a similar size stops calling malloc
+ * entirely.
+ */
+void rb_pool_reset(struct rb_pool *pool);
+
+/** Allocate memory from a pool
+ *
+ * The returned memory is aligned to RB_POOL_ALIGN.  Returns NULL if
+ * allocating a new slab fails.
+ *
+ * \param   pool    The pool to allocate from
+ *
+ * \param   size    The number of bytes to allocate; this must be between 1
+ *                  and RB_POOL_MAX_SIZE
+ */
+void *rb_pool_alloc(struct rb_pool *pool, size_t size);
+
+/** Return memory to a pool
+ *
+ * \param   pool    The pool \p ptr was allocated from
+ *
+ * \param   ptr     The memory to free or NULL
+ *
+ * \param   size    The size passed to rb_pool_alloc for \p ptr
+ */
+void rb_pool_free(struct rb_pool *pool, void *ptr, size_t size);
+
+#endif /* RB_POOL_H */
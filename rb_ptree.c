@@ -0,0 +1,460 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_ptree.h"
+
+#include <assert.h>
+
+static inline void
+rb_pnode_ref(struct rb_pnode *n)
+{
+    if (n)
+        __atomic_add_fetch(&n->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+rb_pnode_unref(const struct rb_ptree_ops *ops, struct rb_pnode *n)
+{
+    if (n == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&n->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    /* This recurses at most as deep as the tree */
+    rb_pnode_unref(ops, n->left);
+    rb_pnode_unref(ops, n->right);
+    ops->free(n);
+}
+
+static inline bool
+rb_pnode_is_black(const struct rb_pnode *n)
+{
+    /* NULL nodes are leaves and therefore black */
+    return n == NULL || !n->red;
+}
+
+/**
+ * Make the node *link points to safe to modify and return it
+ *
+ * If anything else refers to the node, *link is replaced with a private
+ * copy.  The node containing link, if any, must already be private.
+ */
+static struct rb_pnode *
+rb_pnode_make_mut(const struct rb_ptree_ops *ops, struct rb_pnode **link)
+{
+    struct rb_pnode *n = *link;
+    assert(n != NULL);
+
+    /* If we hold the only reference, nobody else can take a new one */
+    if (__atomic_load_n(&n->refcount, __ATOMIC_ACQUIRE) == 1)
+        return n;
+
+    struct rb_pnode *copy = ops->clone(n);
+    assert(copy != NULL);
+    copy->left = n->left;
+    copy->right = n->right;
+    copy->red = n->red;
+    copy->refcount = 1;
+    rb_pnode_ref(copy->left);
+    rb_pnode_ref(copy->right);
+
+    *link = copy;
+    rb_pnode_unref(ops, n);
+
+    return copy;
+}
+
+/* The link pointing at path[i] */
+static inline struct rb_pnode **
+rb_ptree_path_link(struct rb_ptree *T, struct rb_pnode **path, int i)
+{
+    if (i == 0)
+        return &T->root;
+    else if (path[i - 1]->left == path[i])
+        return &path[i - 1]->left;
+    else
+        return &path[i - 1]->right;
+}
+
+static void
+rb_pnode_rotate_left(struct rb_pnode **link, struct rb_pnode *x)
+{
+    struct rb_pnode *y = x->right;
+    assert(*link == x && y != NULL);
+    x->right = y->left;
+    y->left = x;
+    *link = y;
+}
+
+static void
+rb_pnode_rotate_right(struct rb_pnode **link, struct rb_pnode *y)
+{
+    struct rb_pnode *x = y->left;
+    assert(*link == y && x != NULL);
+    y->left = x->right;
+    x->right = y;
+    *link = x;
+}
+
+void
+rb_ptree_init(struct rb_ptree *T, const struct rb_ptree_ops *ops)
+{
+    T->root = NULL;
+    T->ops = ops;
+}
+
+void
+rb_ptree_finish(struct rb_ptree *T)
+{
+    rb_pnode_unref(T->ops, T->root);
+    T->root = NULL;
+}
+
+void
+rb_ptree_snapshot(const struct rb_ptree *T, struct rb_ptree *S)
+{
+    rb_pnode_ref(T->root);
+    S->root = T->root;
+    S->ops = T->ops;
+}
+
+void
+rb_ptree_insert(struct rb_ptree *T, struct rb_pnode *node,
+                int (*cmp)(const struct rb_pnode *, const struct rb_pnode *))
+{
+    /* Everything on the path from the root to the new node gets a new
+     * child pointer, so make all of it private on the way down.
+     */
+    struct rb_pnode *path[RB_PTREE_MAX_DEPTH + 1];
+    int depth = 0;
+    struct rb_pnode **link = &T->root;
+    while (*link != NULL) {
+        assert(depth < (int)RB_PTREE_MAX_DEPTH);
+        struct rb_pnode *x = rb_pnode_make_mut(T->ops, link);
+        path[depth++] = x;
+        link = cmp(x, node) < 0 ? &x->left : &x->right;
+    }
+
+    node->left = NULL;
+    node->right = NULL;
+    node->refcount = 1;
+    node->red = true;
+    *link = node;
+    path[depth] = node;
+
+    /* Now we do the insertion fixup.  z is path[i] and everything on the
+     * path is private.  Only the uncle may need to be copied.
+     */
+    int i = depth;
+    while (i > 0 && path[i - 1]->red) {
+        struct rb_pnode *z_p = path[i - 1];
+        assert(i >= 2);
+        struct rb_pnode *z_p_p = path[i - 2];
+        if (z_p == z_p_p->left) {
+            if (!rb_pnode_is_black(z_p_p->right)) {
+                struct rb_pnode *y = rb_pnode_make_mut(T->ops, &z_p_p->right);
+                z_p->red = false;
+                y->red = false;
+                z_p_p->red = true;
+                i -= 2;
+            } else {
+                if (path[i] == z_p->right) {
+                    /* Rotating swaps z and its parent on the path */
+                    rb_pnode_rotate_left(&z_p_p->left, z_p);
+                    path[i - 1] = path[i];
+                    path[i] = z_p;
+                    z_p = path[i - 1];
+                }
+                z_p->red = false;
+                z_p_p->red = true;
+                rb_pnode_rotate_right(rb_ptree_path_link(T, path, i - 2),
+                                      z_p_p);
+                break;
+            }
+        } else {
+            if (!rb_pnode_is_black(z_p_p->left)) {
+                struct rb_pnode *y = rb_pnode_make_mut(T->ops, &z_p_p->left);
+                z_p->red = false;
+                y->red = false;
+                z_p_p->red = true;
+                i -= 2;
+            } else {
+                if (path[i] == z_p->left) {
+                    rb_pnode_rotate_right(&z_p_p->right, z_p);
+                    path[i - 1] = path[i];
+                    path[i] = z_p;
+                    z_p = path[i - 1];
+                }
+                z_p->red = false;
+                z_p_p->red = true;
+                rb_pnode_rotate_left(rb_ptree_path_link(T, path, i - 2),
+                                     z_p_p);
+                break;
+            }
+        }
+    }
+    T->root->red = false;
+}
+
+bool
+rb_ptree_remove(struct rb_ptree *T, const void *key,
+                int (*cmp)(const struct rb_pnode *, const void *))
+{
+    /* Don't copy anything unless there's something to remove */
+    if (rb_ptree_search(T, key, cmp) == NULL)
+        return false;
+
+    /* Two extra slots for the nodes rotated in during the fixup */
+    struct rb_pnode *path[RB_PTREE_MAX_DEPTH + 2];
+    int depth = 0;
+    struct rb_pnode **link = &T->root;
+    struct rb_pnode *z;
+    while (true) {
+        assert(*link != NULL && depth < (int)RB_PTREE_MAX_DEPTH);
+        struct rb_pnode *x = rb_pnode_make_mut(T->ops, link);
+        path[depth++] = x;
+        int c = cmp(x, key);
+        if (c < 0) {
+            link = &x->left;
+        } else if (c > 0) {
+            link = &x->right;
+        } else {
+            z = x;
+            break;
+        }
+    }
+
+    /* x_p is path[j], the parent of x.  We have to track this separately
+     * because x may be NULL.
+     */
+    int k = depth - 1;
+    struct rb_pnode *x;
+    int j;
+    bool y_was_black = !z->red;
+    if (z->left == NULL || z->right == NULL) {
+        x = z->left ? z->left : z->right;
+        *link = x;
+        j = k - 1;
+    } else {
+        /* Find the minimum sub-node of z->right, making the way there
+         * private since we're going to change it.
+         */
+        struct rb_pnode *y = rb_pnode_make_mut(T->ops, &z->right);
+        path[depth++] = y;
+        while (y->left != NULL) {
+            assert(depth < (int)RB_PTREE_MAX_DEPTH);
+            y = rb_pnode_make_mut(T->ops, &y->left);
+            path[depth++] = y;
+        }
+        y_was_black = !y->red;
+
+        x = y->right;
+        if (path[depth - 2] == z) {
+            j = k;
+        } else {
+            path[depth - 2]->left = x;
+            y->right = z->right;
+            j = depth - 2;
+        }
+        y->left = z->left;
+        y->red = z->red;
+        *link = y;
+        path[k] = y;
+    }
+
+    /* z's children belong to someone else now */
+    z->left = NULL;
+    z->right = NULL;
+    rb_pnode_unref(T->ops, z);
+
+    if (y_was_black) {
+        /* Fixup RB tree after the delete.  Everything on the path is
+         * private, but the sibling and its children may need to be copied
+         * before we touch them.
+         */
+        while (x != T->root && rb_pnode_is_black(x)) {
+            struct rb_pnode *x_p = path[j];
+            if (x == x_p->left) {
+                struct rb_pnode *w = rb_pnode_make_mut(T->ops, &x_p->right);
+                if (w->red) {
+                    w->red = false;
+                    x_p->red = true;
+                    rb_pnode_rotate_left(rb_ptree_path_link(T, path, j), x_p);
+                    /* w is now between x_p and its old parent */
+                    path[j] = w;
+                    path[++j] = x_p;
+                    w = rb_pnode_make_mut(T->ops, &x_p->right);
+                }
+                if (rb_pnode_is_black(w->left) && rb_pnode_is_black(w->right)) {
+                    w->red = true;
+                    x = x_p;
+                    j--;
+                } else {
+                    if (rb_pnode_is_black(w->right)) {
+                        struct rb_pnode *w_l =
+                            rb_pnode_make_mut(T->ops, &w->left);
+                        w_l->red = false;
+                        w->red = true;
+                        rb_pnode_rotate_right(&x_p->right, w);
+                        w = w_l;
+                    }
+                    w->red = x_p->red;
+                    x_p->red = false;
+                    rb_pnode_make_mut(T->ops, &w->right)->red = false;
+                    rb_pnode_rotate_left(rb_ptree_path_link(T, path, j), x_p);
+                    x = T->root;
+                }
+            } else {
+                struct rb_pnode *w = rb_pnode_make_mut(T->ops, &x_p->left);
+                if (w->red) {
+                    w->red = false;
+                    x_p->red = true;
+                    rb_pnode_rotate_right(rb_ptree_path_link(T, path, j), x_p);
+                    path[j] = w;
+                    path[++j] = x_p;
+                    w = rb_pnode_make_mut(T->ops, &x_p->left);
+                }
+                if (rb_pnode_is_black(w->right) && rb_pnode_is_black(w->left)) {
+                    w->red = true;
+                    x = x_p;
+                    j--;
+                } else {
+                    if (rb_pnode_is_black(w->left)) {
+                        struct rb_pnode *w_r =
+                            rb_pnode_make_mut(T->ops, &w->right);
+                        w_r->red = false;
+                        w->red = true;
+                        rb_pnode_rotate_left(&x_p->left, w);
+                        w = w_r;
+                    }
+                    w->red = x_p->red;
+                    x_p->red = false;
+                    rb_pnode_make_mut(T->ops, &w->left)->red = false;
+                    rb_pnode_rotate_right(rb_ptree_path_link(T, path, j), x_p);
+                    x = T->root;
+                }
+            }
+        }
+
+        if (x != NULL && x->red) {
+            struct rb_pnode **x_link;
+            if (x == T->root)
+                x_link = &T->root;
+            else if (x == path[j]->left)
+                x_link = &path[j]->left;
+            else
+                x_link = &path[j]->right;
+            rb_pnode_make_mut(T->ops, x_link)->red = false;
+        }
+    }
+
+    return true;
+}
+
+static void
+rb_ptree_iter_push_left(struct rb_ptree_iter *iter, struct rb_pnode *n)
+{
+    while (n != NULL) {
+        assert(iter->depth < RB_PTREE_MAX_DEPTH);
+        iter->stack[iter->depth++] = n;
+        n = n->left;
+    }
+}
+
+void
+rb_ptree_iter_init(struct rb_ptree_iter *iter, const struct rb_ptree *T)
+{
+    iter->depth = 0;
+    rb_ptree_iter_push_left(iter, T->root);
+}
+
+void
+rb_ptree_iter_init_lower_bound(struct rb_ptree_iter *iter,
+                               const struct rb_ptree *T, const void *key,
+                               int (*cmp)(const struct rb_pnode *,
+                                          const void *))
+{
+    /* The stack holds exactly the nodes where we went left, which are the
+     * ones still to come after the lower bound.
+     */
+    iter->depth = 0;
+    struct rb_pnode *x = T->root;
+    while (x != NULL) {
+        if (cmp(x, key) <= 0) {
+            assert(iter->depth < RB_PTREE_MAX_DEPTH);
+            iter->stack[iter->depth++] = x;
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+}
+
+struct rb_pnode *
+rb_ptree_iter_next(struct rb_ptree_iter *iter)
+{
+    if (iter->depth == 0)
+        return NULL;
+
+    struct rb_pnode *n = iter->stack[--iter->depth];
+    rb_ptree_iter_push_left(iter, n->right);
+    return n;
+}
+
+static void
+validate_rb_pnode(const struct rb_pnode *n, int black_depth)
+{
+    if (n == NULL) {
+        assert(black_depth == 0);
+        return;
+    }
+
+    assert(n->refcount > 0);
+
+    if (rb_pnode_is_black(n)) {
+        black_depth--;
+    } else {
+        assert(rb_pnode_is_black(n->left));
+        assert(rb_pnode_is_black(n->right));
+    }
+
+    validate_rb_pnode(n->left, black_depth);
+    validate_rb_pnode(n->right, black_depth);
+}
+
+void
+rb_ptree_validate(const struct rb_ptree *T)
+{
+    if (T->root == NULL)
+        return;
+
+    assert(rb_pnode_is_black(T->root));
+
+    unsigned black_depth = 0;
+    for (const struct rb_pnode *n = T->root; n; n = n->left) {
+        if (rb_pnode_is_black(n))
+            black_depth++;
+    }
+
+    validate_rb_pnode(T->root, black_depth);
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_PTREE_H
+#define RB_PTREE_H
+
+/** \file rb_ptree.h
+ *
+ * Persistent red-black trees
+ *
+ * A persistent tree never modifies a node which might be seen by anyone
+ * else.  Insert and remove copy the O(log n) nodes on the path they touch
+ * and leave the originals alone, so taking a snapshot of a tree is just
+ * taking a reference to its root.  Each node is reference counted by the
+ * nodes and trees pointing to it and is freed when the last of them goes
+ * away.  A node which only one tree can reach is modified in place, so a
+ * tree without snapshots isn't copied at all.
+ *
+ * Because a node can be shared by many trees, it can't have a parent
+ * pointer and iteration uses an explicit stack instead.
+ *
+ * Every struct rb_ptree is a separate handle and may only be used by one
+ * thread at a time, but different handles may be used concurrently even
+ * if they share nodes.  In particular, a snapshot may be iterated on one
+ * thread while the tree it was taken from keeps being modified on another.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The deepest a persistent tree can get */
+#define RB_PTREE_MAX_DEPTH (2 * 8 * sizeof(void *))
+
+/** A persistent red-black tree node
+ *
+ * This should be embedded as a field in the data structure being stored
+ * in the tree.
+ */
+struct rb_pnode {
+    struct rb_pnode *left;
+    struct rb_pnode *right;
+
+    /** The number of nodes and trees pointing at this node */
+    unsigned refcount;
+
+    bool red;
+};
+
+/** Callbacks used by a persistent tree to manage its nodes */
+struct rb_ptree_ops {
+    /** Copy the data structure containing a node
+     *
+     * The links, reference count and color of the new node are filled out
+     * by the tree.  This must not fail.
+     */
+    struct rb_pnode *(*clone)(const struct rb_pnode *node);
+
+    /** Free the data structure containing a node
+     *
+     * This is called once nothing refers to the node any more.  The
+     * children of the node have already been released.
+     */
+    void (*free)(struct rb_pnode *node);
+};
+
+/** A persistent red-black tree */
+struct rb_ptree {
+    struct rb_pnode *root;
+    const struct rb_ptree_ops *ops;
+};
+
+/** Retrieve the data structure containing a persistent node
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    A pointer to a rb_pnode
+ *
+ * \param   field   The rb_pnode field in the containing data structure
+ */
+#define rb_pnode_data(type, node, field) \
+    ((type *)(((char *)(node)) - offsetof(type, field)))
+
+/** Initialize a persistent tree
+ *
+ * \param   T       The tree to initialize
+ *
+ * \param   ops     The callbacks used to copy and free nodes
+ */
+void rb_ptree_init(struct rb_ptree *T, const struct rb_ptree_ops *ops);
+
+/** Release a persistent tree
+ *
+ * This drops the tree's reference to its nodes, freeing any which aren't
+ * also part of some other tree.  The tree is left empty.
+ */
+void rb_ptree_finish(struct rb_ptree *T);
+
+/** Take a snapshot of a persistent tree
+ *
+ * After this call, \p S holds the same nodes as \p T and the two can be
+ * modified independently.  This takes O(1) time.  \p S must be released
+ * with rb_ptree_finish when it's no longer needed.
+ *
+ * \param   T       The tree to take a snapshot of
+ *
+ * \param   S       An uninitialized tree which receives the snapshot
+ */
+void rb_ptree_snapshot(const struct rb_ptree *T, struct rb_ptree *S);
+
+/** Returns true if the persistent tree is empty */
+static inline bool
+rb_ptree_is_empty(const struct rb_ptree *T)
+{
+    return T->root == NULL;
+}
+
+/** Insert a node into a persistent tree
+ *
+ * \p node must be newly created and not part of any tree.  The tree takes
+ * ownership of it.
+ *
+ * \param   T       The persistent tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+void rb_ptree_insert(struct rb_ptree *T, struct rb_pnode *node,
+                     int (*cmp)(const struct rb_pnode *,
+                                const struct rb_pnode *));
+
+/** Remove a node with a given key from a persistent tree
+ *
+ * If more than one node matches \p key, the one rb_ptree_search would
+ * return is removed.  Returns false if no node matches \p key.
+ *
+ * \param   T       The persistent tree from which to remove the node
+ *
+ * \param   key     The key of the node to remove
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+bool rb_ptree_remove(struct rb_ptree *T, const void *key,
+                     int (*cmp)(const struct rb_pnode *, const void *));
+
+/** Search a persistent tree for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.  The node
+ * returned may be shared with other trees and must not be modified.
+ *
+ * \param   T       The persistent tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline struct rb_pnode *
+rb_ptree_search(const struct rb_ptree *T, const void *key,
+                int (*cmp)(const struct rb_pnode *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_pnode *x = T->root;
+    while (x != NULL) {
+        int c = cmp(x, key);
+        if (c < 0)
+            x = x->left;
+        else if (c > 0)
+            x = x->right;
+        else
+            return x;
+    }
+
+    return x;
+}
+
+/** An in-order iterator over a persistent tree
+ *
+ * The iterator doesn't hold a reference to the tree so the tree must not
+ * be modified or released while the iterator is in use.  Iterate over a
+ * snapshot to keep going while the tree itself changes.
+ */
+struct rb_ptree_iter {
+    struct rb_pnode *stack[RB_PTREE_MAX_DEPTH];
+    unsigned depth;
+};
+
+/** Start iterating from the first (left-most) node in a persistent tree */
+void rb_ptree_iter_init(struct rb_ptree_iter *iter, const struct rb_ptree *T);
+
+/** Start iterating from the first node which doesn't compare less than a key
+ *
+ * \param   iter    The iterator to initialize
+ *
+ * \param   T       The persistent tree to iterate over
+ *
+ * \param   key     The key to start from
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+void rb_ptree_iter_init_lower_bound(struct rb_ptree_iter *iter,
+                                    const struct rb_ptree *T, const void *key,
+                                    int (*cmp)(const struct rb_pnode *,
+                                               const void *));
+
+/** Get the next node from an iterator or NULL if there are no more */
+struct rb_pnode *rb_ptree_iter_next(struct rb_ptree_iter *iter);
+
+/** Iterate over the nodes in a persistent tree
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   iter    A struct rb_ptree_iter to use for the iteration
+ *
+ * \param   T       The persistent tree
+ *
+ * \param   field   The rb_pnode field in containing data structure
+ */
+#define rb_ptree_foreach(type, node, iter, T, field) \
+   for (type *node, *__node = (rb_ptree_iter_init(iter, T), \
+                               (type *)rb_ptree_iter_next(iter)); \
+        __node != NULL && \
+        (node = rb_pnode_data(type, (struct rb_pnode *)__node, field), true); \
+        __node = (type *)rb_ptree_iter_next(iter))
+
+/** Validate a persistent red-black tree
+ *
+ * This function walks the tree and validates that this is a valid red-
+ * black tree and that every node is referenced.  If anything is wrong, it
+ * will assert-fail.
+ */
+void rb_ptree_validate(const struct rb_ptree *T);
+
+#endif /* RB_PTREE_H */
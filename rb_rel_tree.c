@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* For mmap and fstat */
+#define _POSIX_C_SOURCE 200809L
+
+#include "rb_rel_tree.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A valid tree of any size that fits in memory is far shallower than this */
+#define RB_REL_TREE_MAX_DEPTH 128
+
+#define RB_REL_NONE SIZE_MAX
+
+static int64_t
+rb_rel_offset(size_t from, size_t to, size_t node_size)
+{
+    if (to == RB_REL_NONE)
+        return 0;
+
+    return ((int64_t)to - (int64_t)from) * (int64_t)node_size;
+}
+
+/* Returns the index of the middle node of nodes [lo, hi) or RB_REL_NONE */
+static size_t
+rb_rel_mid(size_t lo, size_t hi)
+{
+    return lo < hi ? lo + (hi - lo) / 2 : RB_REL_NONE;
+}
+
+bool
+rb_rel_tree_write(FILE *f, struct rb_tree *T, size_t data_size,
+                  void (*write_cb)(const struct rb_node *node,
+                                   void *data, void *cb_data),
+                  void *cb_data)
+{
+    size_t count = 0;
+    for (struct rb_node *n = rb_tree_first(T); n; n = rb_node_next(n))
+        count++;
+
+    /* Keep every node 8-byte aligned */
+    size_t node_size = (sizeof(struct rb_rel_node) + data_size + 7) & ~(size_t)7;
+    if (node_size > UINT32_MAX)
+        return false;
+
+    struct rb_rel_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RB_REL_TREE_MAGIC, sizeof(header.magic));
+    header.version = RB_REL_TREE_VERSION;
+    header.node_size = node_size;
+    header.count = count;
+    header.root = count ? (int64_t)(sizeof(header) + (count / 2) * node_size)
+                        : 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+        return false;
+
+    char *buf = malloc(node_size);
+    if (buf == NULL)
+        return false;
+
+    /* The number of complete levels, as in rb_tree_build_sorted */
+    unsigned red_depth = 0;
+    while ((count + 1) >> (red_depth + 1))
+        red_depth++;
+
+    /* The nodes are written in order.  Node i's place in the balanced
+     * tree, and so its links, only depend on i and count so we find them
+     * by walking down the tree of index ranges.
+     */
+    size_t i = 0;
+    for (struct rb_node *n = rb_tree_first(T); n; n = rb_node_next(n), i++) {
+        size_t lo = 0, hi = count, parent = RB_REL_NONE;
+        unsigned depth = 0;
+        while (true) {
+            size_t mid = rb_rel_mid(lo, hi);
+            if (mid == i)
+                break;
+
+            parent = mid;
+            if (i < mid)
+                hi = mid;
+            else
+                lo = mid + 1;
+            depth++;
+        }
+
+        struct rb_rel_node *rn = (struct rb_rel_node *)buf;
+        memset(buf, 0, node_size);
+        rn->parent = rb_rel_offset(i, parent, node_size);
+        if (depth < red_depth)
+            rn->parent |= 1;
+        rn->left = rb_rel_offset(i, rb_rel_mid(lo, i), node_size);
+        rn->right = rb_rel_offset(i, rb_rel_mid(i + 1, hi), node_size);
+        write_cb(n, rn + 1, cb_data);
+
+        if (fwrite(buf, node_size, 1, f) != 1) {
+            free(buf);
+            return false;
+        }
+    }
+    assert(i == count);
+
+    free(buf);
+    return true;
+}
+
+bool
+rb_rel_tree_init(struct rb_rel_tree *R, const void *data, size_t size)
+{
+    const struct rb_rel_header *header = data;
+
+    if (((uintptr_t)data & 7) != 0 || size < sizeof(*header))
+        return false;
+
+    if (memcmp(header->magic, RB_REL_TREE_MAGIC, sizeof(header->magic)) ||
+        header->version != RB_REL_TREE_VERSION)
+        return false;
+
+    if (header->node_size < sizeof(struct rb_rel_node) ||
+        (header->node_size & 7) != 0)
+        return false;
+
+    size_t max_count = (size - sizeof(*header)) / header->node_size;
+    if (header->count > max_count)
+        return false;
+
+    if (header->count == 0 ? header->root != 0 :
+        header->root != (int64_t)(sizeof(*header) +
+                                  (header->count / 2) * header->node_size))
+        return false;
+
+    R->header = header;
+    R->size = size;
+    R->map = NULL;
+    return true;
+}
+
+bool
+rb_rel_tree_map(struct rb_rel_tree *R, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    if (!rb_rel_tree_init(R, map, size)) {
+        munmap(map, size);
+        return false;
+    }
+
+    R->map = map;
+    return true;
+}
+
+void
+rb_rel_tree_unmap(struct rb_rel_tree *R)
+{
+    assert(R->map);
+    munmap(R->map, R->size);
+    R->map = NULL;
+}
+
+static const struct rb_rel_node *
+rb_rel_node_minimum(const struct rb_rel_node *n)
+{
+    const struct rb_rel_node *left;
+    while ((left = rb_rel_node_left(n)))
+        n = left;
+    return n;
+}
+
+static const struct rb_rel_node *
+rb_rel_node_maximum(const struct rb_rel_node *n)
+{
+    const struct rb_rel_node *right;
+    while ((right = rb_rel_node_right(n)))
+        n = right;
+    return n;
+}
+
+const struct rb_rel_node *
+rb_rel_tree_first(const struct rb_rel_tree *R)
+{
+    const struct rb_rel_node *root = rb_rel_tree_root(R);
+    return root ? rb_rel_node_minimum(root) : NULL;
+}
+
+const struct rb_rel_node *
+rb_rel_tree_last(const struct rb_rel_tree *R)
+{
+    const struct rb_rel_node *root = rb_rel_tree_root(R);
+    return root ? rb_rel_node_maximum(root) : NULL;
+}
+
+const struct rb_rel_node *
+rb_rel_node_next(const struct rb_rel_node *node)
+{
+    if (node->right)
+        return rb_rel_node_minimum(rb_rel_node_right(node));
+
+    const struct rb_rel_node *p = rb_rel_node_parent(node);
+    while (p && node == rb_rel_node_right(p)) {
+        node = p;
+        p = rb_rel_node_parent(node);
+    }
+    return p;
+}
+
+const struct rb_rel_node *
+rb_rel_node_prev(const struct rb_rel_node *node)
+{
+    if (node->left)
+        return rb_rel_node_maximum(rb_rel_node_left(node));
+
+    const struct rb_rel_node *p = rb_rel_node_parent(node);
+    while (p && node == rb_rel_node_left(p)) {
+        node = p;
+        p = rb_rel_node_parent(node);
+    }
+    return p;
+}
+
+/* Returns true if link, from the node or header at offset, points to the
+ * start of a node.  offset is relative to the header.
+ */
+static bool
+rb_rel_tree_valid_link(const struct rb_rel_tree *R, int64_t offset,
+                       int64_t link)
+{
+    const int64_t first = sizeof(*R->header);
+    const int64_t end = first + R->header->count * R->header->node_size;
+
+    /* Check the bounds before adding so a bad link can't overflow */
+    if (link < first - offset || link >= end - offset)
+        return false;
+
+    return (offset + link - first) % R->header->node_size == 0;
+}
+
+static bool
+rb_rel_tree_validate_node(const struct rb_rel_tree *R,
+                          const struct rb_rel_node *n,
+                          const struct rb_rel_node *parent, bool parent_red,
+                          unsigned depth, unsigned black_depth,
+                          unsigned *black_height, uint64_t *count)
+{
+    if (n == NULL) {
+        /* Every path must have the same number of black nodes */
+        if (*black_height == UINT32_MAX)
+            *black_height = black_depth;
+        return black_depth == *black_height;
+    }
+
+    /* Compare offsets rather than following a link we haven't checked */
+    const int64_t parent_offset =
+        parent ? (const char *)parent - (const char *)n : 0;
+    if (depth > RB_REL_TREE_MAX_DEPTH ||
+        (n->parent & ~(int64_t)1) != parent_offset)
+        return false;
+
+    bool red = (n->parent & 1) == 0;
+    if (red && (parent_red || parent == NULL))
+        return false;
+
+    /* Both links are relative to n so equal links mean the same child */
+    const int64_t offset = (const char *)n - (const char *)R->header;
+    if ((n->left && !rb_rel_tree_valid_link(R, offset, n->left)) ||
+        (n->right && !rb_rel_tree_valid_link(R, offset, n->right)) ||
+        (n->left && n->left == n->right))
+        return false;
+
+    (*count)++;
+    if (!red)
+        black_depth++;
+
+    return rb_rel_tree_validate_node(R, rb_rel_node_left(n), n, red,
+                                     depth + 1, black_depth,
+                                     black_height, count) &&
+           rb_rel_tree_validate_node(R, rb_rel_node_right(n), n, red,
+                                     depth + 1, black_depth,
+                                     black_height, count);
+}
+
+bool
+rb_rel_tree_validate(const struct rb_rel_tree *R)
+{
+    const struct rb_rel_node *root = rb_rel_tree_root(R);
+    if (root == NULL)
+        return R->header->count == 0;
+
+    if (!rb_rel_tree_valid_link(R, 0, R->header->root))
+        return false;
+
+    /* Each node's children must point back to it and a node's two
+     * children must differ so, starting from the root, which has no
+     * parent, no node can be reached twice.
+     */
+    unsigned black_height = UINT32_MAX;
+    uint64_t count = 0;
+    if (!rb_rel_tree_validate_node(R, root, NULL, false, 0, 0,
+                                   &black_height, &count))
+        return false;
+
+    return count == R->header->count;
+}
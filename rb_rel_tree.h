@@ -0,0 +1,291 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_REL_TREE_H
+#define RB_REL_TREE_H
+
+/** \file rb_rel_tree.h
+ *
+ * Relocatable red-black trees for files
+ *
+ * A struct rb_node links to other nodes with absolute pointers so a tree
+ * can't be saved to disk and used again without rebuilding it.  A
+ * relocatable tree instead links each node to its parent and children
+ * with offsets relative to the node itself.  It works wherever it is in
+ * memory so a file holding one can be mmapped and searched or iterated
+ * in place, only paging in the nodes it touches.
+ *
+ * A relocatable tree is written from a regular red-black tree in a single
+ * sequential pass by rb_rel_tree_write.  Each node is stored as a struct
+ * rb_rel_node followed by a fixed amount of data supplied by the caller,
+ * which is usually the key and whatever goes with it.  The nodes are
+ * written in order as a perfectly balanced tree like the one
+ * rb_tree_build_sorted builds.  Relocatable trees are read-only.
+ *
+ * Files are only portable between machines with the same byte order and
+ * integer sizes.
+ */
+
+#include "rb_tree.h"
+
+#include <stdio.h>
+
+/** The magic number at the start of a relocatable tree */
+#define RB_REL_TREE_MAGIC "rbreltr"
+
+/** The version of the relocatable tree format */
+#define RB_REL_TREE_VERSION 1
+
+/** The header at the start of a relocatable tree */
+struct rb_rel_header {
+    char magic[8];
+    uint32_t version;
+
+    /** The size of each node including its data */
+    uint32_t node_size;
+
+    /** The number of nodes */
+    uint64_t count;
+
+    /** The offset of the root from the start of the header or 0 if the
+     * tree is empty
+     */
+    int64_t root;
+};
+
+/** A relocatable red-black tree node
+ *
+ * Each link is the offset in bytes from this node to the node it points
+ * to or 0 for NULL.
+ */
+struct rb_rel_node {
+    /** Parent and color of this node
+     *
+     * As for struct rb_node, the least significant bit is 1 for black and
+     * 0 for red.  Nodes are 8-byte aligned so it isn't part of the offset.
+     */
+    int64_t parent;
+
+    int64_t left;
+    int64_t right;
+};
+
+/** A relocatable red-black tree which is ready to search */
+struct rb_rel_tree {
+    const struct rb_rel_header *header;
+    size_t size;
+
+    /** The mapping from rb_rel_tree_map or NULL */
+    void *map;
+};
+
+static inline const struct rb_rel_node *
+rb_rel_node_link(const struct rb_rel_node *n, int64_t offset)
+{
+    return offset ? (const struct rb_rel_node *)((const char *)n + offset)
+                  : NULL;
+}
+
+/** Return the parent node of the given node or NULL if it is the root */
+static inline const struct rb_rel_node *
+rb_rel_node_parent(const struct rb_rel_node *n)
+{
+    return rb_rel_node_link(n, n->parent & ~(int64_t)1);
+}
+
+/** Return the left child of the given node or NULL */
+static inline const struct rb_rel_node *
+rb_rel_node_left(const struct rb_rel_node *n)
+{
+    return rb_rel_node_link(n, n->left);
+}
+
+/** Return the right child of the given node or NULL */
+static inline const struct rb_rel_node *
+rb_rel_node_right(const struct rb_rel_node *n)
+{
+    return rb_rel_node_link(n, n->right);
+}
+
+/** Return the data stored after a node */
+static inline const void *
+rb_rel_node_data(const struct rb_rel_node *n)
+{
+    return n + 1;
+}
+
+/** Write a red-black tree out as a relocatable tree
+ *
+ * \param   f           The file to write to, from its current position
+ *
+ * \param   T           The red-black tree to write
+ *
+ * \param   data_size   The number of bytes of data to store with each node
+ *
+ * \param   write_cb    A callback which fills out the data for a node
+ *
+ * \param   cb_data     Passed through to \p write_cb
+ *
+ * \return  True on success, false if memory could not be allocated or the
+ *          file could not be written
+ */
+bool rb_rel_tree_write(FILE *f, struct rb_tree *T, size_t data_size,
+                       void (*write_cb)(const struct rb_node *node,
+                                        void *data, void *cb_data),
+                       void *cb_data);
+
+/** Initialize a relocatable tree from memory
+ *
+ * \p data must be 8-byte aligned and stay valid for as long as the tree
+ * is used.  Only the header is checked so, if the data can't be trusted,
+ * rb_rel_tree_validate should be called as well.
+ *
+ * \return  True if \p data holds a relocatable tree of this version
+ */
+bool rb_rel_tree_init(struct rb_rel_tree *R, const void *data, size_t size);
+
+/** Map a relocatable tree file read-only and initialize a tree from it
+ *
+ * \return  True on success, false if the file could not be mapped or
+ *          does not hold a relocatable tree
+ */
+bool rb_rel_tree_map(struct rb_rel_tree *R, const char *path);
+
+/** Unmap a tree mapped with rb_rel_tree_map */
+void rb_rel_tree_unmap(struct rb_rel_tree *R);
+
+/** Return the number of nodes in a relocatable tree */
+static inline size_t
+rb_rel_tree_count(const struct rb_rel_tree *R)
+{
+    return R->header->count;
+}
+
+/** Return the root of a relocatable tree or NULL if it is empty */
+static inline const struct rb_rel_node *
+rb_rel_tree_root(const struct rb_rel_tree *R)
+{
+    if (R->header->root == 0)
+        return NULL;
+
+    return (const struct rb_rel_node *)
+        ((const char *)R->header + R->header->root);
+}
+
+/** Search a relocatable tree for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.
+ *
+ * \param   R       The relocatable tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes, as
+ *                  for rb_tree_search
+ */
+static inline const struct rb_rel_node *
+rb_rel_tree_search(const struct rb_rel_tree *R, const void *key,
+                   int (*cmp)(const struct rb_rel_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    const struct rb_rel_node *x = rb_rel_tree_root(R);
+    while (x != NULL) {
+        int c = cmp(x, key);
+        if (c < 0)
+            x = rb_rel_node_left(x);
+        else if (c > 0)
+            x = rb_rel_node_right(x);
+        else
+            return x;
+    }
+
+    return x;
+}
+
+/** Find the first node which does not compare less than a key
+ *
+ * Returns the left-most node which compares greater than or equal to
+ * \p key or NULL if there is no such node.
+ *
+ * \param   R       The relocatable tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline const struct rb_rel_node *
+rb_rel_tree_lower_bound(const struct rb_rel_tree *R, const void *key,
+                        int (*cmp)(const struct rb_rel_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    const struct rb_rel_node *y = NULL;
+    const struct rb_rel_node *x = rb_rel_tree_root(R);
+    while (x != NULL) {
+        if (cmp(x, key) <= 0) {
+            y = x;
+            x = rb_rel_node_left(x);
+        } else {
+            x = rb_rel_node_right(x);
+        }
+    }
+
+    return y;
+}
+
+/** Get the first (left-most) node in the tree or NULL */
+const struct rb_rel_node *rb_rel_tree_first(const struct rb_rel_tree *R);
+
+/** Get the last (right-most) node in the tree or NULL */
+const struct rb_rel_node *rb_rel_tree_last(const struct rb_rel_tree *R);
+
+/** Get the next node (to the right) in the tree or NULL */
+const struct rb_rel_node *rb_rel_node_next(const struct rb_rel_node *n);
+
+/** Get the previous node (to the left) in the tree or NULL */
+const struct rb_rel_node *rb_rel_node_prev(const struct rb_rel_node *n);
+
+/** Iterate over the nodes of a relocatable tree in order
+ *
+ * \param   node    The variable name for the current node; this will be
+ *                  declared as a const struct rb_rel_node pointer
+ *
+ * \param   R       The relocatable tree
+ */
+#define rb_rel_tree_foreach(node, R) \
+   for (const struct rb_rel_node *node = rb_rel_tree_first(R); \
+        node != NULL; node = rb_rel_node_next(node))
+
+/** Validate a relocatable tree
+ *
+ * This function checks that every link points to a node inside the tree
+ * and that the nodes form a valid red-black tree.  It returns false rather
+ * than assert-failing so that it can be used on files which can't be
+ * trusted.
+ */
+bool rb_rel_tree_validate(const struct rb_rel_tree *R);
+
+#endif /* RB_REL_TREE_H */
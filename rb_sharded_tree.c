@@ -0,0 +1,607 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_sharded_tree.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Only move nodes between two neighboring shards automatically once one is
+ * more than twice the size of the other plus this many nodes.
+ */
+#define RB_SHARDED_TREE_SKEW_SLACK 1024
+
+struct rb_shard {
+    pthread_mutex_t lock;
+    struct rb_tree tree;
+
+    /* Written with the lock held but read without it */
+    size_t count;
+
+    /* Keep the hot part of each shard off of its neighbors' cache lines */
+    char pad[64];
+};
+
+static inline const void *
+rb_sharded_tree_key(struct rb_sharded_tree *T, const struct rb_node *n)
+{
+    return T->ops->key(n);
+}
+
+static inline const void *
+rb_sharded_tree_bound(struct rb_sharded_tree *T, unsigned i)
+{
+    return T->bounds + (size_t)i * T->key_size;
+}
+
+/* Copy a key with relaxed atomics
+ *
+ * Bounds are read by rb_sharded_tree_route without any lock while they
+ * may be changing, seqlock style.  Copying them in and out a byte at a
+ * time with atomics keeps that from being a data race.  The sequence
+ * counter tells the reader whether the copy it got is any good.
+ */
+static void
+rb_sharded_tree_copy_key(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    for (size_t i = 0; i < size; i++)
+        __atomic_store_n(&d[i], __atomic_load_n(&s[i], __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+}
+
+static inline size_t
+rb_shard_count(struct rb_shard *shard)
+{
+    return __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+}
+
+static inline void
+rb_shard_set_count(struct rb_shard *shard, size_t count)
+{
+    __atomic_store_n(&shard->count, count, __ATOMIC_RELAXED);
+}
+
+bool
+rb_sharded_tree_init(struct rb_sharded_tree *T, unsigned num_shards,
+                     size_t key_size, const struct rb_sharded_tree_ops *ops)
+{
+    assert(num_shards > 0 && key_size > 0);
+    if (key_size > RB_SHARDED_TREE_MAX_KEY_SIZE)
+        return false;
+
+    T->ops = ops;
+    T->key_size = key_size;
+    T->num_shards = num_shards;
+    T->bounds_seq = 0;
+
+    T->shards = malloc(num_shards * sizeof(*T->shards));
+    T->bounds = malloc(num_shards * key_size);
+    T->bound_set = malloc(num_shards * sizeof(*T->bound_set));
+    if (T->shards == NULL || T->bounds == NULL || T->bound_set == NULL) {
+        free(T->shards);
+        free(T->bounds);
+        free(T->bound_set);
+        return false;
+    }
+
+    for (unsigned i = 0; i < num_shards; i++) {
+        pthread_mutex_init(&T->shards[i].lock, NULL);
+        rb_tree_init(&T->shards[i].tree);
+        T->shards[i].count = 0;
+        T->bound_set[i] = false;
+    }
+    pthread_mutex_init(&T->rebalance_lock, NULL);
+
+    return true;
+}
+
+void
+rb_sharded_tree_finish(struct rb_sharded_tree *T)
+{
+    for (unsigned i = 0; i < T->num_shards; i++)
+        pthread_mutex_destroy(&T->shards[i].lock);
+    pthread_mutex_destroy(&T->rebalance_lock);
+
+    free(T->shards);
+    free(T->bounds);
+    free(T->bound_set);
+}
+
+/* Returns true if key is at or past the lower bound of shard i.  A NULL key
+ * sorts before everything.
+ */
+static bool
+rb_sharded_tree_above_bound(struct rb_sharded_tree *T, unsigned i,
+                            const void *key)
+{
+    if (i == 0)
+        return true;
+    if (key == NULL || !__atomic_load_n(&T->bound_set[i], __ATOMIC_RELAXED))
+        return false;
+    return T->ops->cmp(rb_sharded_tree_bound(T, i), key) <= 0;
+}
+
+/* The same as rb_sharded_tree_above_bound but without holding any lock.
+ * The bound is copied into scratch first and the answer is only good if
+ * bounds_seq didn't change in the meantime.
+ */
+static bool
+rb_sharded_tree_above_bound_unlocked(struct rb_sharded_tree *T, unsigned i,
+                                     const void *key, void *scratch)
+{
+    if (i == 0)
+        return true;
+    if (key == NULL || !__atomic_load_n(&T->bound_set[i], __ATOMIC_RELAXED))
+        return false;
+    rb_sharded_tree_copy_key(scratch, rb_sharded_tree_bound(T, i),
+                             T->key_size);
+    return T->ops->cmp(scratch, key) <= 0;
+}
+
+/* Find the shard which should hold key.  The bounds may change under us so
+ * the answer has to be checked once the shard is locked.
+ */
+static unsigned
+rb_sharded_tree_route(struct rb_sharded_tree *T, const void *key)
+{
+    uint64_t bound[RB_SHARDED_TREE_MAX_KEY_SIZE / sizeof(uint64_t)];
+    unsigned seq, shard;
+    do {
+        seq = __atomic_load_n(&T->bounds_seq, __ATOMIC_ACQUIRE);
+
+        /* The bounds only ever increase so this finds the last one which
+         * key is above.
+         */
+        unsigned lo = 0, hi = T->num_shards;
+        while (hi - lo > 1) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (rb_sharded_tree_above_bound_unlocked(T, mid, key, bound))
+                lo = mid;
+            else
+                hi = mid;
+        }
+        shard = lo;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+             __atomic_load_n(&T->bounds_seq, __ATOMIC_RELAXED) != seq);
+
+    return shard;
+}
+
+/* Find and lock the shard which holds key.
+ *
+ * The bounds of shard i are only changed with both shard i and one of its
+ * neighbors locked, so they can't change while we hold shard i's lock.
+ */
+static unsigned
+rb_sharded_tree_lock_key(struct rb_sharded_tree *T, const void *key)
+{
+    while (true) {
+        unsigned i = rb_sharded_tree_route(T, key);
+        pthread_mutex_lock(&T->shards[i].lock);
+        if (rb_sharded_tree_above_bound(T, i, key) &&
+            (i + 1 == T->num_shards ||
+             !rb_sharded_tree_above_bound(T, i + 1, key)))
+            return i;
+        pthread_mutex_unlock(&T->shards[i].lock);
+    }
+}
+
+static void
+rb_sharded_tree_set_bound(struct rb_sharded_tree *T, unsigned i,
+                          const void *key)
+{
+    assert(i > 0);
+
+    /* Same as the write side of rb_latch_tree */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&T->bounds_seq, T->bounds_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (key) {
+        rb_sharded_tree_copy_key(T->bounds + (size_t)i * T->key_size, key,
+                                 T->key_size);
+        __atomic_store_n(&T->bound_set[i], true, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&T->bound_set[i], false, __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&T->bounds_seq, T->bounds_seq + 1, __ATOMIC_RELAXED);
+}
+
+static bool
+rb_sharded_tree_same_key(struct rb_sharded_tree *T,
+                         const struct rb_node *a, const struct rb_node *b)
+{
+    return T->ops->cmp(rb_sharded_tree_key(T, a),
+                       rb_sharded_tree_key(T, b)) == 0;
+}
+
+/* Move the nodes of head, all of which sort before everything in shard,
+ * to the front of shard.
+ */
+static void
+rb_shard_prepend(struct rb_shard *shard, struct rb_tree *head)
+{
+    struct rb_node *pivot = rb_tree_first(&shard->tree);
+    if (pivot == NULL) {
+        shard->tree = *head;
+    } else {
+        rb_tree_remove(&shard->tree, pivot);
+        rb_tree_join(head, pivot, &shard->tree);
+        shard->tree = *head;
+    }
+    rb_tree_init(head);
+}
+
+static void
+rb_shard_append(struct rb_shard *shard, struct rb_tree *tail)
+{
+    struct rb_node *pivot = rb_tree_first(tail);
+    if (pivot == NULL)
+        return;
+
+    rb_tree_remove(tail, pivot);
+    rb_tree_join(&shard->tree, pivot, tail);
+}
+
+/* Move up to count nodes from the end of shard i to the start of shard
+ * i + 1.  Both shards must be locked.  Runs of equal keys are never split
+ * so fewer nodes may be moved.
+ */
+static void
+rb_sharded_tree_push(struct rb_sharded_tree *T, unsigned i, size_t count)
+{
+    struct rb_shard *l = &T->shards[i], *r = &T->shards[i + 1];
+    if (count == 0 || l->count == 0)
+        return;
+    if (count > l->count)
+        count = l->count;
+
+    struct rb_node *n = rb_tree_last(&l->tree);
+    for (size_t k = 1; k < count; k++)
+        n = rb_node_prev(n);
+
+    /* Don't leave part of a run of equal keys behind */
+    while (n) {
+        struct rb_node *prev = rb_node_prev(n);
+        if (prev == NULL || !rb_sharded_tree_same_key(T, prev, n))
+            break;
+        n = rb_node_next(n);
+        count--;
+    }
+    if (n == NULL)
+        return;
+
+    struct rb_tree tail;
+    rb_tree_split_at(&l->tree, n, &l->tree, &tail);
+    rb_shard_prepend(r, &tail);
+    rb_shard_set_count(l, l->count - count);
+    rb_shard_set_count(r, r->count + count);
+    rb_sharded_tree_set_bound(T, i + 1, rb_sharded_tree_key(T, n));
+}
+
+/* Move up to count nodes from the start of shard i + 1 to the end of shard
+ * i.  Both shards must be locked.  Runs of equal keys are never split so
+ * fewer nodes may be moved.
+ */
+static void
+rb_sharded_tree_pull(struct rb_sharded_tree *T, unsigned i, size_t count)
+{
+    struct rb_shard *l = &T->shards[i], *r = &T->shards[i + 1];
+    if (count == 0 || r->count == 0)
+        return;
+
+    if (count >= r->count) {
+        /* Shard i + 1 is left empty with the same bound as the shard
+         * after it, or past every key if it's the last one.
+         */
+        const void *bound = NULL;
+        if (i + 2 < T->num_shards && T->bound_set[i + 2])
+            bound = rb_sharded_tree_bound(T, i + 2);
+
+        rb_shard_append(l, &r->tree);
+        rb_shard_set_count(l, l->count + r->count);
+        rb_shard_set_count(r, 0);
+        rb_sharded_tree_set_bound(T, i + 1, bound);
+        return;
+    }
+
+    /* n is the first node which stays behind */
+    struct rb_node *n = rb_tree_first(&r->tree);
+    for (size_t k = 0; k < count; k++)
+        n = rb_node_next(n);
+
+    /* Don't take part of a run of equal keys */
+    while (count > 0) {
+        struct rb_node *prev = rb_node_prev(n);
+        if (!rb_sharded_tree_same_key(T, prev, n))
+            break;
+        n = prev;
+        count--;
+    }
+    if (count == 0)
+        return;
+
+    struct rb_tree head;
+    rb_tree_split_at(&r->tree, n, &head, &r->tree);
+    rb_shard_append(l, &head);
+    rb_shard_set_count(l, l->count + count);
+    rb_shard_set_count(r, r->count - count);
+    rb_sharded_tree_set_bound(T, i + 1, rb_sharded_tree_key(T, n));
+}
+
+/* Even out shards i and i + 1.  The caller must hold the rebalance lock. */
+static void
+rb_sharded_tree_balance_pair(struct rb_sharded_tree *T, unsigned i)
+{
+    struct rb_shard *l = &T->shards[i], *r = &T->shards[i + 1];
+    pthread_mutex_lock(&l->lock);
+    pthread_mutex_lock(&r->lock);
+
+    if (l->count > r->count)
+        rb_sharded_tree_push(T, i, (l->count - r->count) / 2);
+    else
+        rb_sharded_tree_pull(T, i, (r->count - l->count) / 2);
+
+    pthread_mutex_unlock(&r->lock);
+    pthread_mutex_unlock(&l->lock);
+}
+
+static bool
+rb_sharded_tree_is_skewed(size_t a, size_t b)
+{
+    return a > 2 * b + RB_SHARDED_TREE_SKEW_SLACK ||
+           b > 2 * a + RB_SHARDED_TREE_SKEW_SLACK;
+}
+
+/* Called after shard i changed size without holding any locks */
+static void
+rb_sharded_tree_check_skew(struct rb_sharded_tree *T, unsigned i)
+{
+    size_t count = rb_shard_count(&T->shards[i]);
+    unsigned pair;
+    if (i + 1 < T->num_shards &&
+        rb_sharded_tree_is_skewed(count, rb_shard_count(&T->shards[i + 1])))
+        pair = i;
+    else if (i > 0 &&
+             rb_sharded_tree_is_skewed(count, rb_shard_count(&T->shards[i - 1])))
+        pair = i - 1;
+    else
+        return;
+
+    /* If someone else is already moving nodes around, let them */
+    if (pthread_mutex_trylock(&T->rebalance_lock) != 0)
+        return;
+    rb_sharded_tree_balance_pair(T, pair);
+    pthread_mutex_unlock(&T->rebalance_lock);
+}
+
+void
+rb_sharded_tree_insert(struct rb_sharded_tree *T, struct rb_node *node)
+{
+    const void *key = rb_sharded_tree_key(T, node);
+    unsigned i = rb_sharded_tree_lock_key(T, key);
+    struct rb_shard *shard = &T->shards[i];
+
+    struct rb_node *y = NULL;
+    struct rb_node *x = shard->tree.root;
+    bool left = false;
+    while (x != NULL) {
+        y = x;
+        left = T->ops->cmp(key, rb_sharded_tree_key(T, x)) < 0;
+        if (left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+    rb_tree_insert_at(&shard->tree, y, node, left);
+    rb_shard_set_count(shard, shard->count + 1);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    rb_sharded_tree_check_skew(T, i);
+}
+
+void
+rb_sharded_tree_remove(struct rb_sharded_tree *T, struct rb_node *node)
+{
+    unsigned i = rb_sharded_tree_lock_key(T, rb_sharded_tree_key(T, node));
+    struct rb_shard *shard = &T->shards[i];
+
+    rb_tree_remove(&shard->tree, node);
+    rb_shard_set_count(shard, shard->count - 1);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    rb_sharded_tree_check_skew(T, i);
+}
+
+struct rb_node *
+rb_sharded_tree_search(struct rb_sharded_tree *T, const void *key)
+{
+    unsigned i = rb_sharded_tree_lock_key(T, key);
+    struct rb_shard *shard = &T->shards[i];
+
+    struct rb_node *x = shard->tree.root;
+    while (x != NULL) {
+        int c = T->ops->cmp(key, rb_sharded_tree_key(T, x));
+        if (c < 0)
+            x = x->left;
+        else if (c > 0)
+            x = x->right;
+        else
+            break;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return x;
+}
+
+void
+rb_sharded_tree_scan(struct rb_sharded_tree *T, const void *lo,
+                     bool (*cb)(struct rb_node *node, void *data),
+                     void *data)
+{
+    uint64_t resume[RB_SHARDED_TREE_MAX_KEY_SIZE / sizeof(uint64_t)];
+    const void *key = NULL;
+    if (lo) {
+        memcpy(resume, lo, T->key_size);
+        key = resume;
+    }
+
+    while (true) {
+        unsigned i = rb_sharded_tree_lock_key(T, key);
+        struct rb_shard *shard = &T->shards[i];
+
+        /* Find the first node which doesn't compare less than key */
+        struct rb_node *x;
+        if (key) {
+            struct rb_node *y = NULL;
+            x = shard->tree.root;
+            while (x != NULL) {
+                if (T->ops->cmp(key, rb_sharded_tree_key(T, x)) <= 0) {
+                    y = x;
+                    x = x->left;
+                } else {
+                    x = x->right;
+                }
+            }
+            x = y;
+        } else {
+            x = rb_tree_first(&shard->tree);
+        }
+
+        for (; x != NULL; x = rb_node_next(x)) {
+            if (!cb(x, data)) {
+                pthread_mutex_unlock(&shard->lock);
+                return;
+            }
+        }
+
+        /* Pick up wherever the next shard's range starts now.  Going by
+         * key rather than by shard index means we neither miss nor repeat
+         * nodes which get moved between shards behind our back.
+         */
+        if (i + 1 == T->num_shards || !T->bound_set[i + 1]) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+        memcpy(resume, rb_sharded_tree_bound(T, i + 1), T->key_size);
+        key = resume;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+size_t
+rb_sharded_tree_shard_count(struct rb_sharded_tree *T, unsigned shard)
+{
+    assert(shard < T->num_shards);
+    return rb_shard_count(&T->shards[shard]);
+}
+
+struct rb_tree *
+rb_sharded_tree_shard(struct rb_sharded_tree *T, unsigned shard)
+{
+    assert(shard < T->num_shards);
+    return &T->shards[shard].tree;
+}
+
+void
+rb_sharded_tree_rebalance(struct rb_sharded_tree *T)
+{
+    unsigned n = T->num_shards;
+    if (n < 2)
+        return;
+
+    pthread_mutex_lock(&T->rebalance_lock);
+
+    size_t total = 0;
+    for (unsigned i = 0; i < n; i++)
+        total += rb_shard_count(&T->shards[i]);
+
+    /* Shards 0 through i should end up with total * (i + 1) / n nodes
+     * between them, which says how many nodes have to cross the boundary
+     * after shard i.  Doing all of the moves to the right from left to
+     * right and then all of the moves to the left from right to left
+     * guarantees that each shard has enough nodes when it's time to move
+     * them.  Moves across the other boundaries on the way don't change the
+     * number of nodes before this one, so it can be recounted as we go.
+     */
+    for (unsigned pass = 0; pass < 2; pass++) {
+        for (unsigned k = 0; k + 1 < n; k++) {
+            unsigned i = pass == 0 ? k : n - 2 - k;
+
+            size_t prefix = 0;
+            for (unsigned j = 0; j <= i; j++)
+                prefix += rb_shard_count(&T->shards[j]);
+            size_t target = total / n * (i + 1) + total % n * (i + 1) / n;
+
+            struct rb_shard *l = &T->shards[i], *r = &T->shards[i + 1];
+            pthread_mutex_lock(&l->lock);
+            pthread_mutex_lock(&r->lock);
+            if (pass == 0 && prefix > target)
+                rb_sharded_tree_push(T, i, prefix - target);
+            else if (pass == 1 && prefix < target)
+                rb_sharded_tree_pull(T, i, target - prefix);
+            pthread_mutex_unlock(&r->lock);
+            pthread_mutex_unlock(&l->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&T->rebalance_lock);
+}
+
+void
+rb_sharded_tree_validate(struct rb_sharded_tree *T)
+{
+    for (unsigned i = 0; i < T->num_shards; i++) {
+        struct rb_shard *shard = &T->shards[i];
+        rb_tree_validate(&shard->tree);
+
+        /* Unset bounds must all come at the end */
+        if (i > 0 && T->bound_set[i])
+            assert(T->bound_set[i - 1] || i == 1);
+
+        size_t count = 0;
+        const void *prev = NULL;
+        for (struct rb_node *x = rb_tree_first(&shard->tree); x;
+             x = rb_node_next(x)) {
+            const void *key = rb_sharded_tree_key(T, x);
+            assert(prev == NULL || T->ops->cmp(prev, key) <= 0);
+            assert(rb_sharded_tree_above_bound(T, i, key));
+            assert(i + 1 == T->num_shards ||
+                   !rb_sharded_tree_above_bound(T, i + 1, key));
+            prev = key;
+            count++;
+        }
+        (void)prev;
+        assert(count == shard->count);
+    }
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_SHARDED_TREE_H
+#define RB_SHARDED_TREE_H
+
+/** \file rb_sharded_tree.h
+ *
+ * Range-partitioned red-black trees for concurrent writers
+ *
+ * A sharded tree splits the key space into a fixed number of contiguous
+ * ranges, each of which is a separate rb_tree with its own lock, so
+ * writers working on different parts of the key space don't contend.
+ * Shard i holds the keys from its lower bound up to, but not including,
+ * the lower bound of shard i + 1.  Operations find the right shard with a
+ * binary search of the bounds, which readers do without taking any lock.
+ *
+ * The bounds start out with every key in the first shard and move as the
+ * shards fill up.  When an insert or remove leaves a shard much bigger
+ * than one of its neighbors, half of the difference is moved across using
+ * rb_tree_split_at and rb_tree_join, which only locks the two shards
+ * involved.  rb_sharded_tree_rebalance evens out all of the shards.
+ *
+ * Shard bounds are copies of keys, so a key must be a fixed-size blob of
+ * at most RB_SHARDED_TREE_MAX_KEY_SIZE bytes which doesn't point into the
+ * node it came from.
+ */
+
+#include "rb_tree.h"
+
+#include <pthread.h>
+
+/** The largest key a sharded tree can hold
+ *
+ * Keys are copied to the stack while routing and scanning, so their size
+ * has to be bounded.
+ */
+#define RB_SHARDED_TREE_MAX_KEY_SIZE 256
+
+/** Callbacks used by a sharded tree to get at the keys of its nodes */
+struct rb_sharded_tree_ops {
+    /** Return a pointer to the key_size bytes of the key of a node */
+    const void *(*key)(const struct rb_node *node);
+
+    /** Compare two keys
+     *
+     * This returns a negative number if \p a sorts before \p b, a positive
+     * number if \p a sorts after \p b and zero if they are equal.  It is
+     * called concurrently from many threads and may be handed a key which
+     * is in the middle of being changed, in which case the result will be
+     * thrown away.
+     */
+    int (*cmp)(const void *a, const void *b);
+};
+
+struct rb_shard;
+
+/** A sharded red-black tree */
+struct rb_sharded_tree {
+    const struct rb_sharded_tree_ops *ops;
+    size_t key_size;
+
+    unsigned num_shards;
+    struct rb_shard *shards;
+
+    /** Sequence counter guarding bounds and bound_set, odd while they're
+     * being changed
+     */
+    unsigned bounds_seq;
+
+    /** The lower bound of each shard; the first entry is unused */
+    char *bounds;
+
+    /** Whether each lower bound is set; an unset bound is past every key */
+    bool *bound_set;
+
+    /** Serializes moving nodes between shards */
+    pthread_mutex_t rebalance_lock;
+};
+
+/** Initialize a sharded tree
+ *
+ * \param   T           The sharded tree to initialize
+ *
+ * \param   num_shards  The number of shards
+ *
+ * \param   key_size    The size in bytes of a key; this must be at most
+ *                      RB_SHARDED_TREE_MAX_KEY_SIZE
+ *
+ * \param   ops         The callbacks used to get at and compare keys
+ *
+ * \return  True on success, false if memory could not be allocated or
+ *          \p key_size is too big
+ */
+bool rb_sharded_tree_init(struct rb_sharded_tree *T, unsigned num_shards,
+                          size_t key_size,
+                          const struct rb_sharded_tree_ops *ops);
+
+/** Free the memory used by a sharded tree
+ *
+ * The nodes in the tree are left alone.  Use rb_sharded_tree_scan or
+ * rb_sharded_tree_shard to get at them first if they need to be freed.
+ */
+void rb_sharded_tree_finish(struct rb_sharded_tree *T);
+
+/** Insert a node into a sharded tree
+ *
+ * \param   T       The sharded tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ */
+void rb_sharded_tree_insert(struct rb_sharded_tree *T, struct rb_node *node);
+
+/** Remove a node from a sharded tree
+ *
+ * \param   T       The sharded tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_sharded_tree_remove(struct rb_sharded_tree *T, struct rb_node *node);
+
+/** Search a sharded tree for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.  The shard
+ * is unlocked by the time this returns, so it's up to the caller to make
+ * sure the node isn't removed and freed while it's being used.
+ *
+ * \param   T       The sharded tree to search
+ *
+ * \param   key     The key to search for
+ */
+struct rb_node *rb_sharded_tree_search(struct rb_sharded_tree *T,
+                                       const void *key);
+
+/** Walk the nodes in a sharded tree in order
+ *
+ * Each shard is locked while its nodes are handed to \p cb so \p cb must
+ * not call back into the sharded tree.  The walk sees each shard as it is
+ * at the time but, since other threads may change shards which haven't
+ * been reached yet, it is not a snapshot of the whole tree.
+ *
+ * \param   T       The sharded tree to walk
+ *
+ * \param   lo      The key to start from or NULL to start from the first
+ *                  node
+ *
+ * \param   cb      Called on each node in order; returning false stops the
+ *                  walk
+ *
+ * \param   data    Passed through to \p cb
+ */
+void rb_sharded_tree_scan(struct rb_sharded_tree *T, const void *lo,
+                          bool (*cb)(struct rb_node *node, void *data),
+                          void *data);
+
+/** Get the number of nodes in a shard
+ *
+ * This isn't synchronized with anything so it's only a hint if other
+ * threads are using the tree.
+ */
+size_t rb_sharded_tree_shard_count(struct rb_sharded_tree *T, unsigned shard);
+
+/** Get the tree backing a shard
+ *
+ * This must only be used while no other thread is using the sharded
+ * tree.
+ */
+struct rb_tree *rb_sharded_tree_shard(struct rb_sharded_tree *T,
+                                      unsigned shard);
+
+/** Even out the number of nodes in each shard
+ *
+ * Nodes are moved between neighboring shards, locking two shards at a
+ * time, so this can run while the tree is in use.  It takes
+ * O(num_shards log^2 n) time plus time proportional to the number of nodes
+ * moved.
+ */
+void rb_sharded_tree_rebalance(struct rb_sharded_tree *T);
+
+/** Validate a sharded tree
+ *
+ * This validates each shard and checks that every node is in the right
+ * shard.  It must only be used while no other thread is using the sharded
+ * tree.
+ */
+void rb_sharded_tree_validate(struct rb_sharded_tree *T);
+
+#endif /* RB_SHARDED_TREE_H */
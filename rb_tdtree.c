@@ -0,0 +1,411 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_tdtree.h"
+
+#include <assert.h>
+
+/** \file rb_tdtree.c
+ *
+ * Top-down insertion and removal
+ *
+ * These are the single-pass algorithms described by Julienne Walker in
+ * "Red Black Trees" (Eternally Confuzzled).  Insert splits any node with
+ * two red children on the way down, as in a 2-3-4 tree, so that the new
+ * red leaf can always be linked in and at most one rotation is needed to
+ * fix up each red-red conflict as it's found.  Remove pushes a red node
+ * down the path so that the node it finally unlinks, which has at most one
+ * child, is red and removing it can't change any black heights.
+ *
+ * Both work one level at a time with a pointer to the current node and
+ * the few above it which rotations can touch.  A dummy head node above the
+ * root means the root doesn't need special cases.
+ */
+
+static inline bool
+rb_tdnode_is_red(const struct rb_tdnode *n)
+{
+    return n != NULL && (n->left & 1) == 0;
+}
+
+static inline void
+rb_tdnode_set_red(struct rb_tdnode *n)
+{
+    n->left &= ~(uintptr_t)1;
+}
+
+static inline void
+rb_tdnode_set_black(struct rb_tdnode *n)
+{
+    n->left |= 1;
+}
+
+/* Returns the left child for dir 0 and the right child for dir 1 */
+static inline struct rb_tdnode *
+rb_tdnode_child(const struct rb_tdnode *n, int dir)
+{
+    return dir ? n->right : rb_tdnode_left(n);
+}
+
+static inline void
+rb_tdnode_set_child(struct rb_tdnode *n, int dir, struct rb_tdnode *c)
+{
+    if (dir)
+        n->right = c;
+    else
+        n->left = (uintptr_t)c | (n->left & 1);
+}
+
+/* Rotate the subtree at n in direction dir, coloring the new root black and
+ * n red.  Returns the new root of the subtree.
+ */
+static struct rb_tdnode *
+rb_tdnode_rotate(struct rb_tdnode *n, int dir)
+{
+    struct rb_tdnode *c = rb_tdnode_child(n, !dir);
+    rb_tdnode_set_child(n, !dir, rb_tdnode_child(c, dir));
+    rb_tdnode_set_child(c, dir, n);
+    rb_tdnode_set_red(n);
+    rb_tdnode_set_black(c);
+    return c;
+}
+
+static struct rb_tdnode *
+rb_tdnode_rotate_double(struct rb_tdnode *n, int dir)
+{
+    rb_tdnode_set_child(n, !dir,
+                        rb_tdnode_rotate(rb_tdnode_child(n, !dir), !dir));
+    return rb_tdnode_rotate(n, dir);
+}
+
+void
+rb_tdtree_init(struct rb_tdtree *T)
+{
+    T->root = NULL;
+}
+
+void
+rb_tdtree_insert(struct rb_tdtree *T, struct rb_tdnode *node,
+                 int (*cmp)(const struct rb_tdnode *,
+                            const struct rb_tdnode *))
+{
+    /* This sets null children and a color of red */
+    node->left = 0;
+    node->right = NULL;
+
+    if (T->root == NULL) {
+        rb_tdnode_set_black(node);
+        T->root = node;
+        return;
+    }
+
+    /* q is the current node, p its parent, g its grandparent and t its
+     * great-grandparent, whose link to g changes when g is rotated.
+     */
+    struct rb_tdnode head = { 1, T->root };
+    struct rb_tdnode *t = &head, *g = NULL, *p = NULL, *q = T->root;
+    int dir = 0, last = 0;
+
+    while (true) {
+        if (q == NULL) {
+            q = node;
+            rb_tdnode_set_child(p, dir, q);
+        } else if (rb_tdnode_is_red(rb_tdnode_left(q)) &&
+                   rb_tdnode_is_red(q->right)) {
+            /* Split a 4-node on the way down */
+            rb_tdnode_set_red(q);
+            rb_tdnode_set_black(rb_tdnode_left(q));
+            rb_tdnode_set_black(q->right);
+        }
+
+        if (rb_tdnode_is_red(q) && rb_tdnode_is_red(p)) {
+            /* p is red so it isn't the root and g exists */
+            int dir2 = t->right == g;
+            if (q == rb_tdnode_child(p, last)) {
+                rb_tdnode_set_child(t, dir2, rb_tdnode_rotate(g, !last));
+            } else {
+                rb_tdnode_set_child(t, dir2,
+                                    rb_tdnode_rotate_double(g, !last));
+            }
+        }
+
+        if (q == node)
+            break;
+
+        last = dir;
+        dir = cmp(q, node) >= 0;
+        if (g != NULL)
+            t = g;
+        g = p;
+        p = q;
+        q = rb_tdnode_child(q, dir);
+    }
+
+    T->root = head.right;
+    rb_tdnode_set_black(T->root);
+}
+
+struct rb_tdnode *
+rb_tdtree_remove(struct rb_tdtree *T, const void *key,
+                 int (*cmp)(const struct rb_tdnode *, const void *))
+{
+    if (T->root == NULL)
+        return NULL;
+
+    /* f is the node to remove, if we've found it.  We keep going down to
+     * its in-order predecessor, which is what actually gets unlinked, and
+     * then put that in f's place.  Rotations can move f down so we track
+     * its parent as we go.
+     */
+    struct rb_tdnode head = { 1, T->root };
+    struct rb_tdnode *q = &head, *p = NULL, *g = NULL;
+    struct rb_tdnode *f = NULL, *f_parent = NULL;
+    int f_dir = 0, dir = 1;
+
+    while (rb_tdnode_child(q, dir) != NULL) {
+        int last = dir;
+        g = p;
+        p = q;
+        q = rb_tdnode_child(q, dir);
+
+        int c = cmp(q, key);
+        dir = c > 0;
+        if (c == 0) {
+            f = q;
+            f_parent = p;
+            f_dir = last;
+        }
+
+        /* Make sure q or the child we're going to next is red */
+        if (rb_tdnode_is_red(q) || rb_tdnode_is_red(rb_tdnode_child(q, dir)))
+            continue;
+
+        if (rb_tdnode_is_red(rb_tdnode_child(q, !dir))) {
+            /* Rotate q's red child up, which makes q red */
+            struct rb_tdnode *r = rb_tdnode_rotate(q, dir);
+            rb_tdnode_set_child(p, last, r);
+            if (f == q) {
+                f_parent = r;
+                f_dir = dir;
+            }
+            p = r;
+            continue;
+        }
+
+        struct rb_tdnode *s = rb_tdnode_child(p, !last);
+        if (s == NULL)
+            continue;
+
+        if (!rb_tdnode_is_red(rb_tdnode_child(s, !last)) &&
+            !rb_tdnode_is_red(rb_tdnode_child(s, last))) {
+            /* Merge p, q and s into a 4-node */
+            rb_tdnode_set_black(p);
+            rb_tdnode_set_red(s);
+            rb_tdnode_set_red(q);
+        } else {
+            /* Borrow from s with a rotation, which moves p down */
+            int dir2 = g->right == p;
+            struct rb_tdnode *r;
+            if (rb_tdnode_is_red(rb_tdnode_child(s, last)))
+                r = rb_tdnode_rotate_double(p, last);
+            else
+                r = rb_tdnode_rotate(p, last);
+            rb_tdnode_set_child(g, dir2, r);
+
+            rb_tdnode_set_red(q);
+            rb_tdnode_set_red(r);
+            rb_tdnode_set_black(rb_tdnode_left(r));
+            rb_tdnode_set_black(r->right);
+
+            /* Either way, p ends up as r's child on the last side */
+            if (f == p) {
+                f_parent = r;
+                f_dir = last;
+            }
+        }
+    }
+
+    if (f != NULL) {
+        /* q has at most one child */
+        struct rb_tdnode *child = rb_tdnode_child(q, rb_tdnode_left(q) == NULL);
+        rb_tdnode_set_child(p, p->right == q, child);
+
+        if (f != q) {
+            /* This copies f's color along with its children */
+            q->left = f->left;
+            q->right = f->right;
+            rb_tdnode_set_child(f_parent, f_dir, q);
+        }
+    }
+
+    T->root = head.right;
+    if (T->root)
+        rb_tdnode_set_black(T->root);
+
+    return f;
+}
+
+struct rb_tdnode *
+rb_tdtree_first(const struct rb_tdtree *T)
+{
+    struct rb_tdnode *n = T->root;
+    if (n == NULL)
+        return NULL;
+
+    while (rb_tdnode_left(n))
+        n = rb_tdnode_left(n);
+    return n;
+}
+
+struct rb_tdnode *
+rb_tdtree_last(const struct rb_tdtree *T)
+{
+    struct rb_tdnode *n = T->root;
+    if (n == NULL)
+        return NULL;
+
+    while (n->right)
+        n = n->right;
+    return n;
+}
+
+static inline void
+rb_tdcursor_push(struct rb_tdcursor *cur, struct rb_tdnode *n)
+{
+    assert(cur->depth < RB_TDTREE_MAX_DEPTH);
+    cur->stack[cur->depth++] = n;
+}
+
+/* Push n and then the path down to the end of the subtree in direction
+ * dir
+ */
+static void
+rb_tdcursor_push_to_end(struct rb_tdcursor *cur, struct rb_tdnode *n,
+                        int dir)
+{
+    for (; n != NULL; n = rb_tdnode_child(n, dir))
+        rb_tdcursor_push(cur, n);
+}
+
+void
+rb_tdcursor_first(struct rb_tdcursor *cur, const struct rb_tdtree *T)
+{
+    cur->depth = 0;
+    rb_tdcursor_push_to_end(cur, T->root, 0);
+}
+
+void
+rb_tdcursor_last(struct rb_tdcursor *cur, const struct rb_tdtree *T)
+{
+    cur->depth = 0;
+    rb_tdcursor_push_to_end(cur, T->root, 1);
+}
+
+void
+rb_tdcursor_lower_bound(struct rb_tdcursor *cur,
+                        const struct rb_tdtree *T, const void *key,
+                        int (*cmp)(const struct rb_tdnode *, const void *))
+{
+    unsigned found_depth = 0;
+    cur->depth = 0;
+    for (struct rb_tdnode *x = T->root; x != NULL;) {
+        rb_tdcursor_push(cur, x);
+        if (cmp(x, key) <= 0) {
+            found_depth = cur->depth;
+            x = rb_tdnode_left(x);
+        } else {
+            x = x->right;
+        }
+    }
+
+    /* Everything below the lower bound is to one side of it */
+    cur->depth = found_depth;
+}
+
+/* Move to the next node in direction dir */
+static struct rb_tdnode *
+rb_tdcursor_step(struct rb_tdcursor *cur, int dir)
+{
+    assert(cur->depth > 0);
+
+    struct rb_tdnode *n = cur->stack[cur->depth - 1];
+    struct rb_tdnode *c = rb_tdnode_child(n, dir);
+    if (c) {
+        rb_tdcursor_push_to_end(cur, c, !dir);
+    } else {
+        /* Go up until we come up from the other side of a node */
+        do {
+            c = cur->stack[--cur->depth];
+        } while (cur->depth > 0 &&
+                 rb_tdnode_child(cur->stack[cur->depth - 1], dir) == c);
+    }
+
+    return rb_tdcursor_node(cur);
+}
+
+struct rb_tdnode *
+rb_tdcursor_next(struct rb_tdcursor *cur)
+{
+    return rb_tdcursor_step(cur, 1);
+}
+
+struct rb_tdnode *
+rb_tdcursor_prev(struct rb_tdcursor *cur)
+{
+    return rb_tdcursor_step(cur, 0);
+}
+
+static void
+validate_rb_tdnode(const struct rb_tdnode *n, int black_depth)
+{
+    if (n == NULL) {
+        assert(black_depth == 0);
+        return;
+    }
+
+    if (rb_tdnode_is_red(n)) {
+        assert(!rb_tdnode_is_red(rb_tdnode_left(n)));
+        assert(!rb_tdnode_is_red(n->right));
+    } else {
+        black_depth--;
+    }
+
+    validate_rb_tdnode(rb_tdnode_left(n), black_depth);
+    validate_rb_tdnode(n->right, black_depth);
+}
+
+void
+rb_tdtree_validate(const struct rb_tdtree *T)
+{
+    if (T->root == NULL)
+        return;
+
+    assert(!rb_tdnode_is_red(T->root));
+
+    int black_depth = 0;
+    for (const struct rb_tdnode *n = T->root; n; n = rb_tdnode_left(n)) {
+        if (!rb_tdnode_is_red(n))
+            black_depth++;
+    }
+
+    validate_rb_tdnode(T->root, black_depth);
+}
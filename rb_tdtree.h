@@ -0,0 +1,275 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_TDTREE_H
+#define RB_TDTREE_H
+
+/** \file rb_tdtree.h
+ *
+ * Red-black trees without parent pointers
+ *
+ * A struct rb_node spends a third of its 24 bytes on the parent pointer,
+ * which is only needed to walk back up the tree.  A struct rb_tdnode only
+ * has its two child pointers and keeps its color in the bottom bit of the
+ * left one, for 16 bytes per node.
+ *
+ * Without parent pointers, inserts and removes can't fix the tree up on
+ * the way back up.  Instead, they restructure the tree on the way down so
+ * that the node being added or removed can be linked in or out without
+ * breaking any of the red-black properties.  They touch each node on the
+ * path once.  In-order iteration is done with a cursor holding the path
+ * from the root.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The deepest a red-black tree can get */
+#define RB_TDTREE_MAX_DEPTH (2 * 8 * sizeof(void *))
+
+/** A red-black tree node without a parent pointer
+ *
+ * This should be embedded as a field in the data structure being stored
+ * in the tree.
+ */
+struct rb_tdnode {
+    /** Left child and color of this node
+     *
+     * The least significant bit represents the color and is set to 1 for
+     * black and 0 for red.  The other bits are the pointer to the left
+     * child.
+     */
+    uintptr_t left;
+
+    /** Right child of this node */
+    struct rb_tdnode *right;
+};
+
+/** A red-black tree of struct rb_tdnode */
+struct rb_tdtree {
+    struct rb_tdnode *root;
+};
+
+/** Retrieve the data structure containing a node
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    A pointer to a rb_tdnode
+ *
+ * \param   field   The rb_tdnode field in the containing data structure
+ */
+#define rb_tdnode_data(type, node, field) \
+    ((type *)(((char *)(node)) - offsetof(type, field)))
+
+/** Return the left child of a node or NULL */
+static inline struct rb_tdnode *
+rb_tdnode_left(const struct rb_tdnode *n)
+{
+    return (struct rb_tdnode *)(n->left & ~(uintptr_t)1);
+}
+
+/** Return the right child of a node or NULL */
+static inline struct rb_tdnode *
+rb_tdnode_right(const struct rb_tdnode *n)
+{
+    return n->right;
+}
+
+/** Initialize a tree */
+void rb_tdtree_init(struct rb_tdtree *T);
+
+/** Returns true if the tree is empty */
+static inline bool
+rb_tdtree_is_empty(const struct rb_tdtree *T)
+{
+    return T->root == NULL;
+}
+
+/** Insert a node into a tree
+ *
+ * Nodes are placed after any existing nodes which compare equal.
+ *
+ * \param   T       The tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+void rb_tdtree_insert(struct rb_tdtree *T, struct rb_tdnode *node,
+                      int (*cmp)(const struct rb_tdnode *,
+                                 const struct rb_tdnode *));
+
+/** Remove a node with a given key from a tree
+ *
+ * Since there is no way to find a node's place in the tree from the node
+ * itself, nodes are removed by key.  If more than one node matches \p key,
+ * one of them is removed.
+ *
+ * \param   T       The tree from which to remove the node
+ *
+ * \param   key     The key of the node to remove
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ *
+ * \return  The node which was removed or NULL if no node matches \p key
+ */
+struct rb_tdnode *rb_tdtree_remove(struct rb_tdtree *T, const void *key,
+                                   int (*cmp)(const struct rb_tdnode *,
+                                              const void *));
+
+/** Search a tree for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.
+ *
+ * \param   T       The tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline struct rb_tdnode *
+rb_tdtree_search(const struct rb_tdtree *T, const void *key,
+                 int (*cmp)(const struct rb_tdnode *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_tdnode *x = T->root;
+    while (x != NULL) {
+        int c = cmp(x, key);
+        if (c < 0)
+            x = rb_tdnode_left(x);
+        else if (c > 0)
+            x = x->right;
+        else
+            return x;
+    }
+
+    return x;
+}
+
+/** Get the first (left-most) node in the tree or NULL */
+struct rb_tdnode *rb_tdtree_first(const struct rb_tdtree *T);
+
+/** Get the last (right-most) node in the tree or NULL */
+struct rb_tdnode *rb_tdtree_last(const struct rb_tdtree *T);
+
+/** A position in a tree
+ *
+ * The cursor holds the path from the root to its node so it can move in
+ * either direction.  It is invalidated by any change to the tree.
+ */
+struct rb_tdcursor {
+    struct rb_tdnode *stack[RB_TDTREE_MAX_DEPTH];
+    unsigned depth;
+};
+
+/** Get the node at a cursor or NULL if it is past either end of the tree */
+static inline struct rb_tdnode *
+rb_tdcursor_node(const struct rb_tdcursor *cur)
+{
+    return cur->depth ? cur->stack[cur->depth - 1] : NULL;
+}
+
+/** Point a cursor at the first (left-most) node in a tree */
+void rb_tdcursor_first(struct rb_tdcursor *cur, const struct rb_tdtree *T);
+
+/** Point a cursor at the last (right-most) node in a tree */
+void rb_tdcursor_last(struct rb_tdcursor *cur, const struct rb_tdtree *T);
+
+/** Point a cursor at the first node which doesn't compare less than a key
+ *
+ * \param   cur     The cursor to initialize
+ *
+ * \param   T       The tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+void rb_tdcursor_lower_bound(struct rb_tdcursor *cur,
+                             const struct rb_tdtree *T, const void *key,
+                             int (*cmp)(const struct rb_tdnode *,
+                                        const void *));
+
+/** Move a cursor to the next node (to the right)
+ *
+ * Returns the new node or NULL if the cursor moved past the end.
+ */
+struct rb_tdnode *rb_tdcursor_next(struct rb_tdcursor *cur);
+
+/** Move a cursor to the previous node (to the left)
+ *
+ * Returns the new node or NULL if the cursor moved past the start.
+ */
+struct rb_tdnode *rb_tdcursor_prev(struct rb_tdcursor *cur);
+
+/** Iterate over the nodes in a tree
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   cur     A struct rb_tdcursor to use for the iteration
+ *
+ * \param   T       The tree
+ *
+ * \param   field   The rb_tdnode field in containing data structure
+ */
+#define rb_tdtree_foreach(type, node, cur, T, field) \
+   for (type *node, *__node = (rb_tdcursor_first(cur, T), \
+                               (type *)rb_tdcursor_node(cur)); \
+        __node != NULL && \
+        (node = rb_tdnode_data(type, (struct rb_tdnode *)__node, field), true); \
+        __node = (type *)rb_tdcursor_next(cur))
+
+/** Iterate over the nodes in a tree in reverse order
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   cur     A struct rb_tdcursor to use for the iteration
+ *
+ * \param   T       The tree
+ *
+ * \param   field   The rb_tdnode field in containing data structure
+ */
+#define rb_tdtree_foreach_rev(type, node, cur, T, field) \
+   for (type *node, *__node = (rb_tdcursor_last(cur, T), \
+                               (type *)rb_tdcursor_node(cur)); \
+        __node != NULL && \
+        (node = rb_tdnode_data(type, (struct rb_tdnode *)__node, field), true); \
+        __node = (type *)rb_tdcursor_prev(cur))
+
+/** Validate a tree
+ *
+ * This function walks the tree and validates that this is a valid red-
+ * black tree.  If anything is wrong, it will assert-fail.
+ */
+void rb_tdtree_validate(const struct rb_tdtree *T);
+
+#endif /* RB_TDTREE_H */
@@ -20,7 +20,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
-#include "rb_tree.h"
+#include "rb_tree_augmented.h"
 
 /** \file rb_tree.c
  *
@@ -33,299 +33,371 @@
  * NULL for the leaves instead of a sentinel.  This means we have to do a
  * tiny bit more tracking in our implementation of delete but it makes the
  * algorithms far more explicit than stashing stuff in the sentinel.
+ *
+ * The insert and delete algorithms themselves live in rb_tree_augmented.h
+ * so that they can be inlined along with the augmentation callbacks.
  */
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
-static bool
-rb_node_is_black(struct rb_node *n)
+void
+rb_tree_init(struct rb_tree *T)
 {
-    /* NULL nodes are leaves and therefore black */
-    return (n == NULL) || (n->parent & 1);
+    T->root = NULL;
 }
 
-static bool
-rb_node_is_red(struct rb_node *n)
+#ifdef RB_TREE_STATS
+#if defined(__GNUC__)
+__thread struct rb_tree_stats rb_tree_thread_stats;
+#else
+_Thread_local struct rb_tree_stats rb_tree_thread_stats;
+#endif
+#endif
+
+void
+rb_tree_stats_get(struct rb_tree_stats *stats)
 {
-    return !rb_node_is_black(n);
+#ifdef RB_TREE_STATS
+    *stats = rb_tree_thread_stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
 }
 
-static void
-rb_node_set_black(struct rb_node *n)
+void
+rb_tree_stats_reset(void)
 {
-    n->parent |= 1;
+#ifdef RB_TREE_STATS
+    memset(&rb_tree_thread_stats, 0, sizeof(rb_tree_thread_stats));
+#endif
 }
 
-static void
-rb_node_set_red(struct rb_node *n)
+static size_t
+rb_counted_node_compute(struct rb_counted_node *n)
 {
-    n->parent &= ~1ull;
+    return rb_counted_node_count(n->node.left) + 1 +
+           rb_counted_node_count(n->node.right);
 }
 
-static void
-rb_node_copy_color(struct rb_node *dst, struct rb_node *src)
+RB_DECLARE_CALLBACKS(static, rb_counted_callbacks, struct rb_counted_node,
+                     node, size_t, count, rb_counted_node_compute);
+
+void
+rb_tree_insert_at(struct rb_tree *T, struct rb_node *parent,
+                  struct rb_node *node, bool insert_left)
 {
-    dst->parent = (dst->parent & ~1ull) | (src->parent & 1);
+    rb_tree_insert_at_augmented(T, parent, node, insert_left, NULL);
 }
 
-static void
-rb_node_set_parent(struct rb_node *n, struct rb_node *p)
+void
+rb_tree_insert_at_counted(struct rb_tree *T, struct rb_node *parent,
+                          struct rb_counted_node *node, bool insert_left)
 {
-    n->parent = (n->parent & 1) | (uintptr_t)p;
+    rb_tree_insert_at_augmented(T, parent, &node->node, insert_left,
+                                &rb_counted_callbacks);
 }
 
+/**
+ * Link nodes[0..count) into a perfectly balanced subtree and return its root
+ *
+ * Splitting at the midpoint every time means that every NULL leaf ends up
+ * at a depth of either floor(log2(count + 1)) or one more than that.  If we
+ * color every node above red_depth black and the nodes on the bottom-most
+ * (possibly partial) level red, every path has the same number of black
+ * nodes and no red node has a red child.
+ */
 static struct rb_node *
-rb_node_minimum(struct rb_node *node)
+rb_tree_build_subtree(struct rb_node **nodes, size_t count,
+                      unsigned depth, unsigned red_depth)
 {
-    while (node->left)
-        node = node->left;
-    return node;
+    if (count == 0)
+        return NULL;
+
+    size_t mid = count / 2;
+    struct rb_node *n = nodes[mid];
+
+    n->parent = 0;
+    n->left = rb_tree_build_subtree(nodes, mid, depth + 1, red_depth);
+    n->right = rb_tree_build_subtree(nodes + mid + 1, count - mid - 1,
+                                     depth + 1, red_depth);
+    if (n->left)
+        rb_node_set_parent(n->left, n);
+    if (n->right)
+        rb_node_set_parent(n->right, n);
+
+    if (depth < red_depth)
+        rb_node_set_black(n);
+
+    return n;
 }
 
-static struct rb_node *
-rb_node_maximum(struct rb_node *node)
+void
+rb_tree_build_sorted(struct rb_tree *T, struct rb_node **nodes, size_t count)
 {
-    while (node->right)
-        node = node->right;
-    return node;
+    assert(T->root == NULL);
+
+    /* The number of complete levels, floor(log2(count + 1)) */
+    unsigned red_depth = 0;
+    while ((count + 1) >> (red_depth + 1))
+        red_depth++;
+
+    T->root = rb_tree_build_subtree(nodes, count, 0, red_depth);
 }
 
 void
-rb_tree_init(struct rb_tree *T)
+rb_tree_remove(struct rb_tree *T, struct rb_node *z)
 {
-    T->root = NULL;
+    rb_tree_remove_augmented(T, z, NULL);
 }
 
-/**
- * Replace the subtree of T rooted at u with the subtree rooted at v
- *
- * This is called RB-transplant in CLRS.
- *
- * The node to be replaced is assumed to be a non-leaf.
- */
-static void
-rb_tree_splice(struct rb_tree *T, struct rb_node *u, struct rb_node *v)
+void
+rb_tree_remove_counted(struct rb_tree *T, struct rb_counted_node *z)
 {
-    assert(u);
-    struct rb_node *p = rb_node_parent(u);
-    if (p == NULL) {
-        assert(T->root == u);
-        T->root = v;
-    } else if (u == p->left) {
-        p->left = v;
-    } else {
-        assert(u == p->right);
-        p->right = v;
-    }
-    if (v)
-        rb_node_set_parent(v, p);
+    rb_tree_remove_augmented(T, &z->node, &rb_counted_callbacks);
 }
 
-static void
-rb_tree_rotate_left(struct rb_tree *T, struct rb_node *x)
+void
+rb_tree_replace_node(struct rb_tree *T, struct rb_node *old_node,
+                     struct rb_node *new_node)
 {
-    assert(x && x->right);
+    struct rb_node *p = rb_node_parent(old_node);
+    if (p == NULL)
+        T->root = new_node;
+    else if (p->left == old_node)
+        p->left = new_node;
+    else
+        p->right = new_node;
 
-    struct rb_node *y = x->right;
-    x->right = y->left;
-    if (y->left)
-        rb_node_set_parent(y->left, x);
-    rb_tree_splice(T, x, y);
-    y->left = x;
-    rb_node_set_parent(x, y);
+    /* This copies the parent, color and children */
+    *new_node = *old_node;
+    if (new_node->left)
+        rb_node_set_parent(new_node->left, new_node);
+    if (new_node->right)
+        rb_node_set_parent(new_node->right, new_node);
 }
 
-static void
-rb_tree_rotate_right(struct rb_tree *T, struct rb_node *y)
+void
+rb_tree_multi_insert_at(struct rb_tree *T, struct rb_node *parent,
+                        struct rb_multi_node *node, bool insert_left)
 {
-    assert(y && y->left);
-
-    struct rb_node *x = y->left;
-    y->left = x->right;
-    if (x->right)
-        rb_node_set_parent(x->right, y);
-    rb_tree_splice(T, y, x);
-    x->right = y;
-    rb_node_set_parent(y, x);
+    node->next = node;
+    node->prev = node;
+    rb_tree_insert_at(T, parent, &node->node, insert_left);
 }
 
 void
-rb_tree_insert_at(struct rb_tree *T, struct rb_node *parent,
-                  struct rb_node *node, bool insert_left)
+rb_multi_node_append(struct rb_multi_node *head, struct rb_multi_node *node)
 {
-    /* This sets null children, parent, and a color of red */
-    memset(node, 0, sizeof(*node));
+    assert(rb_multi_node_is_head(head));
 
-    if (parent == NULL) {
-        assert(T->root == NULL);
-        T->root = node;
-        rb_node_set_black(node);
+    /* Mark the node as not being in the tree */
+    node->node.parent = 0;
+    node->node.left = NULL;
+    node->node.right = NULL;
+
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void
+rb_tree_multi_remove(struct rb_tree *T, struct rb_multi_node *node)
+{
+    if (node->next == node) {
+        assert(rb_multi_node_is_head(node));
+        rb_tree_remove(T, &node->node);
         return;
     }
 
-    if (insert_left) {
-        assert(parent->left == NULL);
-        parent->left = node;
-    } else {
-        assert(parent->right == NULL);
-        parent->right = node;
-    }
-    rb_node_set_parent(node, parent);
-
-    /* Now we do the insertion fixup */
-    struct rb_node *z = node;
-    while (rb_node_is_red(rb_node_parent(z))) {
-        struct rb_node *z_p = rb_node_parent(z);
-        assert(z == z_p->left || z == z_p->right);
-        struct rb_node *z_p_p = rb_node_parent(z_p);
-        assert(z_p_p != NULL);
-        if (z_p == z_p_p->left) {
-            struct rb_node *y = z_p_p->right;
-            if (rb_node_is_red(y)) {
-                rb_node_set_black(z_p);
-                rb_node_set_black(y);
-                rb_node_set_red(z_p_p);
-                z = z_p_p;
-            } else {
-                if (z == z_p->right) {
-                    z = z_p;
-                    rb_tree_rotate_left(T, z);
-                    /* We changed z */
-                    z_p = rb_node_parent(z);
-                    assert(z == z_p->left || z == z_p->right);
-                    z_p_p = rb_node_parent(z_p);
-                }
-                rb_node_set_black(z_p);
-                rb_node_set_red(z_p_p);
-                rb_tree_rotate_right(T, z_p_p);
-            }
+    /* The next node in the bucket takes over as its head */
+    if (rb_multi_node_is_head(node))
+        rb_tree_replace_node(T, &node->node, &node->next->node);
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+}
+
+struct rb_multi_node *
+rb_tree_multi_first(struct rb_tree *T)
+{
+    return rb_multi_node_from_rb(rb_tree_first(T));
+}
+
+struct rb_multi_node *
+rb_tree_multi_last(struct rb_tree *T)
+{
+    struct rb_multi_node *head = rb_multi_node_from_rb(rb_tree_last(T));
+    return head ? head->prev : NULL;
+}
+
+struct rb_multi_node *
+rb_multi_node_next(struct rb_multi_node *n)
+{
+    /* After the last node of a bucket comes the first of the next one */
+    if (!rb_multi_node_is_head(n->next))
+        return n->next;
+
+    return rb_multi_node_from_rb(rb_node_next(&n->next->node));
+}
+
+struct rb_multi_node *
+rb_multi_node_prev(struct rb_multi_node *n)
+{
+    if (!rb_multi_node_is_head(n))
+        return n->prev;
+
+    struct rb_multi_node *head = rb_multi_node_from_rb(rb_node_prev(&n->node));
+    return head ? head->prev : NULL;
+}
+
+void
+rb_tree_destroy(struct rb_tree *T,
+                void (*free_cb)(struct rb_node *, void *), void *data)
+{
+    /* Walk the tree in post-order, unlinking each leaf from its parent
+     * before handing it to free_cb.  Nothing is ever re-balanced and,
+     * because we always come back up through the parent links, this
+     * doesn't need a stack.
+     */
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        if (x->left) {
+            x = x->left;
+        } else if (x->right) {
+            x = x->right;
         } else {
-            struct rb_node *y = z_p_p->left;
-            if (rb_node_is_red(y)) {
-                rb_node_set_black(z_p);
-                rb_node_set_black(y);
-                rb_node_set_red(z_p_p);
-                z = z_p_p;
-            } else {
-                if (z == z_p->left) {
-                    z = z_p;
-                    rb_tree_rotate_right(T, z);
-                    /* We changed z */
-                    z_p = rb_node_parent(z);
-                    assert(z == z_p->left || z == z_p->right);
-                    z_p_p = rb_node_parent(z_p);
-                }
-                rb_node_set_black(z_p);
-                rb_node_set_red(z_p_p);
-                rb_tree_rotate_left(T, z_p_p);
+            struct rb_node *p = rb_node_parent(x);
+            if (p) {
+                if (p->left == x)
+                    p->left = NULL;
+                else
+                    p->right = NULL;
             }
+            if (free_cb)
+                free_cb(x, data);
+            x = p;
         }
     }
-    rb_node_set_black(T->root);
+
+    T->root = NULL;
 }
 
 void
-rb_tree_remove(struct rb_tree *T, struct rb_node *z)
+rb_tree_cached_init(struct rb_tree_cached *T)
 {
-    /* x_p is always the parent node of X.  We have to track this
-     * separately because x may be NULL.
-     */
-    struct rb_node *x, *x_p;
-    struct rb_node *y = z;
-    bool y_was_black = rb_node_is_black(y);
-    if (z->left == NULL) {
-        x = z->right;
-        x_p = rb_node_parent(z);
-        rb_tree_splice(T, z, x);
-    } else if (z->right == NULL) {
-        x = z->left;
-        x_p = rb_node_parent(z);
-        rb_tree_splice(T, z, x);
-    } else {
-        /* Find the minimum sub-node of z->right */
-        y = rb_node_minimum(z->right);
-        y_was_black = rb_node_is_black(y);
+    rb_tree_init(&T->tree);
+    T->first = NULL;
+    T->last = NULL;
+}
 
-        x = y->right;
-        if (rb_node_parent(y) == z) {
-            x_p = y;
-        } else {
-            x_p = rb_node_parent(y);
-            rb_tree_splice(T, y, x);
-            y->right = z->right;
-            rb_node_set_parent(y->right, y);
-        }
-        assert(y->left == NULL);
-        rb_tree_splice(T, z, y);
-        y->left = z->left;
-        rb_node_set_parent(y->left, y);
-        rb_node_copy_color(y, z);
+void
+rb_tree_cached_insert_at(struct rb_tree_cached *T, struct rb_node *parent,
+                         struct rb_node *node, bool insert_left)
+{
+    if (parent == NULL) {
+        T->first = node;
+        T->last = node;
+    } else if (insert_left && parent == T->first) {
+        T->first = node;
+    } else if (!insert_left && parent == T->last) {
+        T->last = node;
     }
 
-    assert(x_p == NULL || x == x_p->left || x == x_p->right);
+    rb_tree_insert_at(&T->tree, parent, node, insert_left);
+}
 
-    if (!y_was_black)
-        return;
+void
+rb_tree_cached_remove(struct rb_tree_cached *T, struct rb_node *node)
+{
+    /* The first node has no left child so its successor is either its
+     * parent or its right child, which can have no children of its own
+     * without breaking the black height.  The same goes for the last node
+     * on the other side.  Either way, this is O(1).
+     */
+    if (node == T->first)
+        T->first = rb_node_next(node);
+    if (node == T->last)
+        T->last = rb_node_prev(node);
 
-    /* Fixup RB tree after the delete */
-    while (x != T->root && rb_node_is_black(x)) {
-        if (x == x_p->left) {
-            struct rb_node *w = x_p->right;
-            if (rb_node_is_red(w)) {
-                rb_node_set_black(w);
-                rb_node_set_red(x_p);
-                rb_tree_rotate_left(T, x_p);
-                assert(x == x_p->left);
-                w = x_p->right;
-            }
-            if (rb_node_is_black(w->left) && rb_node_is_black(w->right)) {
-                rb_node_set_red(w);
-                x = x_p;
-            } else {
-                if (rb_node_is_black(w->right)) {
-                    rb_node_set_black(w->left);
-                    rb_node_set_red(w);
-                    rb_tree_rotate_right(T, w);
-                    w = x_p->right;
-                }
-                rb_node_copy_color(w, x_p);
-                rb_node_set_black(x_p);
-                rb_node_set_black(w->right);
-                rb_tree_rotate_left(T, x_p);
-                x = T->root;
-            }
-        } else {
-            struct rb_node *w = x_p->left;
-            if (rb_node_is_red(w)) {
-                rb_node_set_black(w);
-                rb_node_set_red(x_p);
-                rb_tree_rotate_right(T, x_p);
-                assert(x == x_p->right);
-                w = x_p->left;
-            }
-            if (rb_node_is_black(w->right) && rb_node_is_black(w->left)) {
-                rb_node_set_red(w);
-                x = x_p;
-            } else {
-                if (rb_node_is_black(w->left)) {
-                    rb_node_set_black(w->right);
-                    rb_node_set_red(w);
-                    rb_tree_rotate_left(T, w);
-                    w = x_p->left;
-                }
-                rb_node_copy_color(w, x_p);
-                rb_node_set_black(x_p);
-                rb_node_set_black(w->left);
-                rb_tree_rotate_right(T, x_p);
-                x = T->root;
-            }
-        }
-        x_p = rb_node_parent(x);
+    rb_tree_remove(&T->tree, node);
+}
+
+struct rb_node *
+rb_tree_cached_pop_first(struct rb_tree_cached *T)
+{
+    struct rb_node *node = T->first;
+    if (node == NULL)
+        return NULL;
+
+    assert(node->left == NULL);
+    T->first = node->right ? node->right : rb_node_parent(node);
+    if (node == T->last)
+        T->last = NULL;
+
+    rb_tree_remove(&T->tree, node);
+
+    return node;
+}
+
+void
+rb_tree_threaded_init(struct rb_tree_threaded *T)
+{
+    rb_tree_init(&T->tree);
+    T->first = NULL;
+    T->last = NULL;
+}
+
+void
+rb_tree_threaded_insert_at(struct rb_tree_threaded *T,
+                           struct rb_node *parent,
+                           struct rb_threaded_node *node, bool insert_left)
+{
+    /* A new left child comes right before its parent and a new right
+     * child right after it.
+     */
+    struct rb_threaded_node *p = rb_threaded_node_from_rb(parent);
+    if (p == NULL) {
+        node->prev = NULL;
+        node->next = NULL;
+    } else if (insert_left) {
+        node->prev = p->prev;
+        node->next = p;
+    } else {
+        node->prev = p;
+        node->next = p->next;
     }
-    if (x)
-        rb_node_set_black(x);
+
+    if (node->prev)
+        node->prev->next = node;
+    else
+        T->first = node;
+
+    if (node->next)
+        node->next->prev = node;
+    else
+        T->last = node;
+
+    rb_tree_insert_at(&T->tree, parent, &node->node, insert_left);
+}
+
+void
+rb_tree_threaded_remove(struct rb_tree_threaded *T,
+                        struct rb_threaded_node *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        T->first = node->next;
+
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        T->last = node->prev;
+
+    rb_tree_remove(&T->tree, &node->node);
 }
 
 struct rb_node *
@@ -384,6 +456,428 @@ rb_node_prev(struct rb_node *node)
     }
 }
 
+struct rb_node *
+rb_tree_select(struct rb_tree *T, size_t k)
+{
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        size_t left_count = rb_counted_node_count(x->left);
+        if (k < left_count) {
+            x = x->left;
+        } else if (k == left_count) {
+            return x;
+        } else {
+            k -= left_count + 1;
+            x = x->right;
+        }
+    }
+
+    return NULL;
+}
+
+size_t
+rb_node_rank(struct rb_node *node)
+{
+    size_t rank = rb_counted_node_count(node->left);
+    for (struct rb_node *p = rb_node_parent(node); p;
+         node = p, p = rb_node_parent(p)) {
+        if (node == p->right)
+            rank += rb_counted_node_count(p->left) + 1;
+    }
+    return rank;
+}
+
+/** A free-standing subtree along with its black height
+ *
+ * The join and split algorithms below need to know the black height of
+ * every tree they touch.  Re-computing it each time would cost O(log n)
+ * per join so we carry it around instead.  The root is always black.
+ */
+struct rb_subtree {
+    struct rb_node *root;
+    unsigned black_height;
+};
+
+static unsigned
+rb_node_black_height(struct rb_node *n)
+{
+    unsigned h = 0;
+    for (; n; n = n->left) {
+        if (rb_node_is_black(n))
+            h++;
+    }
+    return h;
+}
+
+static struct rb_subtree
+rb_subtree_from_tree(const struct rb_tree *T)
+{
+    struct rb_subtree s = { T->root, rb_node_black_height(T->root) };
+    return s;
+}
+
+/**
+ * Turn a child of a black node with black height parent_height into a
+ * free-standing subtree.
+ */
+static struct rb_subtree
+rb_subtree_detach(struct rb_node *n, unsigned parent_height)
+{
+    struct rb_subtree s = { n, parent_height - 1 };
+    if (n) {
+        rb_node_set_parent(n, NULL);
+        if (rb_node_is_red(n)) {
+            rb_node_set_black(n);
+            s.black_height++;
+        }
+    }
+    return s;
+}
+
+/**
+ * Join l and r using pivot as the node between them
+ *
+ * Everything in l must sort before pivot and everything in r after it.
+ * This walks down the spine of the taller tree until it finds a black node
+ * with the same black height as the shorter tree, hangs the pivot there as
+ * a red node and then runs the regular insertion fixup.  The cost is
+ * O(|l.black_height - r.black_height| + 1).
+ */
+static struct rb_subtree
+rb_subtree_join(struct rb_subtree l, struct rb_node *pivot,
+                struct rb_subtree r)
+{
+    /* This sets null children, parent, and a color of red */
+    memset(pivot, 0, sizeof(*pivot));
+
+    if (l.black_height == r.black_height) {
+        pivot->left = l.root;
+        pivot->right = r.root;
+        if (l.root)
+            rb_node_set_parent(l.root, pivot);
+        if (r.root)
+            rb_node_set_parent(r.root, pivot);
+        rb_node_set_black(pivot);
+
+        struct rb_subtree s = { pivot, l.black_height + 1 };
+        return s;
+    }
+
+    struct rb_tree T;
+    struct rb_node *p = NULL;
+    unsigned h;
+    if (l.black_height > r.black_height) {
+        struct rb_node *x = l.root;
+        h = l.black_height;
+        while (!rb_node_is_black(x) || h != r.black_height) {
+            if (rb_node_is_black(x))
+                h--;
+            p = x;
+            x = x->right;
+        }
+        assert(p != NULL);
+
+        pivot->left = x;
+        pivot->right = r.root;
+        p->right = pivot;
+        T.root = l.root;
+        h = l.black_height;
+    } else {
+        struct rb_node *x = r.root;
+        h = r.black_height;
+        while (!rb_node_is_black(x) || h != l.black_height) {
+            if (rb_node_is_black(x))
+                h--;
+            p = x;
+            x = x->left;
+        }
+        assert(p != NULL);
+
+        pivot->left = l.root;
+        pivot->right = x;
+        p->left = pivot;
+        T.root = r.root;
+        h = r.black_height;
+    }
+
+    rb_node_set_parent(pivot, p);
+    if (pivot->left)
+        rb_node_set_parent(pivot->left, pivot);
+    if (pivot->right)
+        rb_node_set_parent(pivot->right, pivot);
+
+    rb_tree_insert_fixup(&T, pivot, NULL);
+    if (rb_node_is_red(T.root)) {
+        rb_node_set_black(T.root);
+        h++;
+    }
+
+    struct rb_subtree s = { T.root, h };
+    return s;
+}
+
+/**
+ * Join l and r with no pivot
+ *
+ * This is done by pulling the right-most node out of l and using it as
+ * the pivot.
+ */
+static struct rb_subtree
+rb_subtree_concat(struct rb_subtree l, struct rb_subtree r)
+{
+    if (l.root == NULL)
+        return r;
+    if (r.root == NULL)
+        return l;
+
+    struct rb_tree T = { l.root };
+    struct rb_node *pivot = rb_node_maximum(l.root);
+    rb_tree_remove(&T, pivot);
+
+    return rb_subtree_join(rb_subtree_from_tree(&T), pivot, r);
+}
+
+/** The key used to split a tree
+ *
+ * A tree can be split either by an opaque key, in which case cmp is used,
+ * or by another node, in which case node_cmp is used.  If equal_left is
+ * set, nodes which compare equal to the key go to the left half.
+ */
+struct rb_split_key {
+    const void *key;
+    int (*cmp)(const struct rb_node *, const void *);
+
+    const struct rb_node *node;
+    int (*node_cmp)(const struct rb_node *, const struct rb_node *);
+
+    /* If set, split by position in the tree instead of by key */
+    struct rb_node *at;
+
+    bool equal_left;
+};
+
+static bool
+rb_split_key_goes_left(const struct rb_split_key *k, const struct rb_node *x,
+                       const struct rb_node *x_left)
+{
+    if (k->at) {
+        /* The subtrees of x have already been detached so k->at's
+         * ancestors stop at the root of whichever one it's in.  If it's in
+         * neither, then k->at was an ancestor of x and we're in its left
+         * subtree.
+         */
+        if (k->at == x)
+            return false;
+        struct rb_node *n = k->at;
+        while (rb_node_parent(n))
+            n = rb_node_parent(n);
+        return n != x_left;
+    }
+
+    int c = k->node_cmp ? k->node_cmp(x, k->node) : k->cmp(x, k->key);
+    /* A positive result means the key sorts after x */
+    return c > 0 || (c == 0 && k->equal_left);
+}
+
+/**
+ * Split t into the nodes which sort before the key and those after
+ *
+ * Each level of the recursion hands one node and one of its subtrees to a
+ * join with the result of the level below it.  Because the black heights
+ * of the joined trees increase as we go back up, the joins telescope and
+ * the total cost is O(log n).
+ */
+static void
+rb_subtree_split(struct rb_subtree t, const struct rb_split_key *k,
+                 struct rb_subtree *l, struct rb_subtree *r)
+{
+    if (t.root == NULL) {
+        *l = t;
+        *r = t;
+        return;
+    }
+
+    struct rb_node *x = t.root;
+    assert(rb_node_is_black(x));
+    struct rb_subtree x_l = rb_subtree_detach(x->left, t.black_height);
+    struct rb_subtree x_r = rb_subtree_detach(x->right, t.black_height);
+
+    if (rb_split_key_goes_left(k, x, x_l.root)) {
+        rb_subtree_split(x_r, k, l, r);
+        *l = rb_subtree_join(x_l, x, *l);
+    } else {
+        rb_subtree_split(x_l, k, l, r);
+        *r = rb_subtree_join(*r, x, x_r);
+    }
+}
+
+/**
+ * Merge all of the nodes in u into t
+ *
+ * This walks u, splitting t by each node of u and recursing on the halves.
+ * If t_first is set, nodes from t end up before nodes from u which compare
+ * equal, otherwise after.
+ */
+static struct rb_subtree
+rb_subtree_union(struct rb_subtree t, struct rb_subtree u, bool t_first,
+                 int (*cmp)(const struct rb_node *, const struct rb_node *))
+{
+    if (u.root == NULL)
+        return t;
+    if (t.root == NULL)
+        return u;
+
+    struct rb_node *x = u.root;
+    struct rb_subtree x_l = rb_subtree_detach(x->left, u.black_height);
+    struct rb_subtree x_r = rb_subtree_detach(x->right, u.black_height);
+
+    struct rb_split_key k = {
+        .node = x,
+        .node_cmp = cmp,
+        .equal_left = t_first,
+    };
+    struct rb_subtree t_l, t_r;
+    rb_subtree_split(t, &k, &t_l, &t_r);
+
+    t_l = rb_subtree_union(t_l, x_l, t_first, cmp);
+    t_r = rb_subtree_union(t_r, x_r, t_first, cmp);
+
+    return rb_subtree_join(t_l, x, t_r);
+}
+
+/**
+ * Split t into the nodes which compare equal to some node in the subtree
+ * rooted at u and those which don't
+ *
+ * The tree u is only read, never modified.  Each node of u splits t into
+ * the nodes less than, equal to, and greater than it and the outer two
+ * pieces recurse into the corresponding children of u.
+ */
+static void
+rb_subtree_match(struct rb_subtree t, const struct rb_node *u,
+                 int (*cmp)(const struct rb_node *, const struct rb_node *),
+                 struct rb_subtree *match, struct rb_subtree *rest)
+{
+    if (t.root == NULL || u == NULL) {
+        struct rb_subtree empty = { NULL, 0 };
+        *match = empty;
+        *rest = t;
+        return;
+    }
+
+    struct rb_split_key k = {
+        .node = u,
+        .node_cmp = cmp,
+        .equal_left = false,
+    };
+    struct rb_subtree lt, eq, gt;
+    rb_subtree_split(t, &k, &lt, &gt);
+    k.equal_left = true;
+    rb_subtree_split(gt, &k, &eq, &gt);
+
+    struct rb_subtree match_l, rest_l, match_r, rest_r;
+    rb_subtree_match(lt, u->left, cmp, &match_l, &rest_l);
+    rb_subtree_match(gt, u->right, cmp, &match_r, &rest_r);
+
+    *match = rb_subtree_concat(rb_subtree_concat(match_l, eq), match_r);
+    *rest = rb_subtree_concat(rest_l, rest_r);
+}
+
+void
+rb_tree_join(struct rb_tree *L, struct rb_node *pivot, struct rb_tree *R)
+{
+    struct rb_subtree l = rb_subtree_from_tree(L);
+    struct rb_subtree r = rb_subtree_from_tree(R);
+
+    L->root = rb_subtree_join(l, pivot, r).root;
+    R->root = NULL;
+}
+
+void
+rb_tree_split(struct rb_tree *T, const void *key,
+              struct rb_tree *L, struct rb_tree *R,
+              int (*cmp)(const struct rb_node *, const void *))
+{
+    struct rb_subtree t = rb_subtree_from_tree(T);
+    struct rb_split_key k = {
+        .key = key,
+        .cmp = cmp,
+        .equal_left = false,
+    };
+
+    /* T may alias L or R so only write the results once we're done */
+    struct rb_subtree l, r;
+    rb_subtree_split(t, &k, &l, &r);
+    T->root = NULL;
+    L->root = l.root;
+    R->root = r.root;
+}
+
+void
+rb_tree_split_at(struct rb_tree *T, struct rb_node *node,
+                 struct rb_tree *L, struct rb_tree *R)
+{
+    struct rb_subtree t = rb_subtree_from_tree(T);
+    struct rb_split_key k = {
+        .at = node,
+    };
+
+    struct rb_subtree l, r;
+    rb_subtree_split(t, &k, &l, &r);
+    T->root = NULL;
+    L->root = l.root;
+    R->root = r.root;
+}
+
+void
+rb_tree_union(struct rb_tree *T, struct rb_tree *U,
+              int (*cmp)(const struct rb_node *, const struct rb_node *))
+{
+    struct rb_subtree t = rb_subtree_from_tree(T);
+    struct rb_subtree u = rb_subtree_from_tree(U);
+
+    /* Walk whichever tree is smaller and split the other by its nodes.
+     * The black height is a good enough estimate of the size.
+     */
+    if (u.black_height <= t.black_height)
+        T->root = rb_subtree_union(t, u, true, cmp).root;
+    else
+        T->root = rb_subtree_union(u, t, false, cmp).root;
+    U->root = NULL;
+}
+
+static void
+rb_tree_match(struct rb_tree *T, const struct rb_tree *U,
+              int (*cmp)(const struct rb_node *, const struct rb_node *),
+              bool keep_matches, struct rb_tree *D)
+{
+    assert(D == NULL || D->root == NULL);
+
+    struct rb_subtree match, rest;
+    rb_subtree_match(rb_subtree_from_tree(T), U->root, cmp, &match, &rest);
+
+    T->root = keep_matches ? match.root : rest.root;
+    if (D)
+        D->root = keep_matches ? rest.root : match.root;
+}
+
+void
+rb_tree_intersection(struct rb_tree *T, const struct rb_tree *U,
+                     struct rb_tree *D,
+                     int (*cmp)(const struct rb_node *,
+                                const struct rb_node *))
+{
+    rb_tree_match(T, U, cmp, true, D);
+}
+
+void
+rb_tree_difference(struct rb_tree *T, const struct rb_tree *U,
+                   struct rb_tree *D,
+                   int (*cmp)(const struct rb_node *, const struct rb_node *))
+{
+    rb_tree_match(T, U, cmp, false, D);
+}
+
 static void
 validate_rb_node(struct rb_node *n, int black_depth)
 {
@@ -419,3 +913,114 @@ rb_tree_validate(struct rb_tree *T)
 
     validate_rb_node(T->root, black_depth);
 }
+
+void
+rb_tree_shape_stats(struct rb_tree *T, struct rb_tree_shape *shape)
+{
+    memset(shape, 0, sizeof(*shape));
+
+    for (struct rb_node *n = T->root; n; n = n->left) {
+        if (rb_node_is_black(n))
+            shape->black_height++;
+    }
+
+    /* Walk the tree in pre-order using the parent pointers, keeping track
+     * of the depth as we go up and down.
+     */
+    size_t depth_sum = 0;
+    unsigned depth = 0;
+    struct rb_node *n = T->root;
+    while (n) {
+        assert(depth < RB_TREE_SHAPE_MAX_DEPTH);
+        shape->count++;
+        shape->depth_histogram[depth]++;
+        depth_sum += depth;
+        if (depth + 1 > shape->height)
+            shape->height = depth + 1;
+
+        if (n->left) {
+            n = n->left;
+            depth++;
+        } else if (n->right) {
+            n = n->right;
+            depth++;
+        } else {
+            /* Go up until we find a right subtree we haven't visited */
+            struct rb_node *p = rb_node_parent(n);
+            while (p && (n == p->right || p->right == NULL)) {
+                n = p;
+                p = rb_node_parent(n);
+                depth--;
+            }
+            n = p ? p->right : NULL;
+        }
+    }
+
+    if (shape->count)
+        shape->average_depth = (double)depth_sum / shape->count;
+}
+
+static size_t
+validate_rb_counted_node(struct rb_node *n)
+{
+    if (n == NULL)
+        return 0;
+
+    size_t count = validate_rb_counted_node(n->left) + 1 +
+                   validate_rb_counted_node(n->right);
+    assert(rb_node_data(struct rb_counted_node, n, node)->count == count);
+    return count;
+}
+
+void
+rb_tree_validate_counted(struct rb_tree *T)
+{
+    rb_tree_validate(T);
+    validate_rb_counted_node(T->root);
+}
+
+void
+rb_tree_validate_multi(struct rb_tree *T,
+                       int (*cmp)(const struct rb_node *,
+                                  const struct rb_node *))
+{
+    rb_tree_validate(T);
+
+    struct rb_node *prev = NULL;
+    for (struct rb_node *n = rb_tree_first(T); n; n = rb_node_next(n)) {
+        assert(prev == NULL || cmp(prev, n) > 0);
+        prev = n;
+
+        struct rb_multi_node *head = rb_multi_node_from_rb(n);
+        assert(rb_multi_node_is_head(head));
+        for (struct rb_multi_node *m = head->next; m != head; m = m->next) {
+            assert(!rb_multi_node_is_head(m));
+            assert(m->next->prev == m);
+            assert(cmp(n, &m->node) == 0);
+        }
+        assert(head->next->prev == head);
+    }
+    (void)cmp;
+    (void)prev;
+}
+
+void
+rb_tree_validate_threaded(struct rb_tree_threaded *T)
+{
+    rb_tree_validate(&T->tree);
+
+    struct rb_threaded_node *prev = NULL;
+    for (struct rb_node *n = rb_tree_first(&T->tree); n; n = rb_node_next(n)) {
+        struct rb_threaded_node *tn = rb_threaded_node_from_rb(n);
+        assert(tn->prev == prev);
+        if (prev)
+            assert(prev->next == tn);
+        else
+            assert(T->first == tn);
+        prev = tn;
+    }
+
+    if (prev)
+        assert(prev->next == NULL);
+    assert(T->last == prev);
+}
@@ -28,6 +28,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** A red-black tree node
  *
  * This struct represents a node in the red-black tree.  This struct should
@@ -88,6 +92,56 @@ rb_tree_is_empty(const struct rb_tree *T)
 #define rb_node_data(type, node, field) \
     ((type *)(((char *)(node)) - offsetof(type, field)))
 
+/** Counters of the work done by the tree operations
+ *
+ * Define RB_TREE_STATS when building both the tree and the code using it
+ * to count the comparisons, rotations and fix-up loop iterations done by
+ * the calling thread.  Without it, RB_TREE_STAT_INC compiles to nothing
+ * and all of the counters read as zero.
+ */
+struct rb_tree_stats {
+    /** Calls to rb_tree_search, search_sloppy, lower_bound and upper_bound */
+    uint64_t searches;
+
+    /** Comparisons made by those searches */
+    uint64_t search_compares;
+
+    /** Comparisons made finding where to insert nodes */
+    uint64_t insert_compares;
+
+    /** Nodes inserted */
+    uint64_t inserts;
+
+    /** Iterations of the insert fix-up loop */
+    uint64_t insert_fixups;
+
+    /** Nodes removed */
+    uint64_t removes;
+
+    /** Iterations of the remove fix-up loop */
+    uint64_t remove_fixups;
+
+    /** Rotations done by inserts and removes */
+    uint64_t rotations;
+};
+
+#ifdef RB_TREE_STATS
+#if defined(__GNUC__)
+extern __thread struct rb_tree_stats rb_tree_thread_stats;
+#else
+extern _Thread_local struct rb_tree_stats rb_tree_thread_stats;
+#endif
+#define RB_TREE_STAT_INC(counter) (rb_tree_thread_stats.counter++)
+#else
+#define RB_TREE_STAT_INC(counter) ((void)0)
+#endif
+
+/** Copy the calling thread's counters into \p stats */
+void rb_tree_stats_get(struct rb_tree_stats *stats);
+
+/** Reset the calling thread's counters to zero */
+void rb_tree_stats_reset(void);
+
 /** Insert a node into a tree at a particular location
  *
  * This function should probably not be used directly as it relies on the
@@ -107,6 +161,37 @@ rb_tree_is_empty(const struct rb_tree *T)
 void rb_tree_insert_at(struct rb_tree *T, struct rb_node *parent,
                        struct rb_node *node, bool insert_left);
 
+/** Find where a node would be inserted into a tree
+ *
+ * Returns the node which would become the parent of \p node and sets
+ * \p left to whether \p node would become its left child.  Nodes are
+ * placed after any existing nodes which compare equal.
+ */
+static inline struct rb_node *
+rb_tree_insert_parent(struct rb_tree *T, const struct rb_node *node,
+                      int (*cmp)(const struct rb_node *,
+                                 const struct rb_node *),
+                      bool *left)
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    *left = false;
+    while (x != NULL) {
+        y = x;
+        RB_TREE_STAT_INC(insert_compares);
+        *left = cmp(x, node) < 0;
+        if (*left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+
+    return y;
+}
+
 /** Insert a node into a tree
  *
  * \param   T       The red-black tree into which to insert the new node
@@ -118,6 +203,309 @@ void rb_tree_insert_at(struct rb_tree *T, struct rb_node *parent,
 static inline void
 rb_tree_insert(struct rb_tree *T, struct rb_node *node,
                int (*cmp)(const struct rb_node *, const struct rb_node *))
+{
+    bool left;
+    struct rb_node *parent = rb_tree_insert_parent(T, node, cmp, &left);
+    rb_tree_insert_at(T, parent, node, left);
+}
+
+/** A red-black tree which caches its first and last nodes
+ *
+ * This is useful for things like priority queues where the first or last
+ * node in the tree is looked at far more often than anything else.  It
+ * makes rb_tree_cached_first and rb_tree_cached_last O(1).  Such trees
+ * must only be modified with the rb_tree_cached_* functions.  Everything
+ * else which doesn't modify the tree works as usual on the embedded
+ * rb_tree.
+ */
+struct rb_tree_cached {
+    struct rb_tree tree;
+
+    /** The first (left-most) node in the tree or NULL */
+    struct rb_node *first;
+
+    /** The last (right-most) node in the tree or NULL */
+    struct rb_node *last;
+};
+
+/** Initialize a cached red-black tree */
+void rb_tree_cached_init(struct rb_tree_cached *T);
+
+/** Get the first (left-most) node in a cached tree or NULL */
+static inline struct rb_node *
+rb_tree_cached_first(const struct rb_tree_cached *T)
+{
+    return T->first;
+}
+
+/** Get the last (right-most) node in a cached tree or NULL */
+static inline struct rb_node *
+rb_tree_cached_last(const struct rb_tree_cached *T)
+{
+    return T->last;
+}
+
+/** Insert a node into a cached tree at a particular location
+ *
+ * This is the rb_tree_cached equivalent of rb_tree_insert_at.
+ */
+void rb_tree_cached_insert_at(struct rb_tree_cached *T,
+                              struct rb_node *parent,
+                              struct rb_node *node, bool insert_left);
+
+/** Insert a node into a cached tree
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree_cached_insert(struct rb_tree_cached *T, struct rb_node *node,
+                      int (*cmp)(const struct rb_node *,
+                                 const struct rb_node *))
+{
+    bool left;
+    struct rb_node *parent = rb_tree_insert_parent(&T->tree, node, cmp,
+                                                   &left);
+    rb_tree_cached_insert_at(T, parent, node, left);
+}
+
+/** Remove a node from a cached tree
+ *
+ * \param   T       The red-black tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_tree_cached_remove(struct rb_tree_cached *T, struct rb_node *node);
+
+/** Remove and return the first node in a cached tree or NULL if empty
+ *
+ * The first node never has a left child so finding its successor and
+ * unlinking it are both O(1); only the rebalancing costs more.
+ */
+struct rb_node *rb_tree_cached_pop_first(struct rb_tree_cached *T);
+
+/** A red-black tree node which is also on an in-order list
+ *
+ * Each node links to the nodes before and after it so that stepping
+ * through the tree is O(1) and a scan only touches the nodes it visits
+ * instead of climbing up and down the tree.  Trees of these nodes must be
+ * struct rb_tree_threaded and must only be modified with the
+ * rb_tree_threaded_* functions.  Searching works as usual on the embedded
+ * rb_tree and rb_node.
+ */
+struct rb_threaded_node {
+    struct rb_node node;
+
+    /** The previous node in the tree or NULL */
+    struct rb_threaded_node *prev;
+
+    /** The next node in the tree or NULL */
+    struct rb_threaded_node *next;
+};
+
+/** A red-black tree of struct rb_threaded_node */
+struct rb_tree_threaded {
+    struct rb_tree tree;
+
+    /** The first (left-most) node in the tree or NULL */
+    struct rb_threaded_node *first;
+
+    /** The last (right-most) node in the tree or NULL */
+    struct rb_threaded_node *last;
+};
+
+/** Get the rb_threaded_node containing an rb_node or NULL */
+static inline struct rb_threaded_node *
+rb_threaded_node_from_rb(struct rb_node *n)
+{
+    return n ? rb_node_data(struct rb_threaded_node, n, node) : NULL;
+}
+
+/** Initialize a threaded red-black tree */
+void rb_tree_threaded_init(struct rb_tree_threaded *T);
+
+/** Get the first (left-most) node in a threaded tree or NULL */
+static inline struct rb_threaded_node *
+rb_tree_threaded_first(const struct rb_tree_threaded *T)
+{
+    return T->first;
+}
+
+/** Get the last (right-most) node in a threaded tree or NULL */
+static inline struct rb_threaded_node *
+rb_tree_threaded_last(const struct rb_tree_threaded *T)
+{
+    return T->last;
+}
+
+/** Get the next node (to the right) in a threaded tree or NULL */
+static inline struct rb_threaded_node *
+rb_threaded_node_next(const struct rb_threaded_node *n)
+{
+    return n->next;
+}
+
+/** Get the previous node (to the left) in a threaded tree or NULL */
+static inline struct rb_threaded_node *
+rb_threaded_node_prev(const struct rb_threaded_node *n)
+{
+    return n->prev;
+}
+
+/** Insert a node into a threaded tree at a particular location
+ *
+ * This is the rb_tree_threaded equivalent of rb_tree_insert_at.  The new
+ * node's neighbors are \p parent and one of \p parent's neighbors so the
+ * list is updated in O(1).
+ */
+void rb_tree_threaded_insert_at(struct rb_tree_threaded *T,
+                                struct rb_node *parent,
+                                struct rb_threaded_node *node,
+                                bool insert_left);
+
+/** Insert a node into a threaded tree
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree_threaded_insert(struct rb_tree_threaded *T,
+                        struct rb_threaded_node *node,
+                        int (*cmp)(const struct rb_node *,
+                                   const struct rb_node *))
+{
+    bool left;
+    struct rb_node *parent = rb_tree_insert_parent(&T->tree, &node->node,
+                                                   cmp, &left);
+    rb_tree_threaded_insert_at(T, parent, node, left);
+}
+
+/** Remove a node from a threaded tree
+ *
+ * \param   T       The red-black tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_tree_threaded_remove(struct rb_tree_threaded *T,
+                             struct rb_threaded_node *node);
+
+/** Iterate over the nodes in a threaded tree
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   T       The threaded red-black tree
+ *
+ * \param   field   The rb_threaded_node field in containing data structure
+ */
+#define rb_tree_threaded_foreach(type, node, T, field) \
+   for (type *node, *__node = (type *)rb_tree_threaded_first(T); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_threaded_node *)__node, \
+                             field), true); \
+        __node = (type *)((struct rb_threaded_node *)__node)->next)
+
+/** Iterate over the nodes in a threaded tree in reverse order
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   T       The threaded red-black tree
+ *
+ * \param   field   The rb_threaded_node field in containing data structure
+ */
+#define rb_tree_threaded_foreach_rev(type, node, T, field) \
+   for (type *node, *__node = (type *)rb_tree_threaded_last(T); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_threaded_node *)__node, \
+                             field), true); \
+        __node = (type *)((struct rb_threaded_node *)__node)->prev)
+
+/** A red-black tree node which groups nodes with equal keys
+ *
+ * Trees of these nodes act as multimaps: only the first node inserted
+ * with each key is linked into the tree and the others hang off it on a
+ * list in the order they were inserted.  Duplicates therefore don't make
+ * the tree any deeper and adding or removing one doesn't rebalance it.
+ * Iterating with rb_multi_node_next visits the nodes in the same order a
+ * plain tree would, with equal keys in insertion order.
+ *
+ * Such trees must only be modified with rb_tree_multi_insert and
+ * rb_tree_multi_remove.  Searching works as usual on the embedded rb_tree
+ * and finds the first node of a bucket.
+ */
+struct rb_multi_node {
+    /** Linked into the tree for the first node of each bucket
+     *
+     * The other nodes of a bucket have a parent field of 0, which a node
+     * in a tree never has because the root is always black.
+     */
+    struct rb_node node;
+
+    /** The next and previous nodes in the bucket, which is circular */
+    struct rb_multi_node *next;
+    struct rb_multi_node *prev;
+};
+
+/** Get the rb_multi_node containing an rb_node or NULL */
+static inline struct rb_multi_node *
+rb_multi_node_from_rb(struct rb_node *n)
+{
+    return n ? rb_node_data(struct rb_multi_node, n, node) : NULL;
+}
+
+/** Returns true if a node is the first in its bucket and in the tree */
+static inline bool
+rb_multi_node_is_head(const struct rb_multi_node *n)
+{
+    return n->node.parent != 0;
+}
+
+/** Insert a node into a multimap tree at a particular location
+ *
+ * This is the rb_multi_node equivalent of rb_tree_insert_at and starts a
+ * new bucket.  There must be no node in the tree which compares equal to
+ * \p node.
+ */
+void rb_tree_multi_insert_at(struct rb_tree *T, struct rb_node *parent,
+                             struct rb_multi_node *node, bool insert_left);
+
+/** Add a node to the end of an existing bucket
+ *
+ * \param   head    The first node of the bucket, which is in the tree
+ *
+ * \param   node    The node to add, which must compare equal to \p head
+ */
+void rb_multi_node_append(struct rb_multi_node *head,
+                          struct rb_multi_node *node);
+
+/** Insert a node into a multimap tree
+ *
+ * If a node with an equal key is already in the tree, \p node goes at the
+ * end of its bucket in O(1) time once the bucket has been found.
+ * Otherwise, it is inserted into the tree as the first node of a new
+ * bucket.
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree_multi_insert(struct rb_tree *T, struct rb_multi_node *node,
+                     int (*cmp)(const struct rb_node *,
+                                const struct rb_node *))
 {
     /* This function is declared inline in the hopes that the compiler can
      * optimize away the comparison function pointer call.
@@ -126,17 +514,79 @@ rb_tree_insert(struct rb_tree *T, struct rb_node *node,
     struct rb_node *x = T->root;
     bool left = false;
     while (x != NULL) {
+        int c = cmp(x, &node->node);
+        if (c == 0) {
+            rb_multi_node_append(rb_multi_node_from_rb(x), node);
+            return;
+        }
+
         y = x;
-        left = cmp(x, node) < 0;
-        if (left)
-            x = x->left;
-        else
-            x = x->right;
+        left = c < 0;
+        x = left ? x->left : x->right;
     }
 
-    rb_tree_insert_at(T, y, node, left);
+    rb_tree_multi_insert_at(T, y, node, left);
 }
 
+/** Remove a node from a multimap tree
+ *
+ * This is O(1) unless \p node is the only node in its bucket, in which
+ * case the bucket is removed from the tree.
+ *
+ * \param   T       The red-black tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_tree_multi_remove(struct rb_tree *T, struct rb_multi_node *node);
+
+/** Get the first node in a multimap tree or NULL */
+struct rb_multi_node *rb_tree_multi_first(struct rb_tree *T);
+
+/** Get the last node in a multimap tree or NULL */
+struct rb_multi_node *rb_tree_multi_last(struct rb_tree *T);
+
+/** Get the next node in a multimap tree or NULL */
+struct rb_multi_node *rb_multi_node_next(struct rb_multi_node *n);
+
+/** Get the previous node in a multimap tree or NULL */
+struct rb_multi_node *rb_multi_node_prev(struct rb_multi_node *n);
+
+/** Iterate over the nodes in a multimap tree
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   T       The red-black tree
+ *
+ * \param   field   The rb_multi_node field in containing data structure
+ */
+#define rb_tree_multi_foreach(type, node, T, field) \
+   for (type *node, *__node = (type *)rb_tree_multi_first(T); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_multi_node *)__node, \
+                             field), true); \
+        __node = (type *)rb_multi_node_next((struct rb_multi_node *)__node))
+
+/** Build a tree from an array of sorted nodes
+ *
+ * This links the given nodes into a balanced red-black tree in a single
+ * linear pass without doing any comparisons or rotations.  The nodes must
+ * already be sorted in the order that rb_tree_insert would place them;
+ * nodes with equal keys end up in the tree in the order they appear in the
+ * array.  The tree must be empty.
+ *
+ * \param   T       The empty red-black tree to build
+ *
+ * \param   nodes   An array of \p count pointers to the nodes to insert,
+ *                  sorted in increasing order
+ *
+ * \param   count   The number of nodes in \p nodes
+ */
+void rb_tree_build_sorted(struct rb_tree *T, struct rb_node **nodes,
+                          size_t count);
+
 /** Remove a node from a tree
  *
  * \param   T       The red-black tree from which to remove the node
@@ -145,6 +595,38 @@ rb_tree_insert(struct rb_tree *T, struct rb_node *node,
  */
 void rb_tree_remove(struct rb_tree *T, struct rb_node *z);
 
+/** Replace a node in a tree with a node which isn't in the tree
+ *
+ * \p new_node takes the place, color and children of \p old_node in O(1)
+ * time without any comparisons.  It must compare equal to \p old_node or
+ * at least sort between its neighbors.  Augmented data isn't recomputed.
+ *
+ * \param   T           The red-black tree containing \p old_node
+ *
+ * \param   old_node    The node to take out of the tree
+ *
+ * \param   new_node    The node to put in its place
+ */
+void rb_tree_replace_node(struct rb_tree *T, struct rb_node *old_node,
+                          struct rb_node *new_node);
+
+/** Remove every node from a tree
+ *
+ * This tears the tree down in O(n) time without doing any re-balancing.
+ * Each node is unlinked from the tree before \p free_cb is called on it
+ * and a node's children are always handed to \p free_cb before the node
+ * itself so \p free_cb may free the containing data structure.  The tree
+ * is left empty.
+ *
+ * \param   T       The red-black tree to destroy
+ *
+ * \param   free_cb A function to call on each node or NULL
+ *
+ * \param   data    Passed through to \p free_cb
+ */
+void rb_tree_destroy(struct rb_tree *T,
+                     void (*free_cb)(struct rb_node *, void *), void *data);
+
 /** Search the tree for a node
  *
  * If a node with a matching key exists, the first matching node found will
@@ -163,8 +645,10 @@ rb_tree_search(struct rb_tree *T, const void *key,
     /* This function is declared inline in the hopes that the compiler can
      * optimize away the comparison function pointer call.
      */
+    RB_TREE_STAT_INC(searches);
     struct rb_node *x = T->root;
     while (x != NULL) {
+        RB_TREE_STAT_INC(search_compares);
         int c = cmp(x, key);
         if (c < 0)
             x = x->left;
@@ -199,10 +683,12 @@ rb_tree_search_sloppy(struct rb_tree *T, const void *key,
     /* This function is declared inline in the hopes that the compiler can
      * optimize away the comparison function pointer call.
      */
+    RB_TREE_STAT_INC(searches);
     struct rb_node *y = NULL;
     struct rb_node *x = T->root;
     while (x != NULL) {
         y = x;
+        RB_TREE_STAT_INC(search_compares);
         int c = cmp(x, key);
         if (c < 0)
             x = x->left;
@@ -215,57 +701,438 @@ rb_tree_search_sloppy(struct rb_tree *T, const void *key,
     return y;
 }
 
-/** Get the first (left-most) node in the tree or NULL */
-struct rb_node *rb_tree_first(struct rb_tree *T);
-
-/** Get the last (right-most) node in the tree or NULL */
-struct rb_node *rb_tree_last(struct rb_tree *T);
-
-/** Get the next node (to the right) in the tree or NULL */
-struct rb_node *rb_node_next(struct rb_node *node);
+#if defined(__GNUC__)
+#define rb_tree_prefetch(p) __builtin_prefetch(p)
+#else
+#define rb_tree_prefetch(p) ((void)(p))
+#endif
 
-/** Get the next previous (to the left) in the tree or NULL */
-struct rb_node *rb_node_prev(struct rb_node *node);
+/** The number of searches rb_tree_search_batch keeps in flight at once */
+#define RB_TREE_SEARCH_BATCH_SIZE 16
 
-/** Get the next node if available or the same node again.
+/** Search the tree for many keys at once
  *
- * \param   type    The type of the containing data structure
+ * This does the same thing as calling rb_tree_search for each key but
+ * runs up to RB_TREE_SEARCH_BATCH_SIZE of the searches side-by-side, taking
+ * one step of each in turn.  Each step prefetches the next node of its
+ * search so, on trees which don't fit in cache, the cache misses of the
+ * different searches overlap instead of happening one after another.
  *
- * \param   node    The variable name for current node in the iteration;
- *                  this will be declared as a pointer to \p type
+ * \param   T       The red-black tree to search
  *
- * \param   field   The rb_node field in containing data structure
- */
-#define rb_tree_node_next_if_available(type, node, field) \
-   (&node->field != NULL) ? rb_node_data(type, rb_node_next(&node->field), field) : node
-
-/** Get the previous node if available or the same node again.
+ * \param   keys    An array of \p count keys to search for
  *
- * \param   type    The type of the containing data structure
+ * \param   count   The number of keys
  *
- * \param   node    The variable name for current node in the iteration;
- *                  this will be declared as a pointer to \p type
+ * \param   out     An array of \p count results; out[i] is set to what
+ *                  rb_tree_search would return for keys[i]
  *
- * \param   field   The rb_node field in containing data structure
+ * \param   cmp     A comparison function to use to order the nodes
  */
-#define rb_tree_node_prev_if_available(type, node, field) \
-   (&node->field != NULL) ? rb_node_data(type, rb_node_prev(&node->field), field) : node
+static inline void
+rb_tree_search_batch(struct rb_tree *T, const void *const *keys,
+                     size_t count, struct rb_node **out,
+                     int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    for (size_t start = 0; start < count;
+         start += RB_TREE_SEARCH_BATCH_SIZE) {
+        size_t batch = count - start;
+        if (batch > RB_TREE_SEARCH_BATCH_SIZE)
+            batch = RB_TREE_SEARCH_BATCH_SIZE;
 
-/** Iterate over the nodes in the tree
+        /* The searches which are still running are packed at the start of
+         * active so each round only looks at those.
+         */
+        unsigned active[RB_TREE_SEARCH_BATCH_SIZE];
+        struct rb_node *x[RB_TREE_SEARCH_BATCH_SIZE];
+        unsigned num_active = batch;
+        for (unsigned i = 0; i < batch; i++) {
+            RB_TREE_STAT_INC(searches);
+            active[i] = i;
+            x[i] = T->root;
+        }
+
+        while (num_active > 0) {
+            unsigned still_active = 0;
+            for (unsigned a = 0; a < num_active; a++) {
+                unsigned i = active[a];
+                struct rb_node *n = x[i];
+                int c = 0;
+                if (n) {
+                    RB_TREE_STAT_INC(search_compares);
+                    c = cmp(n, keys[start + i]);
+                }
+                if (c == 0) {
+                    out[start + i] = n;
+                    continue;
+                }
+
+                n = c < 0 ? n->left : n->right;
+                rb_tree_prefetch(n);
+                x[i] = n;
+                active[still_active++] = i;
+            }
+            num_active = still_active;
+        }
+    }
+}
+
+/** Find the first node which does not compare less than a key
  *
- * \param   type    The type of the containing data structure
+ * Returns the left-most node which compares greater than or equal to
+ * \p key or NULL if there is no such node.
  *
- * \param   node    The variable name for current node in the iteration;
- *                  this will be declared as a pointer to \p type
+ * \param   T       The red-black tree to search
  *
- * \param   T       The red-black tree
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline struct rb_node *
+rb_tree_lower_bound(struct rb_tree *T, const void *key,
+                    int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    RB_TREE_STAT_INC(searches);
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        RB_TREE_STAT_INC(search_compares);
+        if (cmp(x, key) <= 0) {
+            y = x;
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+
+    return y;
+}
+
+/** Find the first node which compares greater than a key
+ *
+ * Returns the left-most node which compares greater than \p key or NULL
+ * if there is no such node.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline struct rb_node *
+rb_tree_upper_bound(struct rb_tree *T, const void *key,
+                    int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    RB_TREE_STAT_INC(searches);
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        RB_TREE_STAT_INC(search_compares);
+        if (cmp(x, key) < 0) {
+            y = x;
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+
+    return y;
+}
+
+/** Find the range of nodes which compare equal to a key
+ *
+ * On return, the nodes comparing equal to \p key are those from \p first
+ * up to but not including \p end.  Both are set to the same node if there
+ * are no matching nodes and \p end is NULL if the range runs to the end
+ * of the tree.  This shares the search down to the first matching node
+ * so it's cheaper than calling rb_tree_lower_bound and
+ * rb_tree_upper_bound separately.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ *
+ * \param   first   Receives the first node in the range
+ *
+ * \param   end     Receives the first node after the range
+ */
+static inline void
+rb_tree_equal_range(struct rb_tree *T, const void *key,
+                    int (*cmp)(const struct rb_node *, const void *),
+                    struct rb_node **first, struct rb_node **end)
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        int c = cmp(x, key);
+        if (c < 0) {
+            y = x;
+            x = x->left;
+        } else if (c > 0) {
+            x = x->right;
+        } else {
+            /* Found one.  The rest of the lower bound search happens in
+             * the left subtree and the rest of the upper bound search in
+             * the right.
+             */
+            struct rb_node *lo_y = x, *lo_x = x->left;
+            while (lo_x != NULL) {
+                if (cmp(lo_x, key) <= 0) {
+                    lo_y = lo_x;
+                    lo_x = lo_x->left;
+                } else {
+                    lo_x = lo_x->right;
+                }
+            }
+
+            struct rb_node *hi_x = x->right;
+            while (hi_x != NULL) {
+                if (cmp(hi_x, key) < 0) {
+                    y = hi_x;
+                    hi_x = hi_x->left;
+                } else {
+                    hi_x = hi_x->right;
+                }
+            }
+
+            *first = lo_y;
+            *end = y;
+            return;
+        }
+    }
+
+    *first = y;
+    *end = y;
+}
+
+/** Get the first (left-most) node in the tree or NULL */
+struct rb_node *rb_tree_first(struct rb_tree *T);
+
+/** Get the last (right-most) node in the tree or NULL */
+struct rb_node *rb_tree_last(struct rb_tree *T);
+
+/** Get the next node (to the right) in the tree or NULL */
+struct rb_node *rb_node_next(struct rb_node *node);
+
+/** Get the next previous (to the left) in the tree or NULL */
+struct rb_node *rb_node_prev(struct rb_node *node);
+
+/** Insert a node into a tree near a given node
+ *
+ * If \p node belongs right next to \p hint in the tree, it is linked in
+ * directly with at most two comparisons.  Otherwise, this walks up from
+ * \p hint only until it finds an ancestor whose subtree must contain
+ * \p node and then searches back down from there.  This makes inserting
+ * in nearly sorted order, such as always appending after the last node,
+ * cheap in comparisons.  Finding the neighbor of \p hint may still follow
+ * up to O(log n) parent pointers and, in the worst case, where \p hint
+ * and \p node are on opposite sides of the root, the insert costs as
+ * much as rb_tree_insert.  Nodes are placed after any existing nodes
+ * which compare equal just like rb_tree_insert.
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   hint    A node in the tree near where \p node belongs or NULL
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree_insert_hint(struct rb_tree *T, struct rb_node *hint,
+                    struct rb_node *node,
+                    int (*cmp)(const struct rb_node *, const struct rb_node *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    if (hint == NULL) {
+        rb_tree_insert(T, node, cmp);
+        return;
+    }
+
+    struct rb_node *x = hint;
+    if (cmp(hint, node) >= 0) {
+        /* node goes somewhere after hint */
+        if (hint->right == NULL) {
+            /* The next node is the first ancestor we reach from its left
+             * subtree.  Everything we pass on the way up sorts before
+             * hint so we don't need to compare against it.  We stop there
+             * instead of calling rb_node_next so that we don't walk the
+             * same path twice if node doesn't go right after hint.
+             */
+            struct rb_node *p = rb_node_parent(x);
+            while (p && x == p->right) {
+                x = p;
+                p = rb_node_parent(p);
+            }
+            if (p == NULL || cmp(p, node) < 0) {
+                rb_tree_insert_at(T, hint, node, false);
+                return;
+            }
+            x = p;
+        } else {
+            /* The next node is the left-most node in hint's right subtree
+             * and has no left child.
+             */
+            struct rb_node *next = rb_node_next(hint);
+            if (cmp(next, node) < 0) {
+                rb_tree_insert_at(T, next, node, true);
+                return;
+            }
+        }
+
+        /* Climb until we find an ancestor which sorts after node.  The
+         * subtree we came up from contains the spot for node.
+         */
+        for (struct rb_node *p = rb_node_parent(x); p;
+             x = p, p = rb_node_parent(p)) {
+            if (x == p->left && cmp(p, node) < 0)
+                break;
+        }
+    } else {
+        /* node goes somewhere before hint */
+        if (hint->left == NULL) {
+            struct rb_node *p = rb_node_parent(x);
+            while (p && x == p->left) {
+                x = p;
+                p = rb_node_parent(p);
+            }
+            if (p == NULL || cmp(p, node) >= 0) {
+                rb_tree_insert_at(T, hint, node, true);
+                return;
+            }
+            x = p;
+        } else {
+            struct rb_node *prev = rb_node_prev(hint);
+            if (cmp(prev, node) >= 0) {
+                rb_tree_insert_at(T, prev, node, false);
+                return;
+            }
+        }
+
+        for (struct rb_node *p = rb_node_parent(x); p;
+             x = p, p = rb_node_parent(p)) {
+            if (x == p->right && cmp(p, node) >= 0)
+                break;
+        }
+    }
+
+    /* Search back down from x */
+    struct rb_node *y = NULL;
+    bool left = false;
+    while (x != NULL) {
+        y = x;
+        left = cmp(x, node) < 0;
+        if (left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+
+    rb_tree_insert_at(T, y, node, left);
+}
+
+/** Get the next node (to the right) in the tree or NULL if node is NULL */
+static inline struct rb_node *
+rb_node_next_or_null(struct rb_node *n)
+{
+    return n == NULL ? NULL : rb_node_next(n);
+}
+
+/** Get the previous node (to the left) in the tree or NULL if node is NULL */
+static inline struct rb_node *
+rb_node_prev_or_null(struct rb_node *n)
+{
+    return n == NULL ? NULL : rb_node_prev(n);
+}
+
+#if defined(__GNUC__)
+#define RB_DEPRECATED __attribute__((deprecated))
+#else
+#define RB_DEPRECATED
+#endif
+
+/* Converts a possibly NULL rb_node to its containing data structure.  This
+ * only exists for the deprecated macros below.
+ */
+RB_DEPRECATED static inline void *
+rb_node_data_or_null(struct rb_node *n, size_t offset)
+{
+    return n == NULL ? NULL : (char *)n - offset;
+}
+
+/** Get the next node or NULL
+ *
+ * Deprecated: use rb_node_next_or_null on the rb_node instead.  This used
+ * to rely on rb_node_data producing a NULL-comparable pointer for a NULL
+ * node.  It now returns NULL if \p node is NULL or the last node.
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    A pointer to \p type or NULL
+ *
+ * \param   field   The rb_node field in containing data structure
+ */
+#define rb_tree_node_next_if_available(type, node, field) \
+   ((type *)rb_node_data_or_null( \
+       (node) == NULL ? NULL : rb_node_next_or_null(&(node)->field), \
+       offsetof(type, field)))
+
+/** Get the previous node or NULL
+ *
+ * Deprecated: use rb_node_prev_or_null on the rb_node instead.  This
+ * returns NULL if \p node is NULL or the first node.
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    A pointer to \p type or NULL
+ *
+ * \param   field   The rb_node field in containing data structure
+ */
+#define rb_tree_node_prev_if_available(type, node, field) \
+   ((type *)rb_node_data_or_null( \
+       (node) == NULL ? NULL : rb_node_prev_or_null(&(node)->field), \
+       offsetof(type, field)))
+
+/* The iteration macros below keep the current rb_node in a hidden __node
+ * variable and only convert it to the containing data structure once it's
+ * known not to be NULL.  Going through rb_node_data with a NULL node and
+ * checking the result is undefined behavior and optimizing compilers do
+ * take advantage of it.  __node is declared with the containing type only
+ * so that it can share the declaration with the iteration variable.
+ */
+
+/** Iterate over the nodes in the tree
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   T       The red-black tree
  *
  * \param   field   The rb_node field in containing data structure
  */
 #define rb_tree_foreach(type, node, T, field) \
-   for (type *node = rb_node_data(type, rb_tree_first(T), field); \
-        &node->field != NULL; \
-        node = rb_node_data(type, rb_node_next(&node->field), field))
+   for (type *node, *__node = (type *)rb_tree_first(T); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_node *)__node, field), true); \
+        __node = (type *)rb_node_next((struct rb_node *)__node))
 
 /** Iterate over the nodes in the tree, allowing the current node to be freed
  *
@@ -279,10 +1146,41 @@ struct rb_node *rb_node_prev(struct rb_node *node);
  * \param   field   The rb_node field in containing data structure
  */
 #define rb_tree_foreach_safe(type, node, T, field) \
-   for (type *node = rb_node_data(type, rb_tree_first(T), field), \
-           *__next = rb_tree_node_next_if_available(type, node, field); \
-        &node->field != NULL; \
-        node = __next, __next = rb_tree_node_next_if_available(type, node, field))
+   for (type *node, *__node = (type *)rb_tree_first(T), \
+           *__next = (type *)rb_node_next_or_null((struct rb_node *)__node); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_node *)__node, field), true); \
+        __node = __next, \
+        __next = (type *)rb_node_next_or_null((struct rb_node *)__node))
+
+/** Iterate over the nodes in the tree with keys in the range [lo, hi)
+ *
+ * The two ends of the range are found up-front so this doesn't need to
+ * compare each node against \p hi.  \p lo must not compare greater than
+ * \p hi.
+ *
+ * \param   type    The type of the containing data structure
+ *
+ * \param   node    The variable name for current node in the iteration;
+ *                  this will be declared as a pointer to \p type
+ *
+ * \param   T       The red-black tree
+ *
+ * \param   field   The rb_node field in containing data structure
+ *
+ * \param   lo      The inclusive lower bound key
+ *
+ * \param   hi      The exclusive upper bound key
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+#define rb_tree_foreach_range(type, node, T, field, lo, hi, cmp) \
+   for (type *node, \
+           *__node = (type *)rb_tree_lower_bound(T, lo, cmp), \
+           *__end = (type *)rb_tree_lower_bound(T, hi, cmp); \
+        __node != __end && \
+        (node = rb_node_data(type, (struct rb_node *)__node, field), true); \
+        __node = (type *)rb_node_next((struct rb_node *)__node))
 
 /** Iterate over the nodes in the tree in reverse
  *
@@ -296,9 +1194,10 @@ struct rb_node *rb_node_prev(struct rb_node *node);
  * \param   field   The rb_node field in containing data structure
  */
 #define rb_tree_foreach_rev(type, node, T, field) \
-   for (type *node = rb_node_data(type, rb_tree_last(T), field); \
-        &node->field != NULL; \
-        node = rb_node_data(type, rb_node_prev(&node->field), field))
+   for (type *node, *__node = (type *)rb_tree_last(T); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_node *)__node, field), true); \
+        __node = (type *)rb_node_prev((struct rb_node *)__node))
 
 /** Iterate over the nodes in the tree in reverse, allowing the current node to be freed
  *
@@ -312,10 +1211,446 @@ struct rb_node *rb_node_prev(struct rb_node *node);
  * \param   field   The rb_node field in containing data structure
  */
 #define rb_tree_foreach_rev_safe(type, node, T, field) \
-   for (type *node = rb_node_data(type, rb_tree_last(T), field), \
-           *__prev = rb_tree_node_prev_if_available(type, node, field);  \
-        &node->field != NULL; \
-        node = __prev, __prev = rb_tree_node_prev_if_available(type, node, field))
+   for (type *node, *__node = (type *)rb_tree_last(T), \
+           *__prev = (type *)rb_node_prev_or_null((struct rb_node *)__node); \
+        __node != NULL && \
+        (node = rb_node_data(type, (struct rb_node *)__node, field), true); \
+        __node = __prev, \
+        __prev = (type *)rb_node_prev_or_null((struct rb_node *)__node))
+
+/** Join two trees with a node between them
+ *
+ * Every node in \p L must sort before \p pivot and every node in \p R must
+ * sort after it.  The result is left in \p L and \p R is left empty.  This
+ * takes O(log n) time.
+ *
+ * \param   L       The tree of nodes less than \p pivot; receives the result
+ *
+ * \param   pivot   A node not in either tree
+ *
+ * \param   R       The tree of nodes greater than \p pivot
+ */
+void rb_tree_join(struct rb_tree *L, struct rb_node *pivot,
+                  struct rb_tree *R);
+
+/** Split a tree in two by a key
+ *
+ * After this call, \p L contains all of the nodes of \p T which compare
+ * less than \p key, \p R contains the rest, and \p T is empty.  \p T may
+ * be the same tree as \p L or \p R.  This takes O(log n) time.
+ *
+ * \param   T       The red-black tree to split
+ *
+ * \param   key     The key to split on
+ *
+ * \param   L       Receives the nodes less than \p key
+ *
+ * \param   R       Receives the nodes greater than or equal to \p key
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+void rb_tree_split(struct rb_tree *T, const void *key,
+                   struct rb_tree *L, struct rb_tree *R,
+                   int (*cmp)(const struct rb_node *, const void *));
+
+/** Split a tree in two at a node
+ *
+ * This is the same as rb_tree_split except that the split is by position
+ * rather than by key.  After this call, \p L contains the nodes of \p T
+ * which come before \p node and \p R contains \p node and the nodes after
+ * it.  Because no comparisons are needed, this can split a run of equal
+ * keys.  This takes O(log^2 n) time.
+ *
+ * \param   T       The red-black tree to split
+ *
+ * \param   node    A node in \p T
+ *
+ * \param   L       Receives the nodes before \p node
+ *
+ * \param   R       Receives \p node and the nodes after it
+ */
+void rb_tree_split_at(struct rb_tree *T, struct rb_node *node,
+                      struct rb_tree *L, struct rb_tree *R);
+
+/** Move all of the nodes in one tree into another
+ *
+ * Given equal keys, the nodes from \p T come before the nodes from \p U.
+ * The cost is O(m log(n/m + 1)) where m is the size of the smaller tree.
+ *
+ * \param   T       The red-black tree which receives the union
+ *
+ * \param   U       The red-black tree to merge in; it is left empty
+ *
+ * \param   cmp     A comparison function to use to order the nodes, as
+ *                  for rb_tree_insert
+ */
+void rb_tree_union(struct rb_tree *T, struct rb_tree *U,
+                   int (*cmp)(const struct rb_node *, const struct rb_node *));
+
+/** Remove all of the nodes from a tree whose key isn't in another tree
+ *
+ * After this call, \p T contains only those of its nodes which compare
+ * equal to some node in \p U.  The nodes removed from \p T are placed in
+ * \p D.  \p U is not modified.  The cost is O(m log(n/m + 1)).
+ *
+ * \param   T       The red-black tree to intersect
+ *
+ * \param   U       The red-black tree to intersect with
+ *
+ * \param   D       An empty tree which receives the removed nodes or NULL
+ *
+ * \param   cmp     A comparison function to use to order the nodes, as
+ *                  for rb_tree_insert
+ */
+void rb_tree_intersection(struct rb_tree *T, const struct rb_tree *U,
+                          struct rb_tree *D,
+                          int (*cmp)(const struct rb_node *,
+                                     const struct rb_node *));
+
+/** Remove all of the nodes from a tree whose key is in another tree
+ *
+ * After this call, \p T contains only those of its nodes which don't
+ * compare equal to any node in \p U.  The nodes removed from \p T are
+ * placed in \p D.  \p U is not modified.  The cost is O(m log(n/m + 1)).
+ *
+ * \param   T       The red-black tree to subtract from
+ *
+ * \param   U       The red-black tree to subtract
+ *
+ * \param   D       An empty tree which receives the removed nodes or NULL
+ *
+ * \param   cmp     A comparison function to use to order the nodes, as
+ *                  for rb_tree_insert
+ */
+void rb_tree_difference(struct rb_tree *T, const struct rb_tree *U,
+                        struct rb_tree *D,
+                        int (*cmp)(const struct rb_node *,
+                                   const struct rb_node *));
+
+/** A red-black tree node which tracks the size of its subtree
+ *
+ * Trees made of these nodes support finding the k-th node and the rank
+ * of a node in O(log n) time.  Such trees must only be modified with
+ * rb_tree_insert_counted, rb_tree_insert_at_counted and
+ * rb_tree_remove_counted.  Everything else which doesn't modify the tree,
+ * including iteration and searching, works as usual on the embedded
+ * rb_node.
+ */
+struct rb_counted_node {
+    struct rb_node node;
+
+    /** The number of nodes in the subtree rooted at this node */
+    size_t count;
+};
+
+/** Return the number of nodes in the subtree rooted at a counted node
+ *
+ * \param   n       A pointer to the rb_node in a rb_counted_node or NULL
+ */
+static inline size_t
+rb_counted_node_count(const struct rb_node *n)
+{
+    return n ? rb_node_data(struct rb_counted_node, n, node)->count : 0;
+}
+
+/** Insert a counted node into a tree at a particular location
+ *
+ * This is the rb_counted_node equivalent of rb_tree_insert_at.
+ */
+void rb_tree_insert_at_counted(struct rb_tree *T, struct rb_node *parent,
+                               struct rb_counted_node *node,
+                               bool insert_left);
+
+/** Insert a counted node into a tree
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree_insert_counted(struct rb_tree *T, struct rb_counted_node *node,
+                       int (*cmp)(const struct rb_node *,
+                                  const struct rb_node *))
+{
+    bool left;
+    struct rb_node *parent = rb_tree_insert_parent(T, &node->node, cmp,
+                                                   &left);
+    rb_tree_insert_at_counted(T, parent, node, left);
+}
+
+/** Remove a counted node from a tree
+ *
+ * \param   T       The red-black tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_tree_remove_counted(struct rb_tree *T, struct rb_counted_node *node);
+
+/** Get the k-th node (counting from 0) in a counted tree or NULL
+ *
+ * This takes O(log n) time.
+ */
+struct rb_node *rb_tree_select(struct rb_tree *T, size_t k);
+
+/** Get the position (counting from 0) of a node in a counted tree
+ *
+ * This takes O(log n) time.
+ */
+size_t rb_node_rank(struct rb_node *node);
+
+/** Count the nodes in a counted tree which compare less than a key
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to compare against
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline size_t
+rb_tree_count_less(struct rb_tree *T, const void *key,
+                   int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    size_t count = 0;
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        if (cmp(x, key) > 0) {
+            count += rb_counted_node_count(x->left) + 1;
+            x = x->right;
+        } else {
+            x = x->left;
+        }
+    }
+
+    return count;
+}
+
+/** Count the nodes in a counted tree with keys in the range [lo, hi)
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   lo      The inclusive lower bound of the range
+ *
+ * \param   hi      The exclusive upper bound of the range
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline size_t
+rb_tree_count_range(struct rb_tree *T, const void *lo, const void *hi,
+                    int (*cmp)(const struct rb_node *, const void *))
+{
+    size_t lo_count = rb_tree_count_less(T, lo, cmp);
+    size_t hi_count = rb_tree_count_less(T, hi, cmp);
+    return hi_count > lo_count ? hi_count - lo_count : 0;
+}
+
+/** A red-black tree node which keeps a prefix of its key inline
+ *
+ * Comparing against the key of a regular node means following the node
+ * back to its containing data structure, which is often in a different
+ * cache line.  A prefix node stores an ordered 64-bit prefix of its key
+ * right next to the links so that most of the comparisons during a search
+ * only touch the node itself.  The full comparison function is only called
+ * when two prefixes are equal.
+ *
+ * The prefix must be order-preserving: if one key sorts before another
+ * then its prefix must be less than or equal to the other's.  A hash is
+ * not good enough.  For keys that sort like memcmp, such as strings, use
+ * rb_key_prefix_from_bytes.
+ *
+ * Prefix nodes must be inserted with rb_tree_insert_prefix.  Removal and
+ * iteration work as usual on the embedded rb_node.
+ */
+struct rb_prefix_node {
+    struct rb_node node;
+
+    /** The order-preserving prefix of this node's key */
+    uint64_t prefix;
+};
+
+/** Build an order-preserving prefix from the first bytes of a key
+ *
+ * The first eight bytes of \p key are packed big-endian and zero-padded so
+ * that comparing the prefixes as integers orders them the same as memcmp.
+ *
+ * \param   key     The bytes of the key
+ *
+ * \param   size    The number of bytes in \p key
+ */
+static inline uint64_t
+rb_key_prefix_from_bytes(const void *key, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)key;
+    uint64_t prefix = 0;
+    for (unsigned i = 0; i < 8; i++) {
+        prefix <<= 8;
+        if (i < size)
+            prefix |= bytes[i];
+    }
+    return prefix;
+}
+
+/** Retrieve the rb_prefix_node containing a node */
+static inline const struct rb_prefix_node *
+rb_node_prefix(const struct rb_node *n)
+{
+    return rb_node_data(struct rb_prefix_node, n, node);
+}
+
+/** Insert a prefix node into a tree
+ *
+ * The prefix field of \p node must already be filled out.
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order nodes with equal
+ *                  prefixes.
+ */
+static inline void
+rb_tree_insert_prefix(struct rb_tree *T, struct rb_prefix_node *node,
+                      int (*cmp)(const struct rb_node *,
+                                 const struct rb_node *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    bool left = false;
+    while (x != NULL) {
+        uint64_t x_prefix = rb_node_prefix(x)->prefix;
+        y = x;
+        if (node->prefix != x_prefix)
+            left = node->prefix < x_prefix;
+        else
+            left = cmp(x, &node->node) < 0;
+        if (left)
+            x = x->left;
+        else
+            x = x->right;
+    }
+
+    rb_tree_insert_at(T, y, &node->node, left);
+}
+
+/** Search a tree of prefix nodes for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, NULL is returned.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   prefix  The prefix of \p key
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order nodes with equal
+ *                  prefixes
+ */
+static inline struct rb_node *
+rb_tree_search_prefix(struct rb_tree *T, uint64_t prefix, const void *key,
+                      int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        uint64_t x_prefix = rb_node_prefix(x)->prefix;
+        int c;
+        if (prefix != x_prefix)
+            c = prefix < x_prefix ? -1 : 1;
+        else
+            c = cmp(x, key);
+        if (c < 0)
+            x = x->left;
+        else if (c > 0)
+            x = x->right;
+        else
+            return x;
+    }
+
+    return x;
+}
+
+/** Get the first node in a tree of prefix nodes not less than a key
+ *
+ * This is the rb_prefix_node equivalent of rb_tree_lower_bound.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   prefix  The prefix of \p key
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order nodes with equal
+ *                  prefixes
+ */
+static inline struct rb_node *
+rb_tree_lower_bound_prefix(struct rb_tree *T, uint64_t prefix,
+                           const void *key,
+                           int (*cmp)(const struct rb_node *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    struct rb_node *y = NULL;
+    struct rb_node *x = T->root;
+    while (x != NULL) {
+        uint64_t x_prefix = rb_node_prefix(x)->prefix;
+        bool go_left;
+        if (prefix != x_prefix)
+            go_left = prefix < x_prefix;
+        else
+            go_left = cmp(x, key) <= 0;
+        if (go_left) {
+            y = x;
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+
+    return y;
+}
+
+/** The number of entries in rb_tree_shape::depth_histogram
+ *
+ * A red-black tree is at most 2 log2(n + 1) deep so this is enough for
+ * any tree which fits in a 64-bit address space.
+ */
+#define RB_TREE_SHAPE_MAX_DEPTH 128
+
+/** A summary of the shape of a red-black tree */
+struct rb_tree_shape {
+    /** The number of nodes in the tree */
+    size_t count;
+
+    /** The number of nodes on the longest path from the root to a leaf */
+    unsigned height;
+
+    /** The number of black nodes on every path from the root to a leaf */
+    unsigned black_height;
+
+    /** The average depth of a node, where the root has a depth of 0 */
+    double average_depth;
+
+    /** The number of nodes at each depth */
+    size_t depth_histogram[RB_TREE_SHAPE_MAX_DEPTH];
+};
+
+/** Measure the shape of a red-black tree
+ *
+ * This walks the whole tree once, without recursion, so it is O(n).  It
+ * works the same whether or not RB_TREE_STATS is defined.
+ */
+void rb_tree_shape_stats(struct rb_tree *T, struct rb_tree_shape *shape);
 
 /** Validate a red-black tree
  *
@@ -324,4 +1659,32 @@ struct rb_node *rb_node_prev(struct rb_node *node);
  */
 void rb_tree_validate(struct rb_tree *T);
 
+/** Validate a counted red-black tree
+ *
+ * This does everything rb_tree_validate does and also checks that the
+ * subtree counts are correct.
+ */
+void rb_tree_validate_counted(struct rb_tree *T);
+
+/** Validate a threaded red-black tree
+ *
+ * This does everything rb_tree_validate does and also checks that the
+ * in-order list and the first and last nodes match the tree.
+ */
+void rb_tree_validate_threaded(struct rb_tree_threaded *T);
+
+/** Validate a multimap red-black tree
+ *
+ * This does everything rb_tree_validate does and also checks that every
+ * bucket is well-formed, that its nodes compare equal and that no two
+ * buckets do.
+ */
+void rb_tree_validate_multi(struct rb_tree *T,
+                            int (*cmp)(const struct rb_node *,
+                                       const struct rb_node *));
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* RB_TREE_H */
@@ -0,0 +1,433 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_tree32.h"
+
+#include <assert.h>
+
+/* Node indices are used the same way as node pointers are in rb_tree.c so
+ * the code below reads the same, with N(T, i) standing in for i->.
+ */
+#define N(T, i) rb_tree32_node(T, i)
+
+static inline uint32_t
+rb_node32_parent(struct rb_tree32 *T, uint32_t n)
+{
+    /* The NULL parent is stored as the 31-bit truncation of RB_NODE32_NULL */
+    uint32_t p = N(T, n)->parent >> 1;
+    return p == RB_NODE32_MAX_COUNT ? RB_NODE32_NULL : p;
+}
+
+static inline bool
+rb_node32_is_black(struct rb_tree32 *T, uint32_t n)
+{
+    /* NULL nodes are leaves and therefore black */
+    return (n == RB_NODE32_NULL) || (N(T, n)->parent & 1);
+}
+
+static inline bool
+rb_node32_is_red(struct rb_tree32 *T, uint32_t n)
+{
+    return !rb_node32_is_black(T, n);
+}
+
+static inline void
+rb_node32_set_black(struct rb_tree32 *T, uint32_t n)
+{
+    N(T, n)->parent |= 1;
+}
+
+static inline void
+rb_node32_set_red(struct rb_tree32 *T, uint32_t n)
+{
+    N(T, n)->parent &= ~1u;
+}
+
+static inline void
+rb_node32_copy_color(struct rb_tree32 *T, uint32_t dst, uint32_t src)
+{
+    N(T, dst)->parent = (N(T, dst)->parent & ~1u) | (N(T, src)->parent & 1);
+}
+
+static inline void
+rb_node32_set_parent(struct rb_tree32 *T, uint32_t n, uint32_t p)
+{
+    N(T, n)->parent = (N(T, n)->parent & 1) | (uint32_t)(p << 1);
+}
+
+static uint32_t
+rb_node32_minimum(struct rb_tree32 *T, uint32_t node)
+{
+    while (N(T, node)->left != RB_NODE32_NULL)
+        node = N(T, node)->left;
+    return node;
+}
+
+static uint32_t
+rb_node32_maximum(struct rb_tree32 *T, uint32_t node)
+{
+    while (N(T, node)->right != RB_NODE32_NULL)
+        node = N(T, node)->right;
+    return node;
+}
+
+void
+rb_tree32_init(struct rb_tree32 *T, void *base, size_t stride)
+{
+    T->base = base;
+    T->stride = stride;
+    T->root = RB_NODE32_NULL;
+}
+
+/**
+ * Replace the subtree of T rooted at u with the subtree rooted at v
+ *
+ * This is called RB-transplant in CLRS.
+ *
+ * The node to be replaced is assumed to be a non-leaf.
+ */
+static void
+rb_tree32_splice(struct rb_tree32 *T, uint32_t u, uint32_t v)
+{
+    assert(u != RB_NODE32_NULL);
+    uint32_t p = rb_node32_parent(T, u);
+    if (p == RB_NODE32_NULL) {
+        assert(T->root == u);
+        T->root = v;
+    } else if (u == N(T, p)->left) {
+        N(T, p)->left = v;
+    } else {
+        assert(u == N(T, p)->right);
+        N(T, p)->right = v;
+    }
+    if (v != RB_NODE32_NULL)
+        rb_node32_set_parent(T, v, p);
+}
+
+static void
+rb_tree32_rotate_left(struct rb_tree32 *T, uint32_t x)
+{
+    assert(x != RB_NODE32_NULL && N(T, x)->right != RB_NODE32_NULL);
+
+    uint32_t y = N(T, x)->right;
+    N(T, x)->right = N(T, y)->left;
+    if (N(T, y)->left != RB_NODE32_NULL)
+        rb_node32_set_parent(T, N(T, y)->left, x);
+    rb_tree32_splice(T, x, y);
+    N(T, y)->left = x;
+    rb_node32_set_parent(T, x, y);
+}
+
+static void
+rb_tree32_rotate_right(struct rb_tree32 *T, uint32_t y)
+{
+    assert(y != RB_NODE32_NULL && N(T, y)->left != RB_NODE32_NULL);
+
+    uint32_t x = N(T, y)->left;
+    N(T, y)->left = N(T, x)->right;
+    if (N(T, x)->right != RB_NODE32_NULL)
+        rb_node32_set_parent(T, N(T, x)->right, y);
+    rb_tree32_splice(T, y, x);
+    N(T, x)->right = y;
+    rb_node32_set_parent(T, y, x);
+}
+
+void
+rb_tree32_insert_at(struct rb_tree32 *T, uint32_t parent,
+                    uint32_t node, bool insert_left)
+{
+    assert(node < RB_NODE32_MAX_COUNT);
+
+    /* This sets null children, parent, and a color of red */
+    N(T, node)->parent = (uint32_t)(parent << 1);
+    N(T, node)->left = RB_NODE32_NULL;
+    N(T, node)->right = RB_NODE32_NULL;
+
+    if (parent == RB_NODE32_NULL) {
+        assert(T->root == RB_NODE32_NULL);
+        T->root = node;
+        rb_node32_set_black(T, node);
+        return;
+    }
+
+    if (insert_left) {
+        assert(N(T, parent)->left == RB_NODE32_NULL);
+        N(T, parent)->left = node;
+    } else {
+        assert(N(T, parent)->right == RB_NODE32_NULL);
+        N(T, parent)->right = node;
+    }
+
+    /* Now we do the insertion fixup */
+    uint32_t z = node;
+    while (rb_node32_is_red(T, rb_node32_parent(T, z))) {
+        uint32_t z_p = rb_node32_parent(T, z);
+        assert(z == N(T, z_p)->left || z == N(T, z_p)->right);
+        uint32_t z_p_p = rb_node32_parent(T, z_p);
+        assert(z_p_p != RB_NODE32_NULL);
+        if (z_p == N(T, z_p_p)->left) {
+            uint32_t y = N(T, z_p_p)->right;
+            if (rb_node32_is_red(T, y)) {
+                rb_node32_set_black(T, z_p);
+                rb_node32_set_black(T, y);
+                rb_node32_set_red(T, z_p_p);
+                z = z_p_p;
+            } else {
+                if (z == N(T, z_p)->right) {
+                    z = z_p;
+                    rb_tree32_rotate_left(T, z);
+                    /* We changed z */
+                    z_p = rb_node32_parent(T, z);
+                    assert(z == N(T, z_p)->left || z == N(T, z_p)->right);
+                    z_p_p = rb_node32_parent(T, z_p);
+                }
+                rb_node32_set_black(T, z_p);
+                rb_node32_set_red(T, z_p_p);
+                rb_tree32_rotate_right(T, z_p_p);
+            }
+        } else {
+            uint32_t y = N(T, z_p_p)->left;
+            if (rb_node32_is_red(T, y)) {
+                rb_node32_set_black(T, z_p);
+                rb_node32_set_black(T, y);
+                rb_node32_set_red(T, z_p_p);
+                z = z_p_p;
+            } else {
+                if (z == N(T, z_p)->left) {
+                    z = z_p;
+                    rb_tree32_rotate_right(T, z);
+                    /* We changed z */
+                    z_p = rb_node32_parent(T, z);
+                    assert(z == N(T, z_p)->left || z == N(T, z_p)->right);
+                    z_p_p = rb_node32_parent(T, z_p);
+                }
+                rb_node32_set_black(T, z_p);
+                rb_node32_set_red(T, z_p_p);
+                rb_tree32_rotate_left(T, z_p_p);
+            }
+        }
+    }
+    rb_node32_set_black(T, T->root);
+}
+
+void
+rb_tree32_remove(struct rb_tree32 *T, uint32_t z)
+{
+    /* x_p is always the parent node of X.  We have to track this
+     * separately because x may be NULL.
+     */
+    uint32_t x, x_p;
+    uint32_t y = z;
+    bool y_was_black = rb_node32_is_black(T, y);
+    if (N(T, z)->left == RB_NODE32_NULL) {
+        x = N(T, z)->right;
+        x_p = rb_node32_parent(T, z);
+        rb_tree32_splice(T, z, x);
+    } else if (N(T, z)->right == RB_NODE32_NULL) {
+        x = N(T, z)->left;
+        x_p = rb_node32_parent(T, z);
+        rb_tree32_splice(T, z, x);
+    } else {
+        /* Find the minimum sub-node of z->right */
+        y = rb_node32_minimum(T, N(T, z)->right);
+        y_was_black = rb_node32_is_black(T, y);
+
+        x = N(T, y)->right;
+        if (rb_node32_parent(T, y) == z) {
+            x_p = y;
+        } else {
+            x_p = rb_node32_parent(T, y);
+            rb_tree32_splice(T, y, x);
+            N(T, y)->right = N(T, z)->right;
+            rb_node32_set_parent(T, N(T, y)->right, y);
+        }
+        assert(N(T, y)->left == RB_NODE32_NULL);
+        rb_tree32_splice(T, z, y);
+        N(T, y)->left = N(T, z)->left;
+        rb_node32_set_parent(T, N(T, y)->left, y);
+        rb_node32_copy_color(T, y, z);
+    }
+
+    assert(x_p == RB_NODE32_NULL ||
+           x == N(T, x_p)->left || x == N(T, x_p)->right);
+
+    if (!y_was_black)
+        return;
+
+    /* Fixup RB tree after the delete */
+    while (x != T->root && rb_node32_is_black(T, x)) {
+        if (x == N(T, x_p)->left) {
+            uint32_t w = N(T, x_p)->right;
+            if (rb_node32_is_red(T, w)) {
+                rb_node32_set_black(T, w);
+                rb_node32_set_red(T, x_p);
+                rb_tree32_rotate_left(T, x_p);
+                assert(x == N(T, x_p)->left);
+                w = N(T, x_p)->right;
+            }
+            if (rb_node32_is_black(T, N(T, w)->left) &&
+                rb_node32_is_black(T, N(T, w)->right)) {
+                rb_node32_set_red(T, w);
+                x = x_p;
+            } else {
+                if (rb_node32_is_black(T, N(T, w)->right)) {
+                    rb_node32_set_black(T, N(T, w)->left);
+                    rb_node32_set_red(T, w);
+                    rb_tree32_rotate_right(T, w);
+                    w = N(T, x_p)->right;
+                }
+                rb_node32_copy_color(T, w, x_p);
+                rb_node32_set_black(T, x_p);
+                rb_node32_set_black(T, N(T, w)->right);
+                rb_tree32_rotate_left(T, x_p);
+                x = T->root;
+            }
+        } else {
+            uint32_t w = N(T, x_p)->left;
+            if (rb_node32_is_red(T, w)) {
+                rb_node32_set_black(T, w);
+                rb_node32_set_red(T, x_p);
+                rb_tree32_rotate_right(T, x_p);
+                assert(x == N(T, x_p)->right);
+                w = N(T, x_p)->left;
+            }
+            if (rb_node32_is_black(T, N(T, w)->right) &&
+                rb_node32_is_black(T, N(T, w)->left)) {
+                rb_node32_set_red(T, w);
+                x = x_p;
+            } else {
+                if (rb_node32_is_black(T, N(T, w)->left)) {
+                    rb_node32_set_black(T, N(T, w)->right);
+                    rb_node32_set_red(T, w);
+                    rb_tree32_rotate_left(T, w);
+                    w = N(T, x_p)->left;
+                }
+                rb_node32_copy_color(T, w, x_p);
+                rb_node32_set_black(T, x_p);
+                rb_node32_set_black(T, N(T, w)->left);
+                rb_tree32_rotate_right(T, x_p);
+                x = T->root;
+            }
+        }
+        x_p = rb_node32_parent(T, x);
+    }
+    if (x != RB_NODE32_NULL)
+        rb_node32_set_black(T, x);
+}
+
+uint32_t
+rb_tree32_first(struct rb_tree32 *T)
+{
+    return T->root != RB_NODE32_NULL ? rb_node32_minimum(T, T->root)
+                                     : RB_NODE32_NULL;
+}
+
+uint32_t
+rb_tree32_last(struct rb_tree32 *T)
+{
+    return T->root != RB_NODE32_NULL ? rb_node32_maximum(T, T->root)
+                                     : RB_NODE32_NULL;
+}
+
+uint32_t
+rb_tree32_next(struct rb_tree32 *T, uint32_t node)
+{
+    if (N(T, node)->right != RB_NODE32_NULL) {
+        /* If we have a right child, then the next thing (compared to this
+         * node) is the left-most child of our right child.
+         */
+        return rb_node32_minimum(T, N(T, node)->right);
+    } else {
+        /* If node doesn't have a right child, crawl back up the to the
+         * left until we hit a parent to the right.
+         */
+        uint32_t p = rb_node32_parent(T, node);
+        while (p != RB_NODE32_NULL && node == N(T, p)->right) {
+            node = p;
+            p = rb_node32_parent(T, node);
+        }
+        assert(p == RB_NODE32_NULL || node == N(T, p)->left);
+        return p;
+    }
+}
+
+uint32_t
+rb_tree32_prev(struct rb_tree32 *T, uint32_t node)
+{
+    if (N(T, node)->left != RB_NODE32_NULL) {
+        /* If we have a left child, then the previous thing (compared to
+         * this node) is the right-most child of our left child.
+         */
+        return rb_node32_maximum(T, N(T, node)->left);
+    } else {
+        /* If node doesn't have a left child, crawl back up the to the
+         * right until we hit a parent to the left.
+         */
+        uint32_t p = rb_node32_parent(T, node);
+        while (p != RB_NODE32_NULL && node == N(T, p)->left) {
+            node = p;
+            p = rb_node32_parent(T, node);
+        }
+        assert(p == RB_NODE32_NULL || node == N(T, p)->right);
+        return p;
+    }
+}
+
+static void
+validate_rb_node32(struct rb_tree32 *T, uint32_t n, uint32_t parent,
+                   int black_depth)
+{
+    if (n == RB_NODE32_NULL) {
+        assert(black_depth == 0);
+        return;
+    }
+
+    assert(rb_node32_parent(T, n) == parent);
+    (void)parent;
+
+    if (rb_node32_is_black(T, n)) {
+        black_depth--;
+    } else {
+        assert(rb_node32_is_black(T, N(T, n)->left));
+        assert(rb_node32_is_black(T, N(T, n)->right));
+    }
+
+    validate_rb_node32(T, N(T, n)->left, n, black_depth);
+    validate_rb_node32(T, N(T, n)->right, n, black_depth);
+}
+
+void
+rb_tree32_validate(struct rb_tree32 *T)
+{
+    if (T->root == RB_NODE32_NULL)
+        return;
+
+    assert(rb_node32_is_black(T, T->root));
+
+    unsigned black_depth = 0;
+    for (uint32_t n = T->root; n != RB_NODE32_NULL; n = N(T, n)->left) {
+        if (rb_node32_is_black(T, n))
+            black_depth++;
+    }
+
+    validate_rb_node32(T, T->root, RB_NODE32_NULL, black_depth);
+}
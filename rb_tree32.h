@@ -0,0 +1,381 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_TREE32_H
+#define RB_TREE32_H
+
+/** \file rb_tree32.h
+ *
+ * Compact red-black trees linked by 32-bit indices
+ *
+ * A struct rb_node is 24 bytes on a 64-bit machine, which can be more than
+ * the data it indexes.  A struct rb_node32 is 12 bytes.  Instead of
+ * pointers, its links are 32-bit indices into a caller-supplied array and
+ * the color is packed into the low bit of the parent index.
+ *
+ * Nodes are referred to by their index in the array and RB_NODE32_NULL
+ * plays the role of NULL.  Because nothing in the tree stores a pointer,
+ * the array may be moved, for instance with realloc, as long as the base
+ * pointer of the tree is updated to match.  A tree can hold at most
+ * RB_NODE32_MAX_COUNT nodes.
+ *
+ * Otherwise, this is the same API as rb_tree.h with rb_tree32 in place of
+ * rb_tree and node indices in place of node pointers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The index used for "no node" */
+#define RB_NODE32_NULL UINT32_MAX
+
+/** The maximum number of nodes in a tree, as one bit goes to the color */
+#define RB_NODE32_MAX_COUNT (RB_NODE32_NULL >> 1)
+
+/** A compact red-black tree node
+ *
+ * This struct represents a node in the red-black tree.  It should be
+ * embedded as a field in each element of the array holding the tree.
+ */
+struct rb_node32 {
+    /** Parent index << 1 | the color in the low bit */
+    uint32_t parent;
+
+    uint32_t left;
+    uint32_t right;
+};
+
+/** A compact red-black tree
+ *
+ * In addition to the root, this holds where to find the nodes.  Node i
+ * lives at base + i * stride.
+ */
+struct rb_tree32 {
+    /** A pointer to the rb_node32 in the first element of the array */
+    char *base;
+
+    /** The distance in bytes between consecutive elements */
+    size_t stride;
+
+    uint32_t root;
+};
+
+/** Initialize a compact red-black tree
+ *
+ * \param   T       The tree to initialize
+ *
+ * \param   base    A pointer to the rb_node32 in the first element of the
+ *                  array which will hold the nodes
+ *
+ * \param   stride  The distance in bytes between consecutive elements
+ */
+void rb_tree32_init(struct rb_tree32 *T, void *base, size_t stride);
+
+/** Initialize a compact red-black tree for the elements of an array
+ *
+ * \param   T       The tree to initialize
+ *
+ * \param   array   A pointer to the first element of the array
+ *
+ * \param   field   The rb_node32 field in the array elements
+ */
+#define rb_tree32_init_array(T, array, field) \
+    rb_tree32_init(T, &(array)[0].field, sizeof((array)[0]))
+
+/** Returns true if the compact red-black tree is empty */
+static inline bool
+rb_tree32_is_empty(const struct rb_tree32 *T)
+{
+    return T->root == RB_NODE32_NULL;
+}
+
+/** Get the node with a given index */
+static inline struct rb_node32 *
+rb_tree32_node(const struct rb_tree32 *T, uint32_t i)
+{
+    return (struct rb_node32 *)(T->base + (size_t)i * T->stride);
+}
+
+/** Get the index of a node */
+static inline uint32_t
+rb_tree32_index(const struct rb_tree32 *T, const struct rb_node32 *n)
+{
+    return (uint32_t)(((const char *)n - T->base) / T->stride);
+}
+
+/** Insert a node into a tree at a particular location
+ *
+ * This function should probably not be used directly as it relies on the
+ * caller to ensure that the parent node is correct.  Use rb_tree32_insert
+ * instead.
+ *
+ * \param   T           The red-black tree into which to insert the new node
+ *
+ * \param   parent      The node in the tree that will be the parent of the
+ *                      newly inserted node
+ *
+ * \param   node        The node to insert
+ *
+ * \param   insert_left If true, the new node will be the left child of
+ *                      \p parent, otherwise it will be the right child
+ */
+void rb_tree32_insert_at(struct rb_tree32 *T, uint32_t parent,
+                         uint32_t node, bool insert_left);
+
+/** Insert a node into a tree
+ *
+ * \param   T       The red-black tree into which to insert the new node
+ *
+ * \param   node    The node to insert
+ *
+ * \param   cmp     A comparison function to use to order the nodes.
+ */
+static inline void
+rb_tree32_insert(struct rb_tree32 *T, uint32_t node,
+                 int (*cmp)(const struct rb_node32 *,
+                            const struct rb_node32 *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    const struct rb_node32 *n = rb_tree32_node(T, node);
+    uint32_t y = RB_NODE32_NULL;
+    uint32_t x = T->root;
+    bool left = false;
+    while (x != RB_NODE32_NULL) {
+        const struct rb_node32 *x_n = rb_tree32_node(T, x);
+        y = x;
+        left = cmp(x_n, n) < 0;
+        if (left)
+            x = x_n->left;
+        else
+            x = x_n->right;
+    }
+
+    rb_tree32_insert_at(T, y, node, left);
+}
+
+/** Remove a node from a tree
+ *
+ * \param   T       The red-black tree from which to remove the node
+ *
+ * \param   node    The node to remove
+ */
+void rb_tree32_remove(struct rb_tree32 *T, uint32_t node);
+
+/** Search the tree for a node
+ *
+ * If a node with a matching key exists, the first matching node found will
+ * be returned.  If no matching node exists, RB_NODE32_NULL is returned.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline uint32_t
+rb_tree32_search(struct rb_tree32 *T, const void *key,
+                 int (*cmp)(const struct rb_node32 *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    uint32_t x = T->root;
+    while (x != RB_NODE32_NULL) {
+        const struct rb_node32 *x_n = rb_tree32_node(T, x);
+        int c = cmp(x_n, key);
+        if (c < 0)
+            x = x_n->left;
+        else if (c > 0)
+            x = x_n->right;
+        else
+            return x;
+    }
+
+    return x;
+}
+
+/** Sloppily search the tree for a node
+ *
+ * This function searches the tree for a given node.  If a node with a
+ * matching key exists, that first matching node found will be returned.
+ * If no node with an exactly matching key exists, the node returned will
+ * be either the right-most node comparing less than \p key or the
+ * right-most node comparing greater than \p key.  If the tree is empty,
+ * RB_NODE32_NULL is returned.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline uint32_t
+rb_tree32_search_sloppy(struct rb_tree32 *T, const void *key,
+                        int (*cmp)(const struct rb_node32 *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    uint32_t y = RB_NODE32_NULL;
+    uint32_t x = T->root;
+    while (x != RB_NODE32_NULL) {
+        const struct rb_node32 *x_n = rb_tree32_node(T, x);
+        int c = cmp(x_n, key);
+        y = x;
+        if (c < 0)
+            x = x_n->left;
+        else if (c > 0)
+            x = x_n->right;
+        else
+            return x;
+    }
+
+    return y;
+}
+
+/** Find the first node which does not compare less than a key
+ *
+ * Returns the left-most node which compares greater than or equal to
+ * \p key or RB_NODE32_NULL if there is no such node.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline uint32_t
+rb_tree32_lower_bound(struct rb_tree32 *T, const void *key,
+                      int (*cmp)(const struct rb_node32 *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    uint32_t y = RB_NODE32_NULL;
+    uint32_t x = T->root;
+    while (x != RB_NODE32_NULL) {
+        const struct rb_node32 *x_n = rb_tree32_node(T, x);
+        if (cmp(x_n, key) <= 0) {
+            y = x;
+            x = x_n->left;
+        } else {
+            x = x_n->right;
+        }
+    }
+
+    return y;
+}
+
+/** Find the first node which compares greater than a key
+ *
+ * Returns the left-most node which compares greater than \p key or
+ * RB_NODE32_NULL if there is no such node.
+ *
+ * \param   T       The red-black tree to search
+ *
+ * \param   key     The key to search for
+ *
+ * \param   cmp     A comparison function to use to order the nodes
+ */
+static inline uint32_t
+rb_tree32_upper_bound(struct rb_tree32 *T, const void *key,
+                      int (*cmp)(const struct rb_node32 *, const void *))
+{
+    /* This function is declared inline in the hopes that the compiler can
+     * optimize away the comparison function pointer call.
+     */
+    uint32_t y = RB_NODE32_NULL;
+    uint32_t x = T->root;
+    while (x != RB_NODE32_NULL) {
+        const struct rb_node32 *x_n = rb_tree32_node(T, x);
+        if (cmp(x_n, key) < 0) {
+            y = x;
+            x = x_n->left;
+        } else {
+            x = x_n->right;
+        }
+    }
+
+    return y;
+}
+
+/** Get the first (left-most) node in the tree or RB_NODE32_NULL */
+uint32_t rb_tree32_first(struct rb_tree32 *T);
+
+/** Get the last (right-most) node in the tree or RB_NODE32_NULL */
+uint32_t rb_tree32_last(struct rb_tree32 *T);
+
+/** Get the next node (to the right) in the tree or RB_NODE32_NULL */
+uint32_t rb_tree32_next(struct rb_tree32 *T, uint32_t node);
+
+/** Get the previous node (to the left) in the tree or RB_NODE32_NULL */
+uint32_t rb_tree32_prev(struct rb_tree32 *T, uint32_t node);
+
+/** Iterate over the nodes in the tree
+ *
+ * \param   T       The red-black tree
+ *
+ * \param   i       The variable name for the index of the current node in
+ *                  the iteration; this will be declared as a uint32_t
+ */
+#define rb_tree32_foreach(T, i) \
+    for (uint32_t i = rb_tree32_first(T); i != RB_NODE32_NULL; \
+         i = rb_tree32_next(T, i))
+
+/** Iterate over the nodes in the tree, allowing the current node to be removed
+ *
+ * \param   T       The red-black tree
+ *
+ * \param   i       The variable name for the index of the current node in
+ *                  the iteration; this will be declared as a uint32_t
+ */
+#define rb_tree32_foreach_safe(T, i) \
+    for (uint32_t i = rb_tree32_first(T), \
+             __next = i != RB_NODE32_NULL ? rb_tree32_next(T, i) \
+                                          : RB_NODE32_NULL; \
+         i != RB_NODE32_NULL; \
+         i = __next, \
+         __next = i != RB_NODE32_NULL ? rb_tree32_next(T, i) \
+                                      : RB_NODE32_NULL)
+
+/** Iterate over the nodes in the tree in reverse
+ *
+ * \param   T       The red-black tree
+ *
+ * \param   i       The variable name for the index of the current node in
+ *                  the iteration; this will be declared as a uint32_t
+ */
+#define rb_tree32_foreach_rev(T, i) \
+    for (uint32_t i = rb_tree32_last(T); i != RB_NODE32_NULL; \
+         i = rb_tree32_prev(T, i))
+
+/** Validate a compact red-black tree
+ *
+ * This function walks the tree and validates that this is a valid red-
+ * black tree.  If anything is wrong, it will assert-fail.
+ */
+void rb_tree32_validate(struct rb_tree32 *T);
+
+#endif /* RB_TREE32_H */
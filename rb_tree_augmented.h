@@ -0,0 +1,502 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_TREE_AUGMENTED_H
+#define RB_TREE_AUGMENTED_H
+
+/** \file rb_tree_augmented.h
+ *
+ * Augmented red-black trees
+ *
+ * An augmented tree stores some extra data in each node which is computed
+ * from the node and its children, such as the size of the subtree or the
+ * largest value of some field in the subtree.  The tree manipulation
+ * functions call back into the user every time the shape of the tree
+ * changes so that data can be kept up-to-date.  Only the nodes along the
+ * path which was touched are ever re-computed.
+ *
+ * Everything in here is declared inline so that, when the callbacks are
+ * a constant, the compiler can inline them the same way it inlines the
+ * comparison function in rb_tree_insert.  rb_tree_insert_at and
+ * rb_tree_remove are just these functions with NULL callbacks.
+ */
+
+#include "rb_tree.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The core algorithms are big enough that compilers won't always inline
+ * them on their own, which would leave us with indirect calls to the
+ * callbacks.
+ */
+#if defined(__GNUC__)
+#define RB_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define RB_ALWAYS_INLINE inline
+#endif
+
+/** Callbacks used to maintain the augmented data in a tree */
+struct rb_augment_callbacks {
+    /** Re-compute the augmented data of n and each of its ancestors
+     *
+     * This walks up the tree from n re-computing each node from its
+     * children until it gets to \p stop, which may be NULL for the root.
+     * It may stop early once it finds a node, other than n itself, whose
+     * data doesn't change.
+     */
+    void (*propagate)(struct rb_node *n, struct rb_node *stop);
+
+    /** Copy the augmented data from \p old_node to \p new_node
+     *
+     * This is called when \p new_node takes over the place of
+     * \p old_node in the tree.
+     */
+    void (*copy)(struct rb_node *old_node, struct rb_node *new_node);
+
+    /** Update the augmented data after a rotation
+     *
+     * \p new_node has just taken over the place of \p old_node in the
+     * tree and \p old_node is now one of its children.  The data for
+     * \p new_node should be taken from \p old_node and the data for
+     * \p old_node re-computed.
+     */
+    void (*rotate)(struct rb_node *old_node, struct rb_node *new_node);
+};
+
+/** Declare a set of augmentation callbacks
+ *
+ * This declares propagate, copy and rotate functions along with a
+ * struct rb_augment_callbacks named \p name for the common case where
+ * the augmented data is a single field computed by a function of the
+ * node.
+ *
+ * \param   rbstatic    Storage class of the declarations, e.g. static
+ *
+ * \param   name        The name of the struct rb_augment_callbacks
+ *
+ * \param   type        The type of the containing data structure
+ *
+ * \param   field       The rb_node field in containing data structure
+ *
+ * \param   augtype     The type of the augmented field
+ *
+ * \param   augfield    The augmented field in the containing data structure
+ *
+ * \param   compute     A function or macro taking a pointer to \p type and
+ *                      returning the \p augtype value for that node
+ */
+#define RB_DECLARE_CALLBACKS(rbstatic, name, type, field,                  \
+                             augtype, augfield, compute)                   \
+static inline void                                                          \
+name##_propagate(struct rb_node *rb, struct rb_node *stop)                  \
+{                                                                           \
+    for (bool first = true; rb != stop;                                     \
+         rb = rb_node_parent(rb), first = false) {                          \
+        type *node = rb_node_data(type, rb, field);                         \
+        augtype augmented = compute(node);                                  \
+        if (!first && node->augfield == augmented)                          \
+            break;                                                          \
+        node->augfield = augmented;                                         \
+    }                                                                       \
+}                                                                           \
+static inline void                                                          \
+name##_copy(struct rb_node *rb_old, struct rb_node *rb_new)                 \
+{                                                                           \
+    rb_node_data(type, rb_new, field)->augfield =                           \
+        rb_node_data(type, rb_old, field)->augfield;                        \
+}                                                                           \
+static inline void                                                          \
+name##_rotate(struct rb_node *rb_old, struct rb_node *rb_new)               \
+{                                                                           \
+    type *old_node = rb_node_data(type, rb_old, field);                     \
+    type *new_node = rb_node_data(type, rb_new, field);                     \
+    new_node->augfield = old_node->augfield;                                \
+    old_node->augfield = compute(old_node);                                 \
+}                                                                           \
+rbstatic const struct rb_augment_callbacks name = {                         \
+    .propagate = name##_propagate,                                          \
+    .copy = name##_copy,                                                    \
+    .rotate = name##_rotate,                                                \
+}
+
+static inline bool
+rb_node_is_black(struct rb_node *n)
+{
+    /* NULL nodes are leaves and therefore black */
+    return (n == NULL) || (n->parent & 1);
+}
+
+static inline bool
+rb_node_is_red(struct rb_node *n)
+{
+    return !rb_node_is_black(n);
+}
+
+static inline void
+rb_node_set_black(struct rb_node *n)
+{
+    n->parent |= 1;
+}
+
+static inline void
+rb_node_set_red(struct rb_node *n)
+{
+    n->parent &= ~1ull;
+}
+
+static inline void
+rb_node_copy_color(struct rb_node *dst, struct rb_node *src)
+{
+    dst->parent = (dst->parent & ~1ull) | (src->parent & 1);
+}
+
+static inline void
+rb_node_set_parent(struct rb_node *n, struct rb_node *p)
+{
+    n->parent = (n->parent & 1) | (uintptr_t)p;
+}
+
+/* Store a child link or the root of a tree
+ *
+ * Lock-free readers, such as those of rb_latch_tree, may follow links
+ * while a writer is rotating nodes around.  Storing links atomically keeps
+ * the compiler from tearing or inventing stores readers could see.  A
+ * relaxed atomic store is a plain store on every platform we care about.
+ */
+static inline void
+rb_node_store_link(struct rb_node **link, struct rb_node *n)
+{
+#if defined(__GNUC__)
+    __atomic_store_n(link, n, __ATOMIC_RELAXED);
+#else
+    *link = n;
+#endif
+}
+
+static inline struct rb_node *
+rb_node_minimum(struct rb_node *node)
+{
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+static inline struct rb_node *
+rb_node_maximum(struct rb_node *node)
+{
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+/**
+ * Replace the subtree of T rooted at u with the subtree rooted at v
+ *
+ * This is called RB-transplant in CLRS.
+ *
+ * The node to be replaced is assumed to be a non-leaf.
+ */
+static inline void
+rb_tree_splice(struct rb_tree *T, struct rb_node *u, struct rb_node *v)
+{
+    assert(u);
+    struct rb_node *p = rb_node_parent(u);
+    if (p == NULL) {
+        assert(T->root == u);
+        rb_node_store_link(&T->root, v);
+    } else if (u == p->left) {
+        rb_node_store_link(&p->left, v);
+    } else {
+        assert(u == p->right);
+        rb_node_store_link(&p->right, v);
+    }
+    if (v)
+        rb_node_set_parent(v, p);
+}
+
+static RB_ALWAYS_INLINE void
+rb_tree_rotate_left(struct rb_tree *T, struct rb_node *x,
+                    const struct rb_augment_callbacks *cb)
+{
+    assert(x && x->right);
+    RB_TREE_STAT_INC(rotations);
+
+    struct rb_node *y = x->right;
+    rb_node_store_link(&x->right, y->left);
+    if (y->left)
+        rb_node_set_parent(y->left, x);
+    rb_tree_splice(T, x, y);
+    rb_node_store_link(&y->left, x);
+    rb_node_set_parent(x, y);
+
+    if (cb)
+        cb->rotate(x, y);
+}
+
+static RB_ALWAYS_INLINE void
+rb_tree_rotate_right(struct rb_tree *T, struct rb_node *y,
+                     const struct rb_augment_callbacks *cb)
+{
+    assert(y && y->left);
+    RB_TREE_STAT_INC(rotations);
+
+    struct rb_node *x = y->left;
+    rb_node_store_link(&y->left, x->right);
+    if (x->right)
+        rb_node_set_parent(x->right, y);
+    rb_tree_splice(T, y, x);
+    rb_node_store_link(&x->right, y);
+    rb_node_set_parent(y, x);
+
+    if (cb)
+        cb->rotate(y, x);
+}
+
+/**
+ * Restore the red-black properties after linking in the red node z
+ *
+ * Both of z's children must be black.  The root of the tree may be left
+ * red; it's up to the caller to paint it black.
+ */
+static RB_ALWAYS_INLINE void
+rb_tree_insert_fixup(struct rb_tree *T, struct rb_node *z,
+                     const struct rb_augment_callbacks *cb)
+{
+    while (rb_node_is_red(rb_node_parent(z))) {
+        RB_TREE_STAT_INC(insert_fixups);
+        struct rb_node *z_p = rb_node_parent(z);
+        assert(z == z_p->left || z == z_p->right);
+        struct rb_node *z_p_p = rb_node_parent(z_p);
+        assert(z_p_p != NULL);
+        if (z_p == z_p_p->left) {
+            struct rb_node *y = z_p_p->right;
+            if (rb_node_is_red(y)) {
+                rb_node_set_black(z_p);
+                rb_node_set_black(y);
+                rb_node_set_red(z_p_p);
+                z = z_p_p;
+            } else {
+                if (z == z_p->right) {
+                    z = z_p;
+                    rb_tree_rotate_left(T, z, cb);
+                    /* We changed z */
+                    z_p = rb_node_parent(z);
+                    assert(z == z_p->left || z == z_p->right);
+                    z_p_p = rb_node_parent(z_p);
+                }
+                rb_node_set_black(z_p);
+                rb_node_set_red(z_p_p);
+                rb_tree_rotate_right(T, z_p_p, cb);
+            }
+        } else {
+            struct rb_node *y = z_p_p->left;
+            if (rb_node_is_red(y)) {
+                rb_node_set_black(z_p);
+                rb_node_set_black(y);
+                rb_node_set_red(z_p_p);
+                z = z_p_p;
+            } else {
+                if (z == z_p->left) {
+                    z = z_p;
+                    rb_tree_rotate_right(T, z, cb);
+                    /* We changed z */
+                    z_p = rb_node_parent(z);
+                    assert(z == z_p->left || z == z_p->right);
+                    z_p_p = rb_node_parent(z_p);
+                }
+                rb_node_set_black(z_p);
+                rb_node_set_red(z_p_p);
+                rb_tree_rotate_left(T, z_p_p, cb);
+            }
+        }
+    }
+}
+
+/** Insert a node into an augmented tree at a particular location
+ *
+ * This is the same as rb_tree_insert_at except that it keeps the
+ * augmented data up-to-date.  The augmented data of \p node itself is
+ * computed by the propagate callback.
+ */
+static RB_ALWAYS_INLINE void
+rb_tree_insert_at_augmented(struct rb_tree *T, struct rb_node *parent,
+                            struct rb_node *node, bool insert_left,
+                            const struct rb_augment_callbacks *cb)
+{
+    RB_TREE_STAT_INC(inserts);
+
+    /* This sets null children, parent, and a color of red */
+    memset(node, 0, sizeof(*node));
+
+    if (parent == NULL) {
+        assert(T->root == NULL);
+        rb_node_store_link(&T->root, node);
+        rb_node_set_black(node);
+        if (cb)
+            cb->propagate(node, NULL);
+        return;
+    }
+
+    if (insert_left) {
+        assert(parent->left == NULL);
+        rb_node_store_link(&parent->left, node);
+    } else {
+        assert(parent->right == NULL);
+        rb_node_store_link(&parent->right, node);
+    }
+    rb_node_set_parent(node, parent);
+
+    if (cb)
+        cb->propagate(node, NULL);
+
+    rb_tree_insert_fixup(T, node, cb);
+    rb_node_set_black(T->root);
+}
+
+/** Remove a node from an augmented tree
+ *
+ * This is the same as rb_tree_remove except that it keeps the augmented
+ * data up-to-date.
+ */
+static RB_ALWAYS_INLINE void
+rb_tree_remove_augmented(struct rb_tree *T, struct rb_node *z,
+                         const struct rb_augment_callbacks *cb)
+{
+    RB_TREE_STAT_INC(removes);
+
+    /* x_p is always the parent node of X.  We have to track this
+     * separately because x may be NULL.
+     */
+    struct rb_node *x, *x_p;
+    struct rb_node *y = z;
+    bool y_was_black = rb_node_is_black(y);
+    if (z->left == NULL) {
+        x = z->right;
+        x_p = rb_node_parent(z);
+        rb_tree_splice(T, z, x);
+    } else if (z->right == NULL) {
+        x = z->left;
+        x_p = rb_node_parent(z);
+        rb_tree_splice(T, z, x);
+    } else {
+        /* Find the minimum sub-node of z->right */
+        y = rb_node_minimum(z->right);
+        y_was_black = rb_node_is_black(y);
+
+        x = y->right;
+        if (rb_node_parent(y) == z) {
+            x_p = y;
+        } else {
+            x_p = rb_node_parent(y);
+            rb_tree_splice(T, y, x);
+            rb_node_store_link(&y->right, z->right);
+            rb_node_set_parent(y->right, y);
+        }
+        assert(y->left == NULL);
+        rb_tree_splice(T, z, y);
+        rb_node_store_link(&y->left, z->left);
+        rb_node_set_parent(y->left, y);
+        rb_node_copy_color(y, z);
+    }
+
+    assert(x_p == NULL || x == x_p->left || x == x_p->right);
+
+    if (cb) {
+        /* Everything from x_p on up has lost a node.  If y has taken over
+         * z's place in the tree, it starts with z's data and we have to
+         * make sure propagation doesn't stop before it gets to y.
+         */
+        if (y != z) {
+            cb->copy(z, y);
+            if (x_p != y)
+                cb->propagate(x_p, y);
+            cb->propagate(y, NULL);
+        } else if (x_p) {
+            cb->propagate(x_p, NULL);
+        }
+    }
+
+    if (!y_was_black)
+        return;
+
+    /* Fixup RB tree after the delete */
+    while (x != T->root && rb_node_is_black(x)) {
+        RB_TREE_STAT_INC(remove_fixups);
+        if (x == x_p->left) {
+            struct rb_node *w = x_p->right;
+            if (rb_node_is_red(w)) {
+                rb_node_set_black(w);
+                rb_node_set_red(x_p);
+                rb_tree_rotate_left(T, x_p, cb);
+                assert(x == x_p->left);
+                w = x_p->right;
+            }
+            if (rb_node_is_black(w->left) && rb_node_is_black(w->right)) {
+                rb_node_set_red(w);
+                x = x_p;
+            } else {
+                if (rb_node_is_black(w->right)) {
+                    rb_node_set_black(w->left);
+                    rb_node_set_red(w);
+                    rb_tree_rotate_right(T, w, cb);
+                    w = x_p->right;
+                }
+                rb_node_copy_color(w, x_p);
+                rb_node_set_black(x_p);
+                rb_node_set_black(w->right);
+                rb_tree_rotate_left(T, x_p, cb);
+                x = T->root;
+            }
+        } else {
+            struct rb_node *w = x_p->left;
+            if (rb_node_is_red(w)) {
+                rb_node_set_black(w);
+                rb_node_set_red(x_p);
+                rb_tree_rotate_right(T, x_p, cb);
+                assert(x == x_p->right);
+                w = x_p->left;
+            }
+            if (rb_node_is_black(w->right) && rb_node_is_black(w->left)) {
+                rb_node_set_red(w);
+                x = x_p;
+            } else {
+                if (rb_node_is_black(w->left)) {
+                    rb_node_set_black(w->right);
+                    rb_node_set_red(w);
+                    rb_tree_rotate_left(T, w, cb);
+                    w = x_p->left;
+                }
+                rb_node_copy_color(w, x_p);
+                rb_node_set_black(x_p);
+                rb_node_set_black(w->left);
+                rb_tree_rotate_right(T, x_p, cb);
+                x = T->root;
+            }
+        }
+        x_p = rb_node_parent(x);
+    }
+    if (x)
+        rb_node_set_black(x);
+}
+
+#endif /* RB_TREE_AUGMENTED_H */
@@ -0,0 +1,739 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file rb_tree_bench.cpp
+ *
+ * Benchmarks for rb_tree
+ *
+ * This times rb_tree and rb_btree against std::multiset and a sorted
+ * std::vector on a set of workloads, key distributions and tree sizes and
+ * prints one line of CSV or JSON per measurement.  Build it with something
+ * like
+ *
+ *    cc -O2 -c rb_tree.c rb_btree.c
+ *    c++ -O2 -std=c++11 rb_tree_bench.cpp rb_tree.o rb_btree.o -o rb_tree_bench
+ *
+ * and run it with --help to see the options.
+ *
+ * Each combination of container, key distribution and size runs in its
+ * own child process so that the peak RSS reported for it is its own.
+ * All of the random numbers come from a fixed seed so runs are
+ * reproducible.  The sorted vector is only a baseline for building and
+ * reading; inserting into or removing from the middle of it is O(n) so
+ * the remove and mixed workloads are skipped for it.  The B+-tree is a
+ * map, so it only keeps one copy of each key in the duplicates
+ * distribution.
+ */
+
+#include "rb_btree.h"
+#include "rb_tree.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* splitmix64, which is small, fast and good enough for generating keys */
+struct rng {
+    uint64_t state;
+
+    explicit rng(uint64_t seed) : state(seed) { }
+
+    uint64_t
+    next()
+    {
+        uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return z ^ (z >> 31);
+    }
+
+    /* A uniformly distributed number in [0, n) */
+    uint64_t
+    below(uint64_t n)
+    {
+        return next() % n;
+    }
+
+    /* A uniformly distributed number in [0, 1) */
+    double
+    unit()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+/* The Zipfian generator from "Quickly Generating Billion-Record Synthetic
+ * Databases" by Gray et al., as used by YCSB.  Returns ranks in [0, n)
+ * where rank 0 is the most popular.
+ */
+struct zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+
+    zipf(uint64_t n, double theta) : n(n), theta(theta)
+    {
+        double zeta2 = 1.0 + std::pow(0.5, theta);
+        zetan = 0.0;
+        for (uint64_t i = 1; i <= n; i++)
+            zetan += std::pow((double)i, -theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    uint64_t
+    next(rng &r)
+    {
+        double u = r.unit();
+        double uz = u * zetan;
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + std::pow(0.5, theta))
+            return 1 < n ? 1 : 0;
+        uint64_t k = (uint64_t)(n * std::pow(eta * u - eta + 1.0, alpha));
+        return k < n ? k : n - 1;
+    }
+};
+
+enum key_dist {
+    DIST_SEQUENTIAL,
+    DIST_RANDOM,
+    DIST_ZIPF,
+    DIST_DUPLICATES,
+};
+
+static const char *const dist_names[] = {
+    "sequential", "random", "zipf", "duplicates",
+};
+
+/* Scramble a rank so that popular Zipfian keys are spread over the tree */
+static uint64_t
+scramble(uint64_t x)
+{
+    rng r(x);
+    return r.next();
+}
+
+static std::vector<uint64_t>
+generate_keys(key_dist dist, size_t n, uint64_t seed)
+{
+    std::vector<uint64_t> keys(n);
+    rng r(seed);
+
+    switch (dist) {
+    case DIST_SEQUENTIAL:
+        for (size_t i = 0; i < n; i++)
+            keys[i] = i;
+        break;
+    case DIST_RANDOM:
+        for (size_t i = 0; i < n; i++)
+            keys[i] = r.next();
+        break;
+    case DIST_ZIPF: {
+        zipf z(n, 0.99);
+        for (size_t i = 0; i < n; i++)
+            keys[i] = scramble(z.next(r));
+        break;
+    }
+    case DIST_DUPLICATES:
+        /* About 64 copies of each key */
+        for (size_t i = 0; i < n; i++)
+            keys[i] = scramble(r.below(n / 64 + 1));
+        break;
+    }
+
+    return keys;
+}
+
+/* Optional hardware counters from perf_event_open */
+struct counters {
+    int misses_fd = -1, instructions_fd = -1;
+
+    static int
+    open_counter(uint64_t config)
+    {
+#if defined(__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        (void)config;
+        return -1;
+#endif
+    }
+
+    void
+    open()
+    {
+#if defined(__linux__)
+        misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+        instructions_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+#endif
+    }
+
+    void
+    start()
+    {
+#if defined(__linux__)
+        for (int fd : { misses_fd, instructions_fd }) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void
+    stop()
+    {
+#if defined(__linux__)
+        for (int fd : { misses_fd, instructions_fd }) {
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+#endif
+    }
+
+    static long long
+    read_counter(int fd)
+    {
+        long long value;
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+            return -1;
+        return value;
+    }
+};
+
+struct options {
+    std::vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+    std::vector<key_dist> dists = {
+        DIST_SEQUENTIAL, DIST_RANDOM, DIST_ZIPF, DIST_DUPLICATES,
+    };
+    std::vector<std::string> containers = {
+        "rb_tree", "rb_btree", "std::multiset", "sorted_vector",
+    };
+    bool json = false;
+    bool perf = false;
+    uint64_t seed = 1;
+};
+
+/* Times one workload and prints the result */
+class bench_case {
+public:
+    bench_case(const options &opts, const char *container, key_dist dist,
+               size_t size)
+        : opts(opts), container(container), dist(dist), size(size)
+    {
+        if (opts.perf)
+            ctrs.open();
+    }
+
+    template <typename F> void
+    run(const char *workload, size_t ops, F f)
+    {
+        ctrs.start();
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        ctrs.stop();
+
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        double ns_per_op = ops ? ns / ops : 0.0;
+        double ops_per_sec = ns > 0.0 ? ops * 1e9 / ns : 0.0;
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long peak_rss_kib = usage.ru_maxrss;
+
+        long long misses = counters::read_counter(ctrs.misses_fd);
+        long long instructions = counters::read_counter(ctrs.instructions_fd);
+
+        if (opts.json) {
+            printf("{\"container\": \"%s\", \"dist\": \"%s\", \"size\": %zu, "
+                   "\"workload\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.2f, "
+                   "\"ops_per_sec\": %.0f, \"peak_rss_kib\": %ld, "
+                   "\"cache_misses\": %lld, \"instructions\": %lld}\n",
+                   container, dist_names[dist], size, workload, ops,
+                   ns_per_op, ops_per_sec, peak_rss_kib, misses,
+                   instructions);
+        } else {
+            printf("%s,%s,%zu,%s,%zu,%.2f,%.0f,%ld,%lld,%lld\n",
+                   container, dist_names[dist], size, workload, ops,
+                   ns_per_op, ops_per_sec, peak_rss_kib, misses,
+                   instructions);
+        }
+        fflush(stdout);
+    }
+
+private:
+    const options &opts;
+    const char *container;
+    key_dist dist;
+    size_t size;
+    counters ctrs;
+};
+
+/* Keep the compiler from throwing away results we never look at */
+static volatile uint64_t sink;
+
+struct bench_node {
+    uint64_t key;
+    struct rb_node node;
+};
+
+static int
+bench_node_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+    uint64_t ka = rb_node_data(struct bench_node, a, node)->key;
+    uint64_t kb = rb_node_data(struct bench_node, b, node)->key;
+    return (kb > ka) - (kb < ka);
+}
+
+static int
+bench_node_cmp_key(const struct rb_node *n, const void *key)
+{
+    uint64_t kn = rb_node_data(struct bench_node, n, node)->key;
+    uint64_t k = *(const uint64_t *)key;
+    return (k > kn) - (k < kn);
+}
+
+struct workload_keys {
+    /* The keys to insert */
+    std::vector<uint64_t> keys;
+
+    /* Keys in the tree, in a random order, for searching and removing */
+    std::vector<uint64_t> hits;
+
+    /* Random keys, which are usually not in the tree */
+    std::vector<uint64_t> misses;
+
+    /* New keys for the mixed workload */
+    std::vector<uint64_t> fresh;
+};
+
+static void
+bench_rb_tree(bench_case &bc, const workload_keys &w)
+{
+    const size_t n = w.keys.size();
+    std::vector<bench_node> nodes(n);
+    struct rb_tree tree;
+    rb_tree_init(&tree);
+
+    bc.run("insert", n, [&] {
+        for (size_t i = 0; i < n; i++) {
+            nodes[i].key = w.keys[i];
+            rb_tree_insert(&tree, &nodes[i].node, bench_node_cmp);
+        }
+    });
+
+    bc.run("search", n, [&] {
+        uint64_t found = 0;
+        for (uint64_t key : w.hits)
+            found += rb_tree_search(&tree, &key, bench_node_cmp_key) != NULL;
+        sink = found;
+    });
+
+    bc.run("search_sloppy", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : w.misses) {
+            struct rb_node *x =
+                rb_tree_search_sloppy(&tree, &key, bench_node_cmp_key);
+            sum += rb_node_data(struct bench_node, x, node)->key;
+        }
+        sink = sum;
+    });
+
+    bc.run("iterate", n, [&] {
+        uint64_t sum = 0;
+        rb_tree_foreach(struct bench_node, x, &tree, node)
+            sum += x->key;
+        sink = sum;
+    });
+
+    /* A quarter of the operations replace a node's key, the rest search */
+    bc.run("mixed", n, [&] {
+        uint64_t found = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (i % 4 == 0) {
+                struct bench_node *x = &nodes[i];
+                rb_tree_remove(&tree, &x->node);
+                x->key = w.fresh[i];
+                rb_tree_insert(&tree, &x->node, bench_node_cmp);
+            } else {
+                uint64_t key = w.hits[i];
+                found += rb_tree_search(&tree, &key,
+                                        bench_node_cmp_key) != NULL;
+            }
+        }
+        sink = found;
+    });
+
+    bc.run("remove", n, [&] {
+        for (size_t i = 0; i < n; i++)
+            rb_tree_remove(&tree, &nodes[i].node);
+    });
+}
+
+static void
+bench_rb_btree(bench_case &bc, const workload_keys &w)
+{
+    const size_t n = w.keys.size();
+    struct rb_btree tree;
+    rb_btree_init(&tree);
+
+    bool ok = true;
+    bc.run("insert", n, [&] {
+        for (uint64_t key : w.keys)
+            ok &= rb_btree_insert(&tree, key, NULL);
+    });
+    if (!ok) {
+        fprintf(stderr, "rb_btree_insert: out of memory\n");
+        exit(1);
+    }
+
+    bc.run("search", n, [&] {
+        uint64_t found = 0;
+        for (uint64_t key : w.hits)
+            found += rb_btree_iter_valid(rb_btree_search(&tree, key));
+        sink = found;
+    });
+
+    bc.run("search_sloppy", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : w.misses) {
+            struct rb_btree_iter it = rb_btree_search_sloppy(&tree, key);
+            sum += rb_btree_iter_key(it);
+        }
+        sink = sum;
+    });
+
+    bc.run("lower_bound", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : w.misses) {
+            struct rb_btree_iter it = rb_btree_lower_bound(&tree, key);
+            if (rb_btree_iter_valid(it))
+                sum += rb_btree_iter_key(it);
+        }
+        sink = sum;
+    });
+
+    bc.run("iterate", n, [&] {
+        uint64_t sum = 0;
+        rb_btree_foreach(&tree, it)
+            sum += rb_btree_iter_key(it);
+        sink = sum;
+    });
+
+    /* Keys are removed by value, like std::multiset */
+    bc.run("mixed", n, [&] {
+        uint64_t found = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (i % 4 == 0) {
+                rb_btree_remove(&tree, w.keys[i]);
+                ok &= rb_btree_insert(&tree, w.fresh[i], NULL);
+            } else {
+                struct rb_btree_iter it = rb_btree_search(&tree, w.hits[i]);
+                found += rb_btree_iter_valid(it);
+            }
+        }
+        sink = found;
+    });
+    if (!ok) {
+        fprintf(stderr, "rb_btree_insert: out of memory\n");
+        exit(1);
+    }
+
+    bc.run("remove", n, [&] {
+        for (size_t i = 0; i < n; i++)
+            rb_btree_remove(&tree, i % 4 == 0 ? w.fresh[i] : w.keys[i]);
+    });
+
+    rb_btree_finish(&tree);
+}
+
+static void
+bench_multiset(bench_case &bc, const workload_keys &w)
+{
+    const size_t n = w.keys.size();
+    std::multiset<uint64_t> set;
+
+    bc.run("insert", n, [&] {
+        for (uint64_t key : w.keys)
+            set.insert(key);
+    });
+
+    bc.run("search", n, [&] {
+        uint64_t found = 0;
+        for (uint64_t key : w.hits)
+            found += set.find(key) != set.end();
+        sink = found;
+    });
+
+    /* The closest thing to a sloppy search is a lower bound */
+    bc.run("search_sloppy", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : w.misses) {
+            auto it = set.lower_bound(key);
+            if (it != set.end())
+                sum += *it;
+        }
+        sink = sum;
+    });
+
+    bc.run("iterate", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : set)
+            sum += key;
+        sink = sum;
+    });
+
+    /* Unlike rb_tree, we have to find a node before we can remove it */
+    bc.run("mixed", n, [&] {
+        uint64_t found = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (i % 4 == 0) {
+                set.erase(set.find(w.keys[i]));
+                set.insert(w.fresh[i]);
+            } else {
+                found += set.find(w.hits[i]) != set.end();
+            }
+        }
+        sink = found;
+    });
+
+    bc.run("remove", n, [&] {
+        for (size_t i = 0; i < n; i++)
+            set.erase(set.find(i % 4 == 0 ? w.fresh[i] : w.keys[i]));
+    });
+}
+
+static void
+bench_sorted_vector(bench_case &bc, const workload_keys &w)
+{
+    const size_t n = w.keys.size();
+    std::vector<uint64_t> vec;
+
+    /* The only reasonable way to fill a sorted array is all at once */
+    bc.run("insert", n, [&] {
+        vec = w.keys;
+        std::stable_sort(vec.begin(), vec.end());
+    });
+
+    bc.run("search", n, [&] {
+        uint64_t found = 0;
+        for (uint64_t key : w.hits)
+            found += std::binary_search(vec.begin(), vec.end(), key);
+        sink = found;
+    });
+
+    bc.run("search_sloppy", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : w.misses) {
+            auto it = std::lower_bound(vec.begin(), vec.end(), key);
+            if (it != vec.end())
+                sum += *it;
+        }
+        sink = sum;
+    });
+
+    bc.run("iterate", n, [&] {
+        uint64_t sum = 0;
+        for (uint64_t key : vec)
+            sum += key;
+        sink = sum;
+    });
+}
+
+static workload_keys
+generate_workload(key_dist dist, size_t n, uint64_t seed)
+{
+    workload_keys w;
+    w.keys = generate_keys(dist, n, seed);
+    w.fresh = generate_keys(dist, n, seed + 1);
+
+    /* Sequential keys are inserted in order but searched for at random */
+    w.hits = w.keys;
+    rng r(seed + 2);
+    for (size_t i = n; i > 1; i--)
+        std::swap(w.hits[i - 1], w.hits[r.below(i)]);
+
+    w.misses.resize(n);
+    for (size_t i = 0; i < n; i++)
+        w.misses[i] = r.next();
+
+    return w;
+}
+
+static void
+run_case(const options &opts, const std::string &container, key_dist dist,
+         size_t size)
+{
+    workload_keys w = generate_workload(dist, size, opts.seed);
+    bench_case bc(opts, container.c_str(), dist, size);
+
+    if (container == "rb_tree")
+        bench_rb_tree(bc, w);
+    else if (container == "rb_btree")
+        bench_rb_btree(bc, w);
+    else if (container == "std::multiset")
+        bench_multiset(bc, w);
+    else
+        bench_sorted_vector(bc, w);
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --sizes N,N,...        tree sizes (default 1000,10000,100000,1000000)\n"
+            "  --dists D,D,...        key distributions: sequential, random,\n"
+            "                         zipf, duplicates (default all)\n"
+            "  --containers C,C,...   rb_tree, rb_btree, std::multiset,\n"
+            "                         sorted_vector (default all)\n"
+            "  --seed N               random seed (default 1)\n"
+            "  --json                 print JSON lines instead of CSV\n"
+            "  --perf                 count cache misses and instructions\n",
+            argv0);
+}
+
+static std::vector<std::string>
+split(const char *s)
+{
+    std::vector<std::string> parts;
+    std::string cur;
+    for (; *s; s++) {
+        if (*s == ',') {
+            parts.push_back(cur);
+            cur.clear();
+        } else {
+            cur += *s;
+        }
+    }
+    parts.push_back(cur);
+    return parts;
+}
+
+static bool
+parse_options(int argc, char **argv, options &opts)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--sizes" && has_value) {
+            opts.sizes.clear();
+            for (const std::string &s : split(argv[++i]))
+                opts.sizes.push_back(strtoull(s.c_str(), NULL, 0));
+        } else if (arg == "--dists" && has_value) {
+            opts.dists.clear();
+            for (const std::string &s : split(argv[++i])) {
+                const size_t num_dists = sizeof(dist_names) / sizeof(dist_names[0]);
+                size_t d = 0;
+                while (d < num_dists && s != dist_names[d])
+                    d++;
+                if (d == num_dists)
+                    return false;
+                opts.dists.push_back((key_dist)d);
+            }
+        } else if (arg == "--containers" && has_value) {
+            opts.containers = split(argv[++i]);
+            for (const std::string &c : opts.containers) {
+                if (c != "rb_tree" && c != "rb_btree" &&
+                    c != "std::multiset" && c != "sorted_vector")
+                    return false;
+            }
+        } else if (arg == "--seed" && has_value) {
+            opts.seed = strtoull(argv[++i], NULL, 0);
+        } else if (arg == "--json") {
+            opts.json = true;
+        } else if (arg == "--perf") {
+            opts.perf = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    options opts;
+    if (!parse_options(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!opts.json) {
+        printf("container,dist,size,workload,ops,ns_per_op,ops_per_sec,"
+               "peak_rss_kib,cache_misses,instructions\n");
+        fflush(stdout);
+    }
+
+    for (size_t size : opts.sizes) {
+        for (key_dist dist : opts.dists) {
+            for (const std::string &container : opts.containers) {
+                pid_t pid = fork();
+                if (pid < 0) {
+                    perror("fork");
+                    return 1;
+                } else if (pid == 0) {
+                    run_case(opts, container, dist, size);
+                    exit(0);
+                }
+
+                int status;
+                if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                    WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "%s/%s/%zu failed\n", container.c_str(),
+                            dist_names[dist], size);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
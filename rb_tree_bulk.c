@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rb_tree_bulk.h"
+
+/** \file rb_tree_bulk.c
+ *
+ * Parallel bulk loading of red-black trees
+ *
+ * Bulk loading happens in three phases, each of which is spread across a
+ * set of worker threads:
+ *
+ *  1. Each thread sorts one contiguous chunk of the array.
+ *
+ *  2. Sorted runs are merged pairwise until only one is left.  Every merge
+ *     is split into equal slices of output by binary searching for the
+ *     matching split points in the two inputs so all threads stay busy
+ *     even when only one merge is left.
+ *
+ *  3. The sorted array is cut into one chunk per thread with a single
+ *     pivot node between neighboring chunks.  Each chunk is turned into a
+ *     tree with rb_tree_build_sorted and the trees are then stitched back
+ *     together with rb_tree_join, which is only O(log n) per join.
+ *
+ * All of the sorting is stable so nodes with equal keys keep their order.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Below this many nodes per thread, it isn't worth spinning up threads */
+#define RB_BULK_MIN_NODES_PER_THREAD 4096
+
+/* Runs shorter than this are sorted with insertion sort */
+#define RB_BULK_INSERTION_SORT_MAX 16
+
+typedef int (*rb_bulk_cmp_t)(const struct rb_node *, const struct rb_node *);
+
+/** Returns true if a sorts strictly before b */
+static inline bool
+rb_bulk_less(rb_bulk_cmp_t cmp, const struct rb_node *a,
+             const struct rb_node *b)
+{
+    /* cmp(x, n) < 0 means that n goes to the left of x */
+    return cmp(b, a) < 0;
+}
+
+/** Stably merge a and b into dst, taking from a first on ties */
+static void
+rb_bulk_merge(struct rb_node **dst,
+              struct rb_node *const *a, size_t a_len,
+              struct rb_node *const *b, size_t b_len,
+              rb_bulk_cmp_t cmp)
+{
+    size_t i = 0, j = 0;
+    while (i < a_len && j < b_len) {
+        if (rb_bulk_less(cmp, b[j], a[i]))
+            *dst++ = b[j++];
+        else
+            *dst++ = a[i++];
+    }
+    memcpy(dst, a + i, (a_len - i) * sizeof(*a));
+    dst += a_len - i;
+    memcpy(dst, b + j, (b_len - j) * sizeof(*b));
+}
+
+/** Stably sort a in place, using tmp as scratch space of the same size */
+static void
+rb_bulk_sort(struct rb_node **a, struct rb_node **tmp, size_t n,
+             rb_bulk_cmp_t cmp)
+{
+    if (n <= RB_BULK_INSERTION_SORT_MAX) {
+        for (size_t i = 1; i < n; i++) {
+            struct rb_node *x = a[i];
+            size_t j = i;
+            while (j > 0 && rb_bulk_less(cmp, x, a[j - 1])) {
+                a[j] = a[j - 1];
+                j--;
+            }
+            a[j] = x;
+        }
+        return;
+    }
+
+    size_t mid = n / 2;
+    rb_bulk_sort(a, tmp, mid, cmp);
+    rb_bulk_sort(a + mid, tmp + mid, n - mid, cmp);
+
+    /* Nearly sorted input is common so skip the merge if we can */
+    if (!rb_bulk_less(cmp, a[mid], a[mid - 1]))
+        return;
+
+    rb_bulk_merge(tmp, a, mid, a + mid, n - mid, cmp);
+    memcpy(a, tmp, n * sizeof(*a));
+}
+
+/**
+ * Return how many elements of a are among the first k elements of the
+ * stable merge of a and b
+ */
+static size_t
+rb_bulk_co_rank(size_t k,
+                struct rb_node *const *a, size_t a_len,
+                struct rb_node *const *b, size_t b_len,
+                rb_bulk_cmp_t cmp)
+{
+    size_t lo = k > b_len ? k - b_len : 0;
+    size_t hi = k < a_len ? k : a_len;
+    while (lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        size_t j = k - i;
+        /* If a[i] doesn't sort after b[j - 1], it belongs in the output
+         * before b[j - 1] so we need more of a.
+         */
+        if (j > 0 && !rb_bulk_less(cmp, b[j - 1], a[i]))
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+struct rb_bulk_job {
+    void (*func)(struct rb_bulk_job *job);
+    rb_bulk_cmp_t cmp;
+
+    /* Sort and build jobs work on src[0..count).  Merge jobs produce
+     * dst[out_start..out_end) from the merge of src[0..a_len) and
+     * src[a_len..a_len + b_len).
+     */
+    struct rb_node **src;
+    struct rb_node **dst;
+    size_t count;
+    size_t a_len, b_len;
+    size_t out_start, out_end;
+
+    /* Build jobs put their result here */
+    struct rb_tree tree;
+
+    pthread_t thread;
+    bool started;
+};
+
+static void
+rb_bulk_sort_job(struct rb_bulk_job *job)
+{
+    rb_bulk_sort(job->src, job->dst, job->count, job->cmp);
+}
+
+static void
+rb_bulk_merge_job(struct rb_bulk_job *job)
+{
+    struct rb_node *const *a = job->src;
+    struct rb_node *const *b = job->src + job->a_len;
+
+    size_t a_start = rb_bulk_co_rank(job->out_start, a, job->a_len,
+                                     b, job->b_len, job->cmp);
+    size_t a_end = rb_bulk_co_rank(job->out_end, a, job->a_len,
+                                   b, job->b_len, job->cmp);
+    size_t b_start = job->out_start - a_start;
+    size_t b_end = job->out_end - a_end;
+
+    rb_bulk_merge(job->dst + job->out_start,
+                  a + a_start, a_end - a_start,
+                  b + b_start, b_end - b_start, job->cmp);
+}
+
+static void
+rb_bulk_build_job(struct rb_bulk_job *job)
+{
+    rb_tree_init(&job->tree);
+    rb_tree_build_sorted(&job->tree, job->src, job->count);
+}
+
+static void *
+rb_bulk_thread(void *data)
+{
+    struct rb_bulk_job *job = data;
+    job->func(job);
+    return NULL;
+}
+
+/** Run all of the jobs, one per thread, and wait for them to finish */
+static void
+rb_bulk_run(struct rb_bulk_job *jobs, unsigned num_jobs)
+{
+    for (unsigned i = 1; i < num_jobs; i++) {
+        jobs[i].started = pthread_create(&jobs[i].thread, NULL,
+                                         rb_bulk_thread, &jobs[i]) == 0;
+        /* If we can't get another thread, just do the work ourselves */
+        if (!jobs[i].started)
+            jobs[i].func(&jobs[i]);
+    }
+
+    if (num_jobs > 0)
+        jobs[0].func(&jobs[0]);
+
+    for (unsigned i = 1; i < num_jobs; i++) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].thread, NULL);
+    }
+}
+
+bool
+rb_tree_bulk_load(struct rb_tree *T, struct rb_node **nodes, size_t count,
+                  rb_bulk_cmp_t cmp, unsigned num_threads)
+{
+    assert(T->root == NULL);
+
+    if (num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if (num_threads > count / RB_BULK_MIN_NODES_PER_THREAD)
+        num_threads = count / RB_BULK_MIN_NODES_PER_THREAD;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    struct rb_node **tmp = malloc(count * sizeof(*tmp));
+    /* There's one more job than thread while merging an odd run count */
+    struct rb_bulk_job *jobs = calloc(num_threads + 1, sizeof(*jobs));
+    size_t *runs = malloc((num_threads + 1) * sizeof(*runs));
+    if ((count > 0 && tmp == NULL) || jobs == NULL || runs == NULL) {
+        free(tmp);
+        free(jobs);
+        free(runs);
+        return false;
+    }
+
+    /* Phase 1: sort one chunk per thread */
+    unsigned num_runs = num_threads;
+    for (unsigned i = 0; i <= num_runs; i++)
+        runs[i] = (size_t)((unsigned long long)count * i / num_runs);
+
+    for (unsigned i = 0; i < num_runs; i++) {
+        jobs[i].func = rb_bulk_sort_job;
+        jobs[i].cmp = cmp;
+        jobs[i].src = nodes + runs[i];
+        jobs[i].dst = tmp + runs[i];
+        jobs[i].count = runs[i + 1] - runs[i];
+    }
+    rb_bulk_run(jobs, num_runs);
+
+    /* Phase 2: merge pairs of runs, ping-ponging between the two arrays */
+    struct rb_node **src = nodes, **dst = tmp;
+    while (num_runs > 1) {
+        unsigned num_merges = num_runs / 2;
+        unsigned slices = num_threads / num_merges;
+        unsigned num_jobs = 0;
+
+        for (unsigned m = 0; m < num_merges; m++) {
+            size_t start = runs[2 * m];
+            size_t mid = runs[2 * m + 1];
+            size_t end = runs[2 * m + 2];
+            for (unsigned s = 0; s < slices; s++) {
+                struct rb_bulk_job *job = &jobs[num_jobs++];
+                job->func = rb_bulk_merge_job;
+                job->cmp = cmp;
+                job->src = src + start;
+                job->dst = dst + start;
+                job->a_len = mid - start;
+                job->b_len = end - mid;
+                job->out_start = (end - start) * s / slices;
+                job->out_end = (end - start) * (s + 1) / slices;
+            }
+        }
+
+        /* An odd run out just gets copied across */
+        if (num_runs & 1) {
+            size_t start = runs[num_runs - 1];
+            struct rb_bulk_job *job = &jobs[num_jobs++];
+            job->func = rb_bulk_merge_job;
+            job->cmp = cmp;
+            job->src = src + start;
+            job->dst = dst + start;
+            job->a_len = runs[num_runs] - start;
+            job->b_len = 0;
+            job->out_start = 0;
+            job->out_end = job->a_len;
+        }
+
+        rb_bulk_run(jobs, num_jobs);
+
+        unsigned new_num_runs = (num_runs + 1) / 2;
+        for (unsigned i = 0; i <= new_num_runs; i++)
+            runs[i] = runs[2 * i < num_runs ? 2 * i : num_runs];
+        num_runs = new_num_runs;
+
+        struct rb_node **swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != nodes)
+        memcpy(nodes, src, count * sizeof(*nodes));
+
+    /* Phase 3: build one tree per chunk with a pivot between each pair of
+     * chunks and then join them all together.
+     */
+    unsigned num_chunks = num_threads;
+    size_t start = 0;
+    for (unsigned i = 0; i < num_chunks; i++) {
+        size_t end = (size_t)((unsigned long long)count * (i + 1) /
+                              num_chunks);
+        /* Every chunk but the last gives up its last node as a pivot */
+        if (i + 1 < num_chunks)
+            end--;
+
+        jobs[i].func = rb_bulk_build_job;
+        jobs[i].src = nodes + start;
+        jobs[i].count = end - start;
+        start = end + 1;
+    }
+    rb_bulk_run(jobs, num_chunks);
+
+    *T = jobs[0].tree;
+    for (unsigned i = 1; i < num_chunks; i++) {
+        struct rb_node *pivot = jobs[i].src[-1];
+        rb_tree_join(T, pivot, &jobs[i].tree);
+    }
+
+    free(tmp);
+    free(jobs);
+    free(runs);
+
+    return true;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_TREE_BULK_H
+#define RB_TREE_BULK_H
+
+#include "rb_tree.h"
+
+/** Build a tree from an unsorted array of nodes using multiple threads
+ *
+ * This sorts \p nodes in place with a parallel, stable merge sort, builds
+ * one subtree per thread with rb_tree_build_sorted and then stitches the
+ * subtrees together with rb_tree_join.  Nodes with equal keys end up in
+ * the tree in the order they appear in the array, just as if they had
+ * been inserted one at a time with rb_tree_insert.  The tree must be
+ * empty.
+ *
+ * \param   T           The empty red-black tree to build
+ *
+ * \param   nodes       An array of \p count pointers to the nodes to
+ *                      insert; on success it is left sorted
+ *
+ * \param   count       The number of nodes in \p nodes
+ *
+ * \param   cmp         A comparison function to use to order the nodes,
+ *                      as for rb_tree_insert.  It will be called from
+ *                      multiple threads at once.
+ *
+ * \param   num_threads The maximum number of threads to use or 0 to use
+ *                      one per online CPU
+ *
+ * \return  True on success, false if memory could not be allocated in
+ *          which case neither \p T nor \p nodes is modified
+ */
+bool rb_tree_bulk_load(struct rb_tree *T, struct rb_node **nodes,
+                       size_t count,
+                       int (*cmp)(const struct rb_node *,
+                                  const struct rb_node *),
+                       unsigned num_threads);
+
+#endif /* RB_TREE_BULK_H */
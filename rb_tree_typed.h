@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2017 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RB_TREE_TYPED_H
+#define RB_TREE_TYPED_H
+
+/** \file rb_tree_typed.h
+ *
+ * Type-specialized red-black trees
+ *
+ * The generic functions in rb_tree.h take the comparison function as a
+ * pointer and rely on the compiler to inline it.  That doesn't happen when
+ * the function lives in another file and rb_tree_insert_at and
+ * rb_tree_remove are never specialized at all.  RB_TREE_DEFINE instead
+ * stamps out a complete set of typed functions for one kind of tree with
+ * the key extraction and comparison written directly into them.
+ */
+
+#include "rb_tree_augmented.h"
+
+/** Define a type-specialized red-black tree
+ *
+ * This declares a struct prefix##_tree along with the following static
+ * inline functions, where type is the containing data structure:
+ *
+ *     void prefix_init(struct prefix_tree *T);
+ *     bool prefix_is_empty(const struct prefix_tree *T);
+ *     void prefix_insert(struct prefix_tree *T, type *node);
+ *     void prefix_remove(struct prefix_tree *T, type *node);
+ *     type *prefix_search(struct prefix_tree *T, key_type key);
+ *     type *prefix_lower_bound(struct prefix_tree *T, key_type key);
+ *     type *prefix_upper_bound(struct prefix_tree *T, key_type key);
+ *     type *prefix_first(struct prefix_tree *T);
+ *     type *prefix_last(struct prefix_tree *T);
+ *     type *prefix_next(type *node);
+ *     type *prefix_prev(type *node);
+ *
+ * These behave just like their rb_tree_* counterparts.  The underlying
+ * struct rb_tree is available as the tree member so anything else in
+ * rb_tree.h can still be used on it.
+ *
+ * \param   prefix      The prefix for the generated names
+ *
+ * \param   type        The type of the containing data structure
+ *
+ * \param   field       The rb_node field in containing data structure
+ *
+ * \param   key_type    The type of the key
+ *
+ * \param   key_expr    A function or function-like macro taking a
+ *                      pointer to \p type and returning its key
+ *
+ * \param   cmp_expr    A function or function-like macro taking two keys
+ *                      a and b and returning a negative number if a sorts
+ *                      before b, a positive number if a sorts after b and
+ *                      zero if they are equal
+ */
+#define RB_TREE_DEFINE(prefix, type, field, key_type, key_expr, cmp_expr)   \
+struct prefix##_tree {                                                      \
+    struct rb_tree tree;                                                    \
+};                                                                          \
+                                                                            \
+static inline type *                                                        \
+prefix##_data(struct rb_node *n)                                            \
+{                                                                           \
+    return n ? rb_node_data(type, n, field) : NULL;                         \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+prefix##_init(struct prefix##_tree *T)                                      \
+{                                                                           \
+    T->tree.root = NULL;                                                    \
+}                                                                           \
+                                                                            \
+static inline bool                                                          \
+prefix##_is_empty(const struct prefix##_tree *T)                            \
+{                                                                           \
+    return T->tree.root == NULL;                                            \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+prefix##_insert(struct prefix##_tree *T, type *node)                        \
+{                                                                           \
+    key_type key = key_expr(node);                                          \
+    struct rb_node *y = NULL;                                               \
+    struct rb_node *x = T->tree.root;                                       \
+    bool left = false;                                                      \
+    while (x != NULL) {                                                     \
+        y = x;                                                              \
+        left = cmp_expr(key, key_expr(rb_node_data(type, x, field))) < 0;   \
+        if (left)                                                           \
+            x = x->left;                                                    \
+        else                                                                \
+            x = x->right;                                                   \
+    }                                                                       \
+    rb_tree_insert_at_augmented(&T->tree, y, &node->field, left, NULL);     \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+prefix##_remove(struct prefix##_tree *T, type *node)                        \
+{                                                                           \
+    rb_tree_remove_augmented(&T->tree, &node->field, NULL);                 \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_search(struct prefix##_tree *T, key_type key)                      \
+{                                                                           \
+    struct rb_node *x = T->tree.root;                                       \
+    while (x != NULL) {                                                     \
+        int c = cmp_expr(key, key_expr(rb_node_data(type, x, field)));      \
+        if (c < 0)                                                          \
+            x = x->left;                                                    \
+        else if (c > 0)                                                     \
+            x = x->right;                                                   \
+        else                                                                \
+            return rb_node_data(type, x, field);                            \
+    }                                                                       \
+    return NULL;                                                            \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_lower_bound(struct prefix##_tree *T, key_type key)                 \
+{                                                                           \
+    struct rb_node *y = NULL;                                               \
+    struct rb_node *x = T->tree.root;                                       \
+    while (x != NULL) {                                                     \
+        if (cmp_expr(key, key_expr(rb_node_data(type, x, field))) <= 0) {   \
+            y = x;                                                          \
+            x = x->left;                                                    \
+        } else {                                                            \
+            x = x->right;                                                   \
+        }                                                                   \
+    }                                                                       \
+    return prefix##_data(y);                                                \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_upper_bound(struct prefix##_tree *T, key_type key)                 \
+{                                                                           \
+    struct rb_node *y = NULL;                                               \
+    struct rb_node *x = T->tree.root;                                       \
+    while (x != NULL) {                                                     \
+        if (cmp_expr(key, key_expr(rb_node_data(type, x, field))) < 0) {    \
+            y = x;                                                          \
+            x = x->left;                                                    \
+        } else {                                                            \
+            x = x->right;                                                   \
+        }                                                                   \
+    }                                                                       \
+    return prefix##_data(y);                                                \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_first(struct prefix##_tree *T)                                     \
+{                                                                           \
+    return T->tree.root ? prefix##_data(rb_node_minimum(T->tree.root))      \
+                        : NULL;                                             \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_last(struct prefix##_tree *T)                                      \
+{                                                                           \
+    return T->tree.root ? prefix##_data(rb_node_maximum(T->tree.root))      \
+                        : NULL;                                             \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_next(type *node)                                                   \
+{                                                                           \
+    return prefix##_data(rb_node_next(&node->field));                      \
+}                                                                           \
+                                                                            \
+static inline type *                                                        \
+prefix##_prev(type *node)                                                   \
+{                                                                           \
+    return prefix##_data(rb_node_prev(&node->field));                      \
+}
+
+#endif /* RB_TREE_TYPED_H */
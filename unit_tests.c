@@ -21,9 +21,24 @@
  */
 
 #include "rb_tree.h"
+#include "rb_tree_augmented.h"
+#include "rb_tree_bulk.h"
+#include "rb_interval_tree.h"
+#include "rb_tree32.h"
+#include "rb_pool.h"
+#include "rb_latch_tree.h"
+#include "rb_ptree.h"
+#include "rb_sharded_tree.h"
+#include "rb_btree.h"
+#include "rb_frozen_tree.h"
+#include "rb_rel_tree.h"
+#include "rb_tdtree.h"
+#include "rb_tree_typed.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <string.h>
 
 /* A list of 100 random numbers from 1 to 100.  The number 30 is explicitly
  * missing from this list.
@@ -45,6 +60,18 @@ int test_numbers[] = {
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
 
+/* A tiny deterministic PRNG (xorshift64) for the randomized tests */
+static uint64_t test_rand_state = 0x2545f4914f6cdd1dull;
+
+static uint64_t
+test_rand(void)
+{
+    test_rand_state ^= test_rand_state << 13;
+    test_rand_state ^= test_rand_state >> 7;
+    test_rand_state ^= test_rand_state << 17;
+    return test_rand_state;
+}
+
 struct rb_test_node {
     int key;
     struct rb_node node;
@@ -160,26 +187,2425 @@ validate_search(struct rb_tree *tree, int first_number,
     }
 }
 
-int
-main()
+static void
+test_build_sorted(void)
 {
     struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_node *sorted[ARRAY_SIZE(test_numbers)];
+
+    for (unsigned count = 0; count <= ARRAY_SIZE(test_numbers); count++) {
+        /* Stable insertion sort so that equal keys stay in array order */
+        for (unsigned i = 0; i < count; i++) {
+            nodes[i].key = test_numbers[i];
+            unsigned j = i;
+            while (j > 0 && rb_node_data(struct rb_test_node, sorted[j - 1],
+                                         node)->key > nodes[i].key) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = &nodes[i].node;
+        }
+
+        struct rb_tree tree;
+        rb_tree_init(&tree);
+        rb_tree_build_sorted(&tree, sorted, count);
+        rb_tree_validate(&tree);
+        validate_tree_order(&tree, count);
+        if (count > 0)
+            validate_search(&tree, 0, count - 1);
+    }
+}
+
+static void
+test_bulk_load(void)
+{
+    /* The largest count is big enough that every thread gets a chunk */
+    static const size_t counts[] = {
+        0, 1, 3, ARRAY_SIZE(test_numbers), 40000,
+    };
+    static const unsigned thread_counts[] = { 0, 1, 4, 64 };
+
+    for (unsigned c = 0; c < ARRAY_SIZE(counts); c++) {
+        const size_t count = counts[c];
+        struct rb_test_node *nodes = malloc(count * sizeof(*nodes) + 1);
+        struct rb_node **sorted = malloc(count * sizeof(*sorted) + 1);
+        assert(nodes && sorted);
+
+        for (unsigned t = 0; t < ARRAY_SIZE(thread_counts); t++) {
+            /* Lots of duplicates so that stability matters */
+            for (size_t i = 0; i < count; i++) {
+                if (i < ARRAY_SIZE(test_numbers))
+                    nodes[i].key = test_numbers[i];
+                else
+                    nodes[i].key = (i * 7919) % 1000;
+                sorted[i] = &nodes[i].node;
+            }
+
+            struct rb_tree tree;
+            rb_tree_init(&tree);
+            assert(rb_tree_bulk_load(&tree, sorted, count, rb_test_node_cmp,
+                                     thread_counts[t]));
+            rb_tree_validate(&tree);
+            validate_tree_order(&tree, count);
+
+            /* The array comes back sorted, stably, in tree order */
+            struct rb_node *n = rb_tree_first(&tree);
+            for (size_t i = 0; i < count; i++) {
+                assert(sorted[i] == n);
+                if (i > 0) {
+                    struct rb_test_node *a =
+                        rb_node_data(struct rb_test_node, sorted[i - 1], node);
+                    struct rb_test_node *b =
+                        rb_node_data(struct rb_test_node, sorted[i], node);
+                    assert(a->key < b->key || (a->key == b->key && a < b));
+                }
+                n = rb_node_next(n);
+            }
+            assert(n == NULL);
+        }
+
+        free(nodes);
+        free(sorted);
+    }
+}
+
+static unsigned
+count_key(struct rb_tree *tree, int key)
+{
+    unsigned count = 0;
+    rb_tree_foreach(struct rb_test_node, n, tree, node) {
+        if (n->key == key)
+            count++;
+    }
+    return count;
+}
+
+struct rb_aug_test_node {
+    int key;
+    int val;
+    int max_val;
+    struct rb_node node;
+};
+
+static int
+rb_aug_test_node_max(struct rb_aug_test_node *n)
+{
+    int max_val = n->val;
+    if (n->node.left) {
+        struct rb_aug_test_node *l =
+            rb_node_data(struct rb_aug_test_node, n->node.left, node);
+        if (l->max_val > max_val)
+            max_val = l->max_val;
+    }
+    if (n->node.right) {
+        struct rb_aug_test_node *r =
+            rb_node_data(struct rb_aug_test_node, n->node.right, node);
+        if (r->max_val > max_val)
+            max_val = r->max_val;
+    }
+    return max_val;
+}
+
+RB_DECLARE_CALLBACKS(static, rb_aug_test_callbacks, struct rb_aug_test_node,
+                     node, int, max_val, rb_aug_test_node_max);
+
+static void
+rb_aug_test_insert(struct rb_tree *tree, struct rb_aug_test_node *n)
+{
+    struct rb_node *parent = NULL;
+    bool left = false;
+    for (struct rb_node *x = tree->root; x;) {
+        parent = x;
+        left = n->key < rb_node_data(struct rb_aug_test_node, x, node)->key;
+        x = left ? x->left : x->right;
+    }
+    rb_tree_insert_at_augmented(tree, parent, &n->node, left,
+                                &rb_aug_test_callbacks);
+}
+
+/* Returns the true subtree maximum and asserts that it is what's cached */
+static int
+validate_aug_subtree(struct rb_node *n)
+{
+    if (n == NULL)
+        return INT_MIN;
+
+    struct rb_aug_test_node *tn =
+        rb_node_data(struct rb_aug_test_node, n, node);
+    int max_val = tn->val;
+    int left_max = validate_aug_subtree(n->left);
+    int right_max = validate_aug_subtree(n->right);
+    if (left_max > max_val)
+        max_val = left_max;
+    if (right_max > max_val)
+        max_val = right_max;
+    assert(tn->max_val == max_val);
+    return max_val;
+}
+
+static void
+test_augmented(void)
+{
+    struct rb_aug_test_node nodes[ARRAY_SIZE(test_numbers)];
     struct rb_tree tree;
 
     rb_tree_init(&tree);
-
     for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
         nodes[i].key = test_numbers[i];
-        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+        nodes[i].val = (i * 37) % 101;
+        rb_aug_test_insert(&tree, &nodes[i]);
         rb_tree_validate(&tree);
-        validate_tree_order(&tree, i + 1);
-        validate_search(&tree, 0, i);
+        validate_aug_subtree(tree.root);
     }
 
+    /* Removing in a different order than insertion moves the maximum
+     * around and exercises the splice and rotation callbacks.
+     */
     for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
-        rb_tree_remove(&tree, &nodes[i].node);
+        unsigned idx = (i * 7) % ARRAY_SIZE(test_numbers);
+        rb_tree_remove_augmented(&tree, &nodes[idx].node,
+                                 &rb_aug_test_callbacks);
         rb_tree_validate(&tree);
-        validate_tree_order(&tree, ARRAY_SIZE(test_numbers) - i - 1);
-        validate_search(&tree, i + 1, ARRAY_SIZE(test_numbers) - 1);
+        validate_aug_subtree(tree.root);
+    }
+    assert(tree.root == NULL);
+}
+
+static bool
+intervals_overlap(const struct rb_interval_node *n,
+                  uint64_t start, uint64_t last)
+{
+    return n->start <= last && start <= n->last;
+}
+
+static void
+validate_interval_query(struct rb_tree *tree,
+                        struct rb_interval_node *nodes, const bool *in_tree,
+                        unsigned count, uint64_t start, uint64_t last)
+{
+    unsigned expected = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (in_tree[i] && intervals_overlap(&nodes[i], start, last))
+            expected++;
+    }
+
+    /* The iterator must return exactly the overlapping intervals, in tree
+     * order, which also guarantees that there are no repeats.
+     */
+    unsigned found = 0;
+    struct rb_interval_node *prev = NULL;
+    for (struct rb_interval_node *n =
+            rb_interval_tree_iter_first(tree, start, last);
+         n; n = rb_interval_tree_iter_next(n, start, last)) {
+        assert(in_tree[n - nodes]);
+        assert(intervals_overlap(n, start, last));
+        if (prev) {
+            struct rb_node *x = rb_node_next(&prev->node);
+            while (x != &n->node) {
+                /* Everything we skipped must not overlap */
+                assert(x);
+                assert(!intervals_overlap(
+                    rb_node_data(struct rb_interval_node, x, node),
+                    start, last));
+                x = rb_node_next(x);
+            }
+        }
+        prev = n;
+        found++;
+    }
+    assert(found == expected);
+}
+
+static uint64_t
+random_interval_point(void)
+{
+    /* Mostly small values so that intervals overlap, with some at the very
+     * top of the range to catch overflow in last + 1 style arithmetic.
+     */
+    switch (test_rand() % 8) {
+    case 0:
+        return UINT64_MAX - test_rand() % 4;
+    case 1:
+        return test_rand() % 4;
+    default:
+        return test_rand() % 1000;
+    }
+}
+
+static void
+test_interval_tree(void)
+{
+    struct rb_interval_node nodes[256];
+    bool in_tree[ARRAY_SIZE(nodes)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    memset(in_tree, 0, sizeof(in_tree));
+
+    for (unsigned iter = 0; iter < 4000; iter++) {
+        unsigned i = test_rand() % ARRAY_SIZE(nodes);
+        if (in_tree[i]) {
+            rb_interval_tree_remove(&tree, &nodes[i]);
+            in_tree[i] = false;
+        } else {
+            uint64_t a = random_interval_point();
+            uint64_t b = random_interval_point();
+            nodes[i].start = a < b ? a : b;
+            nodes[i].last = a < b ? b : a;
+            if (test_rand() % 16 == 0)
+                nodes[i].last = UINT64_MAX;
+            rb_interval_tree_insert(&tree, &nodes[i]);
+            in_tree[i] = true;
+        }
+        rb_interval_tree_validate(&tree);
+
+        /* A stabbing query and a range query */
+        uint64_t p = random_interval_point();
+        validate_interval_query(&tree, nodes, in_tree, ARRAY_SIZE(nodes),
+                                p, p);
+
+        uint64_t a = random_interval_point();
+        uint64_t b = random_interval_point();
+        validate_interval_query(&tree, nodes, in_tree, ARRAY_SIZE(nodes),
+                                a < b ? a : b, a < b ? b : a);
+    }
+
+    validate_interval_query(&tree, nodes, in_tree, ARRAY_SIZE(nodes),
+                            0, UINT64_MAX);
+    validate_interval_query(&tree, nodes, in_tree, ARRAY_SIZE(nodes),
+                            UINT64_MAX, UINT64_MAX);
+}
+
+struct rb_test32_node {
+    int key;
+    struct rb_node32 node;
+};
+
+static int
+rb_test32_node_cmp(const struct rb_node32 *a, const struct rb_node32 *b)
+{
+    struct rb_test32_node *ta = rb_node_data(struct rb_test32_node, a, node);
+    struct rb_test32_node *tb = rb_node_data(struct rb_test32_node, b, node);
+    return tb->key - ta->key;
+}
+
+static int
+rb_test32_node_cmp_void(const struct rb_node32 *n, const void *v)
+{
+    struct rb_test32_node *tn = rb_node_data(struct rb_test32_node, n, node);
+    return *(int *)v - tn->key;
+}
+
+/* Returns the index of the first node in stable sorted order whose key is
+ * greater than (or equal to if or_equal) key or RB_NODE32_NULL.
+ */
+static uint32_t
+tree32_bound_brute_force(struct rb_test32_node *nodes, const bool *in_tree,
+                         unsigned count, int key, bool or_equal)
+{
+    uint32_t best = RB_NODE32_NULL;
+    for (unsigned i = 0; i < count; i++) {
+        if (!in_tree[i])
+            continue;
+        if (nodes[i].key < key || (!or_equal && nodes[i].key == key))
+            continue;
+        if (best == RB_NODE32_NULL || nodes[i].key < nodes[best].key)
+            best = i;
+    }
+    return best;
+}
+
+static void
+validate_tree32(struct rb_tree32 *tree, struct rb_test32_node *nodes,
+                const bool *in_tree, unsigned count)
+{
+    rb_tree32_validate(tree);
+
+    unsigned expected_count = 0;
+    for (unsigned i = 0; i < count; i++)
+        expected_count += in_tree[i];
+
+    /* Equal keys stay in insertion order which is index order here */
+    unsigned iter_count = 0;
+    uint32_t prev = RB_NODE32_NULL;
+    rb_tree32_foreach(tree, i) {
+        assert(in_tree[i]);
+        if (prev != RB_NODE32_NULL) {
+            assert(nodes[prev].key < nodes[i].key ||
+                   (nodes[prev].key == nodes[i].key && prev < i));
+        }
+        prev = i;
+        iter_count++;
+    }
+    assert(iter_count == expected_count);
+
+    uint32_t next = RB_NODE32_NULL;
+    rb_tree32_foreach_rev(tree, i) {
+        assert(in_tree[i]);
+        if (next != RB_NODE32_NULL)
+            assert(rb_tree32_next(tree, i) == next);
+        next = i;
+        iter_count--;
+    }
+    assert(iter_count == 0);
+
+    for (int key = 0; key <= 51; key++) {
+        uint32_t lb = tree32_bound_brute_force(nodes, in_tree, count,
+                                               key, true);
+        uint32_t ub = tree32_bound_brute_force(nodes, in_tree, count,
+                                               key, false);
+        assert(rb_tree32_lower_bound(tree, &key,
+                                     rb_test32_node_cmp_void) == lb);
+        assert(rb_tree32_upper_bound(tree, &key,
+                                     rb_test32_node_cmp_void) == ub);
+
+        uint32_t n = rb_tree32_search(tree, &key, rb_test32_node_cmp_void);
+        if (lb != RB_NODE32_NULL && nodes[lb].key == key) {
+            assert(n != RB_NODE32_NULL && in_tree[n]);
+            assert(nodes[n].key == key);
+        } else {
+            assert(n == RB_NODE32_NULL);
+        }
     }
 }
+
+static void
+test_tree32(void)
+{
+    struct rb_test32_node nodes[ARRAY_SIZE(test_numbers)];
+    bool in_tree[ARRAY_SIZE(test_numbers)];
+    struct rb_tree32 tree;
+
+    /* The whole point is to be half the size of an rb_node */
+    assert(sizeof(struct rb_node32) == 12);
+
+    rb_tree32_init_array(&tree, nodes, node);
+    assert(rb_tree32_is_empty(&tree));
+    memset(in_tree, 0, sizeof(in_tree));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree32_insert(&tree, i, rb_test32_node_cmp);
+        in_tree[i] = true;
+        validate_tree32(&tree, nodes, in_tree, ARRAY_SIZE(nodes));
+    }
+
+    /* Remove every third node while iterating */
+    rb_tree32_foreach_safe(&tree, i) {
+        if (i % 3 == 0) {
+            rb_tree32_remove(&tree, i);
+            in_tree[i] = false;
+        }
+    }
+    validate_tree32(&tree, nodes, in_tree, ARRAY_SIZE(nodes));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        if (in_tree[i]) {
+            rb_tree32_remove(&tree, i);
+            in_tree[i] = false;
+            validate_tree32(&tree, nodes, in_tree, ARRAY_SIZE(nodes));
+        }
+    }
+    assert(rb_tree32_is_empty(&tree));
+}
+
+static void
+test_pool(void)
+{
+    struct rb_pool pool;
+    rb_pool_init(&pool);
+
+    /* Freed memory is re-used by the next allocation of the same size
+     * class and only that size class.
+     */
+    void *first[RB_POOL_NUM_SIZE_CLASSES];
+    for (unsigned c = 0; c < RB_POOL_NUM_SIZE_CLASSES; c++) {
+        size_t size = (c + 1) * RB_POOL_ALIGN;
+        first[c] = rb_pool_alloc(&pool, size);
+        assert(first[c] != NULL);
+        assert(((uintptr_t)first[c] & (RB_POOL_ALIGN - 1)) == 0);
+        memset(first[c], 0xaa, size);
+
+        rb_pool_free(&pool, first[c], size);
+        if (c > 0)
+            assert(rb_pool_alloc(&pool, size - RB_POOL_ALIGN) != first[c]);
+        assert(rb_pool_alloc(&pool, size - RB_POOL_ALIGN + 1) == first[c]);
+    }
+    rb_pool_free(&pool, NULL, 1);
+
+    /* Allocate enough to need several slabs */
+    const unsigned num_allocs = 4 * RB_POOL_SLAB_SIZE / RB_POOL_MAX_SIZE;
+    for (unsigned i = 0; i < num_allocs; i++) {
+        void *ptr = rb_pool_alloc(&pool, RB_POOL_MAX_SIZE);
+        assert(ptr != NULL);
+        assert(((uintptr_t)ptr & (RB_POOL_ALIGN - 1)) == 0);
+        memset(ptr, i & 0xff, RB_POOL_MAX_SIZE);
+    }
+
+    /* After a reset, allocation starts over at the beginning of the first
+     * slab, the free lists are empty and the old slabs are used again.
+     */
+    rb_pool_reset(&pool);
+    assert(rb_pool_alloc(&pool, RB_POOL_MAX_SIZE) == first[0]);
+    for (unsigned i = 1; i < num_allocs; i++) {
+        void *ptr = rb_pool_alloc(&pool, RB_POOL_MAX_SIZE);
+        assert(ptr != NULL);
+        memset(ptr, 0x55, RB_POOL_MAX_SIZE);
+    }
+
+    rb_pool_finish(&pool);
+
+    /* Finishing a pool that never allocated is fine too */
+    rb_pool_init(&pool);
+    rb_pool_finish(&pool);
+}
+
+struct rb_test_latch_node {
+    int key;
+    struct rb_latch_node node;
+};
+
+static int
+rb_test_latch_node_cmp(const struct rb_latch_node *a,
+                       const struct rb_latch_node *b)
+{
+    struct rb_test_latch_node *ta =
+        rb_node_data(struct rb_test_latch_node, a, node);
+    struct rb_test_latch_node *tb =
+        rb_node_data(struct rb_test_latch_node, b, node);
+    return tb->key - ta->key;
+}
+
+static int
+rb_test_latch_node_cmp_void(const struct rb_latch_node *n, const void *v)
+{
+    struct rb_test_latch_node *tn =
+        rb_node_data(struct rb_test_latch_node, n, node);
+    return *(int *)v - tn->key;
+}
+
+static void
+test_latch_tree(void)
+{
+    struct rb_test_latch_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_latch_tree tree;
+
+    rb_latch_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_latch_tree_insert(&tree, &nodes[i].node, rb_test_latch_node_cmp);
+        rb_latch_tree_validate(&tree);
+    }
+
+    /* Remove every other node */
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i += 2) {
+        rb_latch_tree_remove(&tree, &nodes[i].node);
+        rb_latch_tree_validate(&tree);
+    }
+
+    unsigned count = 0;
+    struct rb_test_latch_node *prev = NULL;
+    for (struct rb_latch_node *n = rb_latch_tree_first(&tree); n;
+         n = rb_latch_node_next(n)) {
+        struct rb_test_latch_node *tn =
+            rb_node_data(struct rb_test_latch_node, n, node);
+        assert((tn - nodes) % 2 == 1);
+        if (prev)
+            assert(prev->key < tn->key || (prev->key == tn->key && prev < tn));
+        prev = tn;
+        count++;
+    }
+    assert(count == ARRAY_SIZE(test_numbers) / 2);
+    assert(rb_latch_tree_last(&tree) == &prev->node);
+
+    for (int key = 0; key <= 51; key++) {
+        unsigned expected = 0;
+        for (unsigned i = 1; i < ARRAY_SIZE(test_numbers); i += 2)
+            expected += test_numbers[i] == key;
+
+        struct rb_latch_node *n =
+            rb_latch_tree_search(&tree, &key, rb_test_latch_node_cmp_void);
+        if (expected) {
+            assert(n);
+            assert(rb_node_data(struct rb_test_latch_node,
+                                n, node)->key == key);
+        } else {
+            assert(n == NULL);
+        }
+    }
+}
+
+#define LATCH_TEST_NUM_NODES 2048
+#define LATCH_TEST_NUM_FIXED 512
+#define LATCH_TEST_NUM_READERS 2
+
+struct latch_test_ctx {
+    struct rb_latch_tree tree;
+    struct rb_test_latch_node nodes[LATCH_TEST_NUM_NODES];
+    bool stop;
+};
+
+static void *
+latch_test_reader(void *data)
+{
+    struct latch_test_ctx *ctx = data;
+    unsigned seed = 1;
+    while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        seed = seed * 1103515245 + 12345;
+        int key = (seed >> 8) % (2 * LATCH_TEST_NUM_NODES);
+
+        struct rb_latch_node *n =
+            rb_latch_tree_search(&ctx->tree, &key,
+                                 rb_test_latch_node_cmp_void);
+        if (key % 2 == 1) {
+            /* Odd keys are never in the tree */
+            assert(n == NULL);
+        } else if (key / 2 < LATCH_TEST_NUM_FIXED) {
+            /* These are in the tree the whole time */
+            assert(n != NULL);
+        }
+        if (n) {
+            assert(rb_node_data(struct rb_test_latch_node,
+                                n, node)->key == key);
+        }
+    }
+    return NULL;
+}
+
+static void
+test_latch_tree_threaded(void)
+{
+    static struct latch_test_ctx ctx;
+
+    rb_latch_tree_init(&ctx.tree);
+    ctx.stop = false;
+    for (unsigned i = 0; i < LATCH_TEST_NUM_NODES; i++)
+        ctx.nodes[i].key = 2 * i;
+    for (unsigned i = 0; i < LATCH_TEST_NUM_FIXED; i++) {
+        rb_latch_tree_insert(&ctx.tree, &ctx.nodes[i].node,
+                             rb_test_latch_node_cmp);
+    }
+
+    pthread_t readers[LATCH_TEST_NUM_READERS];
+    for (unsigned i = 0; i < LATCH_TEST_NUM_READERS; i++) {
+        int ret = pthread_create(&readers[i], NULL, latch_test_reader, &ctx);
+        assert(ret == 0);
+        (void)ret;
+    }
+
+    /* Removed nodes are never re-inserted because readers may still be
+     * looking at them.
+     */
+    for (unsigned i = LATCH_TEST_NUM_FIXED; i < LATCH_TEST_NUM_NODES; i++) {
+        rb_latch_tree_insert(&ctx.tree, &ctx.nodes[i].node,
+                             rb_test_latch_node_cmp);
+    }
+    for (unsigned i = LATCH_TEST_NUM_FIXED; i < LATCH_TEST_NUM_NODES; i++) {
+        unsigned idx = LATCH_TEST_NUM_FIXED +
+            (i * 7) % (LATCH_TEST_NUM_NODES - LATCH_TEST_NUM_FIXED);
+        rb_latch_tree_remove(&ctx.tree, &ctx.nodes[idx].node);
+    }
+
+    __atomic_store_n(&ctx.stop, true, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < LATCH_TEST_NUM_READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    rb_latch_tree_validate(&ctx.tree);
+    unsigned count = 0;
+    for (struct rb_latch_node *n = rb_latch_tree_first(&ctx.tree); n;
+         n = rb_latch_node_next(n)) {
+        assert(rb_node_data(struct rb_test_latch_node, n, node)->key ==
+               (int)(2 * count));
+        count++;
+    }
+    assert(count == LATCH_TEST_NUM_FIXED);
+}
+
+struct rb_test_pnode {
+    int key;
+    bool live;
+    struct rb_pnode node;
+};
+
+/* Persistent tree nodes come from a fixed array so that the free callback
+ * can catch double frees without touching freed memory.
+ */
+static struct rb_test_pnode ptree_test_nodes[8192];
+static unsigned ptree_test_num_allocs;
+static unsigned ptree_test_num_clones;
+static unsigned ptree_test_num_frees;
+
+static struct rb_test_pnode *
+rb_test_pnode_alloc(int key)
+{
+    assert(ptree_test_num_allocs < ARRAY_SIZE(ptree_test_nodes));
+    struct rb_test_pnode *n = &ptree_test_nodes[ptree_test_num_allocs++];
+    n->key = key;
+    n->live = true;
+    return n;
+}
+
+static struct rb_pnode *
+rb_test_pnode_clone(const struct rb_pnode *node)
+{
+    const struct rb_test_pnode *old =
+        rb_pnode_data(struct rb_test_pnode, node, node);
+    assert(old->live);
+    ptree_test_num_clones++;
+    return &rb_test_pnode_alloc(old->key)->node;
+}
+
+static void
+rb_test_pnode_free(struct rb_pnode *node)
+{
+    struct rb_test_pnode *n = rb_pnode_data(struct rb_test_pnode, node, node);
+    assert(n->live);
+    n->live = false;
+    ptree_test_num_frees++;
+}
+
+static const struct rb_ptree_ops rb_test_pnode_ops = {
+    .clone = rb_test_pnode_clone,
+    .free = rb_test_pnode_free,
+};
+
+static int
+rb_test_pnode_cmp(const struct rb_pnode *a, const struct rb_pnode *b)
+{
+    struct rb_test_pnode *ta = rb_pnode_data(struct rb_test_pnode, a, node);
+    struct rb_test_pnode *tb = rb_pnode_data(struct rb_test_pnode, b, node);
+    return tb->key - ta->key;
+}
+
+static int
+rb_test_pnode_cmp_void(const struct rb_pnode *n, const void *v)
+{
+    struct rb_test_pnode *tn = rb_pnode_data(struct rb_test_pnode, n, node);
+    return *(int *)v - tn->key;
+}
+
+/* Checks that a persistent tree holds exactly the given keys, which must
+ * be sorted.
+ */
+static void
+validate_ptree_keys(const struct rb_ptree *tree, const int *keys,
+                    unsigned count)
+{
+    rb_ptree_validate(tree);
+
+    struct rb_ptree_iter iter;
+    unsigned i = 0;
+    rb_ptree_foreach(struct rb_test_pnode, n, &iter, tree, node) {
+        assert(n->live);
+        assert(i < count && n->key == keys[i]);
+        i++;
+    }
+    assert(i == count);
+
+    for (i = 0; i < count; i++) {
+        struct rb_pnode *n =
+            rb_ptree_search(tree, &keys[i], rb_test_pnode_cmp_void);
+        assert(n);
+        assert(rb_pnode_data(struct rb_test_pnode, n, node)->key == keys[i]);
+    }
+}
+
+static void
+sort_ints(int *a, unsigned count)
+{
+    for (unsigned i = 1; i < count; i++) {
+        int x = a[i];
+        unsigned j = i;
+        while (j > 0 && a[j - 1] > x) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = x;
+    }
+}
+
+static void
+test_ptree(void)
+{
+    const unsigned count = ARRAY_SIZE(test_numbers);
+    int keys0[ARRAY_SIZE(test_numbers)];
+    int keys1[ARRAY_SIZE(test_numbers)];
+    struct rb_ptree tree, snap0, snap1;
+
+    ptree_test_num_allocs = 0;
+    ptree_test_num_clones = 0;
+    ptree_test_num_frees = 0;
+
+    rb_ptree_init(&tree, &rb_test_pnode_ops);
+    for (unsigned i = 0; i < count; i++) {
+        rb_ptree_insert(&tree, &rb_test_pnode_alloc(test_numbers[i])->node,
+                        rb_test_pnode_cmp);
+        rb_ptree_validate(&tree);
+    }
+
+    /* Nothing is shared yet so nothing gets copied */
+    assert(ptree_test_num_clones == 0);
+
+    memcpy(keys0, test_numbers, sizeof(keys0));
+    sort_ints(keys0, count);
+    validate_ptree_keys(&tree, keys0, count);
+
+    /* Replace the first half of the keys in the tree with new ones */
+    rb_ptree_snapshot(&tree, &snap0);
+    memcpy(keys1, test_numbers, sizeof(keys1));
+    for (unsigned i = 0; i < count / 2; i++) {
+        assert(rb_ptree_remove(&tree, &test_numbers[i],
+                               rb_test_pnode_cmp_void));
+        keys1[i] = 100 + i;
+        rb_ptree_insert(&tree, &rb_test_pnode_alloc(keys1[i])->node,
+                        rb_test_pnode_cmp);
+
+        validate_ptree_keys(&snap0, keys0, count);
+    }
+    assert(ptree_test_num_clones > 0);
+
+    int missing = NON_EXISTANT_NUMBER;
+    assert(!rb_ptree_remove(&tree, &missing, rb_test_pnode_cmp_void));
+
+    sort_ints(keys1, count);
+    validate_ptree_keys(&tree, keys1, count);
+
+    /* Take a second snapshot and empty the tree */
+    rb_ptree_snapshot(&tree, &snap1);
+    for (unsigned i = 0; i < count; i++) {
+        assert(rb_ptree_remove(&tree, &keys1[i], rb_test_pnode_cmp_void));
+        rb_ptree_validate(&tree);
+    }
+    assert(rb_ptree_is_empty(&tree));
+    validate_ptree_keys(&snap0, keys0, count);
+    validate_ptree_keys(&snap1, keys1, count);
+
+    /* Release the trees in a different order than they were created */
+    rb_ptree_finish(&snap0);
+    validate_ptree_keys(&snap1, keys1, count);
+    rb_ptree_finish(&tree);
+    rb_ptree_finish(&snap1);
+
+    /* Everything allocated, including every clone, was freed exactly once */
+    assert(ptree_test_num_frees == ptree_test_num_allocs);
+    for (unsigned i = 0; i < ptree_test_num_allocs; i++)
+        assert(!ptree_test_nodes[i].live);
+}
+
+struct rb_test_shard_node {
+    struct rb_node node;
+    uint64_t key;
+};
+
+static const void *
+rb_test_shard_node_key(const struct rb_node *n)
+{
+    return &rb_node_data(struct rb_test_shard_node, n, node)->key;
+}
+
+static int
+rb_test_shard_key_cmp(const void *a, const void *b)
+{
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static const struct rb_sharded_tree_ops rb_test_shard_ops = {
+    .key = rb_test_shard_node_key,
+    .cmp = rb_test_shard_key_cmp,
+};
+
+struct shard_scan_state {
+    uint64_t prev;
+    size_t count;
+    size_t limit;
+};
+
+static bool
+shard_scan_cb(struct rb_node *n, void *data)
+{
+    struct shard_scan_state *state = data;
+    uint64_t key = rb_node_data(struct rb_test_shard_node, n, node)->key;
+    assert(key >= state->prev);
+    state->prev = key;
+    state->count++;
+    return state->count < state->limit;
+}
+
+static size_t
+shard_scan_count(struct rb_sharded_tree *tree, const uint64_t *lo,
+                 size_t limit)
+{
+    struct shard_scan_state state = {
+        .prev = lo ? *lo : 0,
+        .count = 0,
+        .limit = limit,
+    };
+    rb_sharded_tree_scan(tree, lo, shard_scan_cb, &state);
+    return state.count;
+}
+
+/* Validates the tree and checks that no run of equal keys straddles two
+ * shards and that the shards hold roughly total / num_shards nodes each.
+ */
+static void
+validate_shards(struct rb_sharded_tree *tree, unsigned num_shards,
+                size_t total, size_t slack)
+{
+    rb_sharded_tree_validate(tree);
+
+    size_t sum = 0;
+    struct rb_node *prev_last = NULL;
+    for (unsigned i = 0; i < num_shards; i++) {
+        size_t count = rb_sharded_tree_shard_count(tree, i);
+        assert(count + slack >= total / num_shards);
+        assert(count <= total / num_shards + slack);
+        sum += count;
+
+        struct rb_tree *shard = rb_sharded_tree_shard(tree, i);
+        struct rb_node *first = rb_tree_first(shard);
+        if (prev_last && first) {
+            assert(rb_node_data(struct rb_test_shard_node,
+                                prev_last, node)->key <
+                   rb_node_data(struct rb_test_shard_node,
+                                first, node)->key);
+        }
+        if (first)
+            prev_last = rb_tree_last(shard);
+    }
+    assert(sum == total);
+}
+
+static void
+test_sharded_tree(void)
+{
+    const unsigned num_shards = 4;
+    const unsigned run_length = 10;
+    static struct rb_test_shard_node nodes[4000];
+    const size_t num_nodes = ARRAY_SIZE(nodes);
+    struct rb_sharded_tree tree;
+
+    assert(!rb_sharded_tree_init(&tree, num_shards,
+                                 RB_SHARDED_TREE_MAX_KEY_SIZE + 1,
+                                 &rb_test_shard_ops));
+    assert(rb_sharded_tree_init(&tree, num_shards, sizeof(uint64_t),
+                                &rb_test_shard_ops));
+
+    /* Ascending runs of equal keys.  Everything starts out in the first
+     * shard, which gets pushed to the right as it fills up.
+     */
+    for (size_t i = 0; i < num_nodes; i++) {
+        nodes[i].key = i / run_length;
+        rb_sharded_tree_insert(&tree, &nodes[i].node);
+    }
+    assert(rb_sharded_tree_shard_count(&tree, 0) < num_nodes);
+    validate_shards(&tree, num_shards, num_nodes, num_nodes);
+
+    rb_sharded_tree_rebalance(&tree);
+    validate_shards(&tree, num_shards, num_nodes, 2 * run_length);
+
+    /* Routing */
+    for (uint64_t key = 0; key < num_nodes / run_length; key++) {
+        struct rb_node *n = rb_sharded_tree_search(&tree, &key);
+        assert(n);
+        assert(rb_node_data(struct rb_test_shard_node, n, node)->key == key);
+    }
+    uint64_t missing = num_nodes / run_length;
+    assert(rb_sharded_tree_search(&tree, &missing) == NULL);
+
+    /* Scans cross every shard boundary in order */
+    assert(shard_scan_count(&tree, NULL, SIZE_MAX) == num_nodes);
+    for (uint64_t lo = 0; lo <= num_nodes / run_length; lo += 37) {
+        assert(shard_scan_count(&tree, &lo, SIZE_MAX) ==
+               num_nodes - lo * run_length);
+    }
+    assert(shard_scan_count(&tree, NULL, 5) == 5);
+
+    /* Emptying the low end of the key space means rebalancing has to pull
+     * nodes to the left.
+     */
+    for (size_t i = 0; i < num_nodes / 2; i++)
+        rb_sharded_tree_remove(&tree, &nodes[i].node);
+    validate_shards(&tree, num_shards, num_nodes / 2, num_nodes / 2);
+    rb_sharded_tree_rebalance(&tree);
+    validate_shards(&tree, num_shards, num_nodes / 2, 2 * run_length);
+
+    uint64_t lo = 0;
+    assert(shard_scan_count(&tree, &lo, SIZE_MAX) == num_nodes / 2);
+    for (size_t i = 0; i < num_nodes / 2; i++) {
+        uint64_t key = nodes[i].key;
+        struct rb_node *n = rb_sharded_tree_search(&tree, &key);
+        assert(n == NULL);
+    }
+
+    for (size_t i = num_nodes / 2; i < num_nodes; i++)
+        rb_sharded_tree_remove(&tree, &nodes[i].node);
+    rb_sharded_tree_validate(&tree);
+    assert(shard_scan_count(&tree, NULL, SIZE_MAX) == 0);
+
+    rb_sharded_tree_finish(&tree);
+}
+
+#define BTREE_TEST_NUM_KEYS 1000
+
+/* Compares a B+-tree against a model where model[k] is the value for key
+ * k * 3 or NULL if it isn't in the tree.  Spacing the keys out leaves room
+ * to search for keys which are never in the tree.
+ */
+static void
+validate_btree_model(const struct rb_btree *tree, void *const *model)
+{
+    rb_btree_validate(tree);
+
+    unsigned k = 0;
+    rb_btree_foreach(tree, it) {
+        while (k < BTREE_TEST_NUM_KEYS && model[k] == NULL)
+            k++;
+        assert(k < BTREE_TEST_NUM_KEYS);
+        assert(rb_btree_iter_key(it) == k * 3);
+        assert(rb_btree_iter_value(it) == model[k]);
+        k++;
+    }
+    while (k < BTREE_TEST_NUM_KEYS)
+        assert(model[k++] == NULL);
+
+    k = BTREE_TEST_NUM_KEYS;
+    rb_btree_foreach_rev(tree, it) {
+        while (k > 0 && model[k - 1] == NULL)
+            k--;
+        assert(k > 0);
+        k--;
+        assert(rb_btree_iter_key(it) == k * 3);
+    }
+    while (k > 0)
+        assert(model[--k] == NULL);
+}
+
+static void
+validate_btree_queries(const struct rb_btree *tree, void *const *model,
+                       uint64_t key)
+{
+    /* Only multiples of three are ever in the tree */
+    bool present = key % 3 == 0 && key / 3 < BTREE_TEST_NUM_KEYS &&
+                   model[key / 3] != NULL;
+
+    struct rb_btree_iter it = rb_btree_search(tree, key);
+    assert(rb_btree_iter_valid(it) == present);
+    if (present)
+        assert(rb_btree_iter_value(it) == model[key / 3]);
+
+    uint64_t k = (key + 2) / 3;
+    while (k < BTREE_TEST_NUM_KEYS && model[k] == NULL)
+        k++;
+    it = rb_btree_lower_bound(tree, key);
+    if (k < BTREE_TEST_NUM_KEYS) {
+        assert(rb_btree_iter_valid(it));
+        assert(rb_btree_iter_key(it) == k * 3);
+    } else {
+        assert(!rb_btree_iter_valid(it));
+    }
+
+    /* A sloppy search lands on key itself or a neighbor of where it would
+     * go, so there's nothing in the tree between the two.
+     */
+    it = rb_btree_search_sloppy(tree, key);
+    if (rb_btree_is_empty(tree)) {
+        assert(!rb_btree_iter_valid(it));
+    } else {
+        assert(rb_btree_iter_valid(it));
+        uint64_t found = rb_btree_iter_key(it);
+        if (present)
+            assert(found == key);
+        uint64_t lo = found < key ? found : key;
+        uint64_t hi = found < key ? key : found;
+        for (uint64_t j = lo + 1; j < hi; j++) {
+            assert(j % 3 != 0 || j / 3 >= BTREE_TEST_NUM_KEYS ||
+                   model[j / 3] == NULL);
+        }
+    }
+}
+
+static void
+test_btree(void)
+{
+    static void *model[BTREE_TEST_NUM_KEYS];
+    struct rb_btree tree;
+
+    rb_btree_init(&tree);
+    validate_btree_model(&tree, model);
+    validate_btree_queries(&tree, model, 0);
+
+    /* Fill the tree up, drain it almost completely and fill it up again
+     * so that there are plenty of splits and merges.
+     */
+    for (unsigned iter = 0; iter < 30000; iter++) {
+        unsigned phase = iter / 5000;
+        unsigned k = test_rand() % BTREE_TEST_NUM_KEYS;
+        bool insert = (test_rand() % 4 != 0) == (phase % 2 == 0);
+
+        if (insert) {
+            /* This replaces the value if the key is already there */
+            void *value = (void *)(uintptr_t)(iter + 1);
+            assert(rb_btree_insert(&tree, k * 3, value));
+            model[k] = value;
+        } else {
+            assert(rb_btree_remove(&tree, k * 3) == (model[k] != NULL));
+            model[k] = NULL;
+        }
+
+        validate_btree_queries(&tree, model,
+                               test_rand() % (3 * BTREE_TEST_NUM_KEYS + 3));
+        if (iter % 100 == 0)
+            validate_btree_model(&tree, model);
+    }
+
+    validate_btree_model(&tree, model);
+    for (uint64_t key = 0; key <= 3 * BTREE_TEST_NUM_KEYS; key++)
+        validate_btree_queries(&tree, model, key);
+
+    rb_btree_finish(&tree);
+}
+
+struct rb_test_u64_node {
+    uint64_t key;
+    struct rb_node node;
+};
+
+static uint64_t
+rb_test_u64_node_key(const struct rb_node *n)
+{
+    return rb_node_data(struct rb_test_u64_node, n, node)->key;
+}
+
+static int
+rb_test_u64_node_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+    uint64_t ka = rb_test_u64_node_key(a), kb = rb_test_u64_node_key(b);
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static int
+rb_test_u64_node_cmp_void(const struct rb_node *n, const void *v)
+{
+    uint64_t kn = rb_test_u64_node_key(n), kv = *(const uint64_t *)v;
+    return kn < kv ? 1 : kn > kv ? -1 : 0;
+}
+
+static void
+validate_frozen_queries(const struct rb_frozen_tree *frozen,
+                        struct rb_tree *tree, uint64_t key)
+{
+    struct rb_node *lb =
+        rb_tree_lower_bound(tree, &key, rb_test_u64_node_cmp_void);
+    struct rb_node *ub =
+        rb_tree_upper_bound(tree, &key, rb_test_u64_node_cmp_void);
+
+    assert(rb_frozen_tree_lower_bound(frozen, key) == lb);
+    assert(rb_frozen_tree_upper_bound(frozen, key) == ub);
+    if (lb && rb_test_u64_node_key(lb) == key)
+        assert(rb_frozen_tree_search(frozen, key) == lb);
+    else
+        assert(rb_frozen_tree_search(frozen, key) == NULL);
+}
+
+/* rb_frozen_tree.c compares whole blocks with SSE4.2 or AVX2 when it is
+ * built with -msse4.2 or -mavx2 and falls back to scalar code otherwise.
+ * The same checks cover whichever of those it was built with.
+ */
+static void
+test_frozen_tree(void)
+{
+    /* Empty, less than a block, whole blocks of whole levels and partial
+     * last blocks.
+     */
+    static const size_t counts[] = {
+        0, 1, 5, RB_FROZEN_TREE_BLOCK_SIZE, RB_FROZEN_TREE_BLOCK_SIZE + 1,
+        RB_FROZEN_TREE_BLOCK_SIZE * (RB_FROZEN_TREE_BLOCK_SIZE + 2),
+        ARRAY_SIZE(test_numbers), 1000,
+    };
+    static const uint64_t special_keys[] = {
+        0, 1, (1ull << 63) - 1, 1ull << 63, (1ull << 63) + 1,
+        UINT64_MAX - 1, UINT64_MAX,
+    };
+    static struct rb_test_u64_node nodes[1000];
+
+    for (unsigned c = 0; c < ARRAY_SIZE(counts); c++) {
+        const size_t count = counts[c];
+        struct rb_tree tree;
+        rb_tree_init(&tree);
+
+        /* The special keys, which straddle the sign flip the SIMD compares
+         * depend on, duplicates of those and then duplicated small keys.
+         */
+        for (size_t i = 0; i < count; i++) {
+            if (i < ARRAY_SIZE(special_keys))
+                nodes[i].key = special_keys[i];
+            else if (i < 2 * ARRAY_SIZE(special_keys))
+                nodes[i].key = special_keys[i - ARRAY_SIZE(special_keys)];
+            else
+                nodes[i].key = test_numbers[i % ARRAY_SIZE(test_numbers)];
+            rb_tree_insert(&tree, &nodes[i].node, rb_test_u64_node_cmp);
+        }
+
+        struct rb_frozen_tree frozen;
+        assert(rb_tree_freeze(&frozen, &tree, rb_test_u64_node_key));
+        rb_frozen_tree_validate(&frozen, &tree, rb_test_u64_node_key);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(special_keys); i++)
+            validate_frozen_queries(&frozen, &tree, special_keys[i]);
+        for (uint64_t key = 0; key <= 52; key++)
+            validate_frozen_queries(&frozen, &tree, key);
+
+        rb_frozen_tree_finish(&frozen);
+    }
+}
+
+static void
+rb_test_rel_write_cb(const struct rb_node *n, void *data, void *cb_data)
+{
+    (void)cb_data;
+    int key = rb_node_data(struct rb_test_node, n, node)->key;
+    memcpy(data, &key, sizeof(key));
+}
+
+static int
+rb_test_rel_node_key(const struct rb_rel_node *n)
+{
+    int key;
+    memcpy(&key, rb_rel_node_data(n), sizeof(key));
+    return key;
+}
+
+static int
+rb_test_rel_node_cmp_void(const struct rb_rel_node *n, const void *v)
+{
+    return *(int *)v - rb_test_rel_node_key(n);
+}
+
+/* Writes a tree out and reads it back into an 8-byte aligned buffer */
+static uint64_t *
+write_rel_tree(struct rb_tree *tree, size_t *size)
+{
+    FILE *f = tmpfile();
+    assert(f);
+    assert(rb_rel_tree_write(f, tree, sizeof(int),
+                             rb_test_rel_write_cb, NULL));
+
+    assert(fseek(f, 0, SEEK_END) == 0);
+    long end = ftell(f);
+    assert(end > 0);
+    *size = end;
+    rewind(f);
+
+    uint64_t *buf = malloc(*size + sizeof(uint64_t));
+    assert(buf);
+    assert(fread(buf, 1, *size, f) == *size);
+    fclose(f);
+
+    return buf;
+}
+
+static struct rb_rel_node *
+rel_tree_node_at(uint64_t *buf, int64_t offset)
+{
+    return (struct rb_rel_node *)((char *)buf + offset);
+}
+
+static bool
+rel_tree_accepts(const void *buf, size_t size)
+{
+    struct rb_rel_tree rel;
+    return rb_rel_tree_init(&rel, buf, size) && rb_rel_tree_validate(&rel);
+}
+
+static void
+test_rel_tree(void)
+{
+    static const unsigned counts[] = { 0, 1, 2, 7, ARRAY_SIZE(test_numbers) };
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+
+    for (unsigned c = 0; c < ARRAY_SIZE(counts); c++) {
+        const unsigned count = counts[c];
+        struct rb_tree tree;
+        rb_tree_init(&tree);
+        for (unsigned i = 0; i < count; i++) {
+            nodes[i].key = test_numbers[i];
+            rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+        }
+
+        size_t size;
+        uint64_t *buf = write_rel_tree(&tree, &size);
+
+        struct rb_rel_tree rel;
+        assert(rb_rel_tree_init(&rel, buf, size));
+        assert(rb_rel_tree_validate(&rel));
+        assert(rb_rel_tree_count(&rel) == count);
+
+        /* Iteration in both directions matches the original tree */
+        struct rb_node *n = rb_tree_first(&tree);
+        rb_rel_tree_foreach(rn, &rel) {
+            assert(n);
+            assert(rb_test_rel_node_key(rn) ==
+                   rb_node_data(struct rb_test_node, n, node)->key);
+            n = rb_node_next(n);
+        }
+        assert(n == NULL);
+
+        n = rb_tree_last(&tree);
+        for (const struct rb_rel_node *rn = rb_rel_tree_last(&rel); rn;
+             rn = rb_rel_node_prev(rn)) {
+            assert(n);
+            assert(rb_test_rel_node_key(rn) ==
+                   rb_node_data(struct rb_test_node, n, node)->key);
+            n = rb_node_prev(n);
+        }
+        assert(n == NULL);
+
+        for (int key = 0; key <= 51; key++) {
+            const struct rb_rel_node *rn =
+                rb_rel_tree_search(&rel, &key, rb_test_rel_node_cmp_void);
+            n = rb_tree_search(&tree, &key, rb_test_node_cmp_void);
+            assert((rn == NULL) == (n == NULL));
+            if (rn)
+                assert(rb_test_rel_node_key(rn) == key);
+
+            rn = rb_rel_tree_lower_bound(&rel, &key,
+                                         rb_test_rel_node_cmp_void);
+            n = rb_tree_lower_bound(&tree, &key, rb_test_node_cmp_void);
+            assert((rn == NULL) == (n == NULL));
+            if (rn) {
+                assert(rb_test_rel_node_key(rn) ==
+                       rb_node_data(struct rb_test_node, n, node)->key);
+                const struct rb_rel_node *prev = rb_rel_node_prev(rn);
+                assert(prev == NULL || rb_test_rel_node_key(prev) < key);
+            }
+        }
+
+        /* Truncated buffers, down to less than a header */
+        assert(!rel_tree_accepts(buf, sizeof(struct rb_rel_header) - 1));
+        if (count > 0)
+            assert(!rel_tree_accepts(buf, size - 1));
+
+        free(buf);
+    }
+
+    /* Corrupt a few specific fields of a larger tree.  Each of these has to
+     * be rejected by either rb_rel_tree_init or rb_rel_tree_validate.  With
+     * an odd number of nodes, both subtrees of the root have the same
+     * shape, so pointing both of the root's links at the same child keeps
+     * the node count and black height right.
+     */
+    struct rb_tree tree;
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers) - 1; i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+    size_t size;
+    uint64_t *buf = write_rel_tree(&tree, &size);
+    uint64_t *copy = malloc(size + sizeof(uint64_t));
+    assert(copy);
+
+    struct rb_rel_header *header = (struct rb_rel_header *)copy;
+    for (unsigned corruption = 0; corruption < 8; corruption++) {
+        memcpy(copy, buf, size);
+        struct rb_rel_node *root = rel_tree_node_at(copy, header->root);
+        struct rb_rel_node *left = rel_tree_node_at(copy, header->root +
+                                                    root->left);
+        switch (corruption) {
+        case 0: header->magic[0] ^= 1;                          break;
+        case 1: header->version++;                              break;
+        case 2: header->count++;                                break;
+        case 3: root->parent &= ~(int64_t)1; /* red root */     break;
+        case 4: root->left = root->right;                       break;
+        case 5: root->left = size;      /* out of bounds */     break;
+        case 6: left->left = -root->left;  /* back to root */   break;
+        default: root->right = 4;       /* misaligned */        break;
+        }
+        assert(!rel_tree_accepts(copy, size));
+    }
+
+    /* The unmodified copy is fine */
+    memcpy(copy, buf, size);
+    assert(rel_tree_accepts(copy, size));
+
+    free(copy);
+    free(buf);
+}
+
+struct rb_test_tdnode {
+    int key;
+    bool in_tree;
+    /** When the node was inserted, which orders nodes with equal keys */
+    unsigned seq;
+    struct rb_tdnode node;
+};
+
+static int
+rb_test_tdnode_cmp(const struct rb_tdnode *a, const struct rb_tdnode *b)
+{
+    struct rb_test_tdnode *ta = rb_tdnode_data(struct rb_test_tdnode, a, node);
+    struct rb_test_tdnode *tb = rb_tdnode_data(struct rb_test_tdnode, b, node);
+    return tb->key - ta->key;
+}
+
+static int
+rb_test_tdnode_cmp_void(const struct rb_tdnode *n, const void *v)
+{
+    struct rb_test_tdnode *tn = rb_tdnode_data(struct rb_test_tdnode, n, node);
+    return *(int *)v - tn->key;
+}
+
+#define TDTREE_TEST_NUM_KEYS 64
+
+static void
+validate_tdtree_model(struct rb_tdtree *tree, struct rb_test_tdnode *nodes,
+                      unsigned num_nodes)
+{
+    rb_tdtree_validate(tree);
+
+    unsigned expected = 0;
+    for (unsigned i = 0; i < num_nodes; i++)
+        expected += nodes[i].in_tree;
+
+    /* Sorted by key and then by insertion order */
+    struct rb_tdcursor cur;
+    struct rb_test_tdnode *prev = NULL;
+    unsigned count = 0;
+    rb_tdtree_foreach(struct rb_test_tdnode, n, &cur, tree, node) {
+        assert(n->in_tree);
+        if (prev) {
+            assert(prev->key < n->key ||
+                   (prev->key == n->key && prev->seq < n->seq));
+        }
+        prev = n;
+        count++;
+    }
+    assert(count == expected);
+    assert(prev == NULL || rb_tdtree_last(tree) == &prev->node);
+
+    struct rb_test_tdnode *next = NULL;
+    rb_tdtree_foreach_rev(struct rb_test_tdnode, n, &cur, tree, node) {
+        if (next) {
+            assert(n->key < next->key ||
+                   (n->key == next->key && n->seq < next->seq));
+        }
+        next = n;
+        count--;
+    }
+    assert(count == 0);
+    assert(next == NULL || rb_tdtree_first(tree) == &next->node);
+
+    for (int key = -1; key <= TDTREE_TEST_NUM_KEYS; key++) {
+        /* The first node in the tree with the smallest key >= key */
+        struct rb_test_tdnode *lb = NULL;
+        for (unsigned i = 0; i < num_nodes; i++) {
+            struct rb_test_tdnode *n = &nodes[i];
+            if (!n->in_tree || n->key < key)
+                continue;
+            if (lb == NULL || n->key < lb->key ||
+                (n->key == lb->key && n->seq < lb->seq))
+                lb = n;
+        }
+
+        rb_tdcursor_lower_bound(&cur, tree, &key, rb_test_tdnode_cmp_void);
+        assert(rb_tdcursor_node(&cur) == (lb ? &lb->node : NULL));
+
+        struct rb_tdnode *s =
+            rb_tdtree_search(tree, &key, rb_test_tdnode_cmp_void);
+        if (lb && lb->key == key) {
+            assert(s);
+            struct rb_test_tdnode *ts =
+                rb_tdnode_data(struct rb_test_tdnode, s, node);
+            assert(ts->in_tree && ts->key == key);
+        } else {
+            assert(s == NULL);
+        }
+
+        /* Stepping back from the lower bound and forward again */
+        if (lb) {
+            struct rb_tdnode *p = rb_tdcursor_prev(&cur);
+            if (p) {
+                assert(rb_tdnode_data(struct rb_test_tdnode,
+                                      p, node)->key < key);
+                assert(rb_tdcursor_next(&cur) == &lb->node);
+            } else {
+                assert(rb_tdtree_first(tree) == &lb->node);
+            }
+        }
+    }
+}
+
+static void
+test_tdtree(void)
+{
+    static struct rb_test_tdnode nodes[512];
+    struct rb_tdtree tree;
+    unsigned seq = 0;
+
+    assert(sizeof(struct rb_tdnode) == 2 * sizeof(void *));
+
+    rb_tdtree_init(&tree);
+    assert(rb_tdtree_is_empty(&tree));
+    for (unsigned i = 0; i < ARRAY_SIZE(nodes); i++)
+        nodes[i].in_tree = false;
+
+    for (unsigned iter = 0; iter < 6000; iter++) {
+        /* Grow the tree for a while and then shrink it again */
+        bool grow = (test_rand() % 4 != 0) == ((iter / 1500) % 2 == 0);
+        if (grow) {
+            struct rb_test_tdnode *n =
+                &nodes[test_rand() % ARRAY_SIZE(nodes)];
+            if (!n->in_tree) {
+                n->key = test_rand() % TDTREE_TEST_NUM_KEYS;
+                n->seq = seq++;
+                n->in_tree = true;
+                rb_tdtree_insert(&tree, &n->node, rb_test_tdnode_cmp);
+            }
+        } else {
+            int key = test_rand() % TDTREE_TEST_NUM_KEYS;
+            bool any = false;
+            for (unsigned i = 0; i < ARRAY_SIZE(nodes); i++)
+                any |= nodes[i].in_tree && nodes[i].key == key;
+
+            struct rb_tdnode *removed =
+                rb_tdtree_remove(&tree, &key, rb_test_tdnode_cmp_void);
+            assert((removed != NULL) == any);
+            if (removed) {
+                struct rb_test_tdnode *tn =
+                    rb_tdnode_data(struct rb_test_tdnode, removed, node);
+                assert(tn->in_tree && tn->key == key);
+                tn->in_tree = false;
+            }
+        }
+
+        rb_tdtree_validate(&tree);
+        if (iter % 50 == 0)
+            validate_tdtree_model(&tree, nodes, ARRAY_SIZE(nodes));
+    }
+    validate_tdtree_model(&tree, nodes, ARRAY_SIZE(nodes));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].in_tree) {
+            assert(rb_tdtree_remove(&tree, &nodes[i].key,
+                                    rb_test_tdnode_cmp_void));
+        }
+    }
+    assert(rb_tdtree_is_empty(&tree));
+}
+
+static void
+test_join_split(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree, left, right;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+
+    for (int key = 0; key <= 51; key++) {
+        rb_tree_split(&tree, &key, &left, &right, rb_test_node_cmp_void);
+        assert(rb_tree_is_empty(&tree));
+        rb_tree_validate(&left);
+        rb_tree_validate(&right);
+
+        unsigned left_count = 0, right_count = 0;
+        rb_tree_foreach(struct rb_test_node, n, &left, node) {
+            assert(n->key < key);
+            left_count++;
+        }
+        rb_tree_foreach(struct rb_test_node, n, &right, node) {
+            assert(n->key >= key);
+            right_count++;
+        }
+        assert(left_count + right_count == ARRAY_SIZE(test_numbers));
+
+        /* Put it back together using the first node of right as the pivot */
+        struct rb_node *pivot = rb_tree_first(&right);
+        if (pivot == NULL) {
+            pivot = rb_tree_last(&left);
+            rb_tree_remove(&left, pivot);
+        } else {
+            rb_tree_remove(&right, pivot);
+        }
+        rb_tree_join(&left, pivot, &right);
+        assert(rb_tree_is_empty(&right));
+        tree = left;
+        rb_tree_validate(&tree);
+        validate_tree_order(&tree, ARRAY_SIZE(test_numbers));
+    }
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        struct rb_node *at = &nodes[i].node;
+        unsigned pos = 0;
+        for (struct rb_node *n = rb_tree_first(&tree); n != at;
+             n = rb_node_next(n))
+            pos++;
+
+        rb_tree_split_at(&tree, at, &left, &right);
+        assert(rb_tree_is_empty(&tree));
+        rb_tree_validate(&left);
+        rb_tree_validate(&right);
+        assert(rb_tree_first(&right) == at);
+
+        unsigned left_count = 0;
+        for (struct rb_node *n = rb_tree_first(&left); n; n = rb_node_next(n))
+            left_count++;
+        assert(left_count == pos);
+
+        rb_tree_remove(&right, at);
+        rb_tree_join(&left, at, &right);
+        tree = left;
+        rb_tree_validate(&tree);
+        validate_tree_order(&tree, ARRAY_SIZE(test_numbers));
+    }
+}
+
+static void
+test_set_operations(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    const unsigned half = ARRAY_SIZE(test_numbers) / 2;
+    struct rb_tree t, u, d;
+
+    /* Union */
+    rb_tree_init(&t);
+    rb_tree_init(&u);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(i < half ? &t : &u, &nodes[i].node, rb_test_node_cmp);
+    }
+    rb_tree_union(&t, &u, rb_test_node_cmp);
+    assert(rb_tree_is_empty(&u));
+    rb_tree_validate(&t);
+    validate_tree_order(&t, ARRAY_SIZE(test_numbers));
+    validate_search(&t, 0, ARRAY_SIZE(test_numbers) - 1);
+
+    /* Intersection and difference */
+    for (unsigned op = 0; op < 2; op++) {
+        rb_tree_init(&t);
+        rb_tree_init(&u);
+        rb_tree_init(&d);
+        for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+            nodes[i].key = test_numbers[i];
+            rb_tree_insert(i < half ? &t : &u, &nodes[i].node,
+                           rb_test_node_cmp);
+        }
+
+        if (op == 0)
+            rb_tree_intersection(&t, &u, &d, rb_test_node_cmp);
+        else
+            rb_tree_difference(&t, &u, &d, rb_test_node_cmp);
+        rb_tree_validate(&t);
+        rb_tree_validate(&u);
+        rb_tree_validate(&d);
+
+        unsigned t_count = 0, d_count = 0;
+        for (int key = 0; key <= 50; key++) {
+            unsigned orig = 0;
+            for (unsigned i = 0; i < half; i++)
+                orig += test_numbers[i] == key;
+
+            bool in_u = count_key(&u, key) > 0;
+            bool keep = op == 0 ? in_u : !in_u;
+            assert(count_key(&t, key) == (keep ? orig : 0));
+            assert(count_key(&d, key) == (keep ? 0 : orig));
+            t_count += count_key(&t, key);
+            d_count += count_key(&d, key);
+        }
+        assert(t_count + d_count == half);
+        validate_tree_order(&t, t_count);
+        validate_tree_order(&d, d_count);
+        validate_tree_order(&u, ARRAY_SIZE(test_numbers) - half);
+    }
+}
+
+struct rb_test_counted_node {
+    int key;
+    struct rb_counted_node node;
+};
+
+static int
+rb_test_counted_node_cmp_void(const struct rb_node *n, const void *v)
+{
+    struct rb_test_counted_node *tn =
+        rb_node_data(struct rb_test_counted_node, n, node.node);
+    return *(int *)v - tn->key;
+}
+
+static int
+rb_test_counted_node_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+    struct rb_test_counted_node *ta =
+        rb_node_data(struct rb_test_counted_node, a, node.node);
+    struct rb_test_counted_node *tb =
+        rb_node_data(struct rb_test_counted_node, b, node.node);
+
+    return tb->key - ta->key;
+}
+
+static void
+validate_counted(struct rb_tree *tree, unsigned expected_count)
+{
+    size_t i = 0;
+    rb_tree_foreach(struct rb_test_counted_node, n, tree, node.node) {
+        assert(rb_tree_select(tree, i) == &n->node.node);
+        assert(rb_node_rank(&n->node.node) == i);
+        i++;
+    }
+    assert(i == expected_count);
+    assert(rb_tree_select(tree, i) == NULL);
+
+    for (int lo = 0; lo <= 51; lo++) {
+        for (int hi = lo; hi <= 51; hi += 7) {
+            size_t expected = 0;
+            rb_tree_foreach(struct rb_test_counted_node, n, tree, node.node) {
+                if (n->key >= lo && n->key < hi)
+                    expected++;
+            }
+            assert(rb_tree_count_range(tree, &lo, &hi,
+                                       rb_test_counted_node_cmp_void) ==
+                   expected);
+        }
+    }
+}
+
+static void
+test_counted(void)
+{
+    struct rb_test_counted_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert_counted(&tree, &nodes[i].node,
+                               rb_test_counted_node_cmp);
+        rb_tree_validate_counted(&tree);
+        validate_counted(&tree, i + 1);
+    }
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        rb_tree_remove_counted(&tree, &nodes[i].node);
+        rb_tree_validate_counted(&tree);
+        validate_counted(&tree, ARRAY_SIZE(test_numbers) - i - 1);
+    }
+}
+
+static void
+test_cached(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree_cached tree;
+
+    rb_tree_cached_init(&tree);
+    assert(rb_tree_cached_pop_first(&tree) == NULL);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_cached_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+        rb_tree_validate(&tree.tree);
+        assert(rb_tree_cached_first(&tree) == rb_tree_first(&tree.tree));
+        assert(rb_tree_cached_last(&tree) == rb_tree_last(&tree.tree));
+    }
+
+    /* Remove every other node from the back half in array order */
+    for (unsigned i = ARRAY_SIZE(test_numbers) / 2;
+         i < ARRAY_SIZE(test_numbers); i += 2) {
+        rb_tree_cached_remove(&tree, &nodes[i].node);
+        rb_tree_validate(&tree.tree);
+        assert(rb_tree_cached_first(&tree) == rb_tree_first(&tree.tree));
+        assert(rb_tree_cached_last(&tree) == rb_tree_last(&tree.tree));
+    }
+
+    /* Popping everything should give us the rest back in sorted order */
+    unsigned count = 0;
+    struct rb_test_node *prev = NULL;
+    struct rb_node *n;
+    while ((n = rb_tree_cached_pop_first(&tree))) {
+        struct rb_test_node *tn = rb_node_data(struct rb_test_node, n, node);
+        assert(prev == NULL || prev->key < tn->key ||
+               (prev->key == tn->key && prev < tn));
+        rb_tree_validate(&tree.tree);
+        assert(rb_tree_cached_first(&tree) == rb_tree_first(&tree.tree));
+        assert(rb_tree_cached_last(&tree) == rb_tree_last(&tree.tree));
+        prev = tn;
+        count++;
+    }
+    assert(count == ARRAY_SIZE(test_numbers) - ARRAY_SIZE(test_numbers) / 4);
+    assert(rb_tree_is_empty(&tree.tree));
+}
+
+struct rb_test_threaded_node {
+    int key;
+    struct rb_threaded_node node;
+};
+
+static int
+rb_test_threaded_node_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+    return rb_node_data(struct rb_test_threaded_node, b, node.node)->key -
+           rb_node_data(struct rb_test_threaded_node, a, node.node)->key;
+}
+
+static void
+test_threaded(void)
+{
+    struct rb_test_threaded_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree_threaded tree;
+
+    rb_tree_threaded_init(&tree);
+    assert(rb_tree_threaded_first(&tree) == NULL);
+    assert(rb_tree_threaded_last(&tree) == NULL);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_threaded_insert(&tree, &nodes[i].node,
+                                rb_test_threaded_node_cmp);
+        rb_tree_validate_threaded(&tree);
+    }
+
+    /* Remove every other node from the back half in array order */
+    for (unsigned i = ARRAY_SIZE(test_numbers) / 2;
+         i < ARRAY_SIZE(test_numbers); i += 2) {
+        rb_tree_threaded_remove(&tree, &nodes[i].node);
+        rb_tree_validate_threaded(&tree);
+    }
+
+    /* The list has to agree with rb_node_next in both directions */
+    unsigned count = 0;
+    struct rb_node *n = rb_tree_first(&tree.tree);
+    rb_tree_threaded_foreach(struct rb_test_threaded_node, tn, &tree, node) {
+        assert(&tn->node.node == n);
+        n = rb_node_next(n);
+        count++;
+    }
+    assert(n == NULL);
+    assert(count == ARRAY_SIZE(test_numbers) - ARRAY_SIZE(test_numbers) / 4);
+
+    n = rb_tree_last(&tree.tree);
+    rb_tree_threaded_foreach_rev(struct rb_test_threaded_node, tn, &tree,
+                                 node) {
+        assert(&tn->node.node == n);
+        n = rb_node_prev(n);
+    }
+    assert(n == NULL);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers) / 2; i++) {
+        rb_tree_threaded_remove(&tree, &nodes[i].node);
+        rb_tree_validate_threaded(&tree);
+    }
+    for (unsigned i = ARRAY_SIZE(test_numbers) / 2 + 1;
+         i < ARRAY_SIZE(test_numbers); i += 2) {
+        rb_tree_threaded_remove(&tree, &nodes[i].node);
+        rb_tree_validate_threaded(&tree);
+    }
+    assert(rb_tree_is_empty(&tree.tree));
+    assert(rb_tree_threaded_first(&tree) == NULL);
+    assert(rb_tree_threaded_last(&tree) == NULL);
+}
+
+struct rb_test_multi_node {
+    int key;
+    struct rb_multi_node node;
+};
+
+static int
+rb_test_multi_node_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+    return rb_node_data(struct rb_test_multi_node, b, node.node)->key -
+           rb_node_data(struct rb_test_multi_node, a, node.node)->key;
+}
+
+static int
+rb_test_multi_node_cmp_void(const struct rb_node *n, const void *v)
+{
+    return *(int *)v -
+           rb_node_data(struct rb_test_multi_node, n, node.node)->key;
+}
+
+/* Check that a multimap tree holds the nodes with present set in the
+ * order a plain tree would put them.
+ */
+static void
+validate_multi_tree(struct rb_tree *tree,
+                    struct rb_test_multi_node *nodes, const bool *present)
+{
+    struct rb_test_node plain_nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree plain;
+    unsigned count = 0;
+
+    rb_tree_validate_multi(tree, rb_test_multi_node_cmp);
+
+    rb_tree_init(&plain);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        if (!present[i])
+            continue;
+        plain_nodes[i].key = test_numbers[i];
+        rb_tree_insert(&plain, &plain_nodes[i].node, rb_test_node_cmp);
+        count++;
+    }
+
+    struct rb_node *n = rb_tree_first(&plain);
+    rb_tree_multi_foreach(struct rb_test_multi_node, mn, tree, node) {
+        struct rb_test_node *tn = rb_node_data(struct rb_test_node, n, node);
+        assert(mn - nodes == tn - plain_nodes);
+        n = rb_node_next(n);
+        count--;
+    }
+    assert(n == NULL && count == 0);
+
+    n = rb_tree_last(&plain);
+    for (struct rb_multi_node *m = rb_tree_multi_last(tree); m;
+         m = rb_multi_node_prev(m)) {
+        struct rb_test_node *tn = rb_node_data(struct rb_test_node, n, node);
+        assert(rb_node_data(struct rb_test_multi_node, m, node) - nodes ==
+               tn - plain_nodes);
+        n = rb_node_prev(n);
+    }
+    assert(n == NULL);
+}
+
+static void
+test_multi(void)
+{
+    struct rb_test_multi_node nodes[ARRAY_SIZE(test_numbers)];
+    bool present[ARRAY_SIZE(test_numbers)] = { false };
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    assert(rb_tree_multi_first(&tree) == NULL);
+    assert(rb_tree_multi_last(&tree) == NULL);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_multi_insert(&tree, &nodes[i].node, rb_test_multi_node_cmp);
+        present[i] = true;
+        validate_multi_tree(&tree, nodes, present);
+    }
+
+    /* Only distinct keys are in the tree itself */
+    unsigned distinct = 0;
+    for (int key = 0; key <= 50; key++) {
+        for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+            if (test_numbers[i] == key) {
+                distinct++;
+                break;
+            }
+        }
+    }
+    struct rb_tree_shape shape;
+    rb_tree_shape_stats(&tree, &shape);
+    assert(shape.count == distinct);
+
+    /* Searching finds the first node inserted with a key */
+    int key = 39;
+    struct rb_multi_node *found =
+        rb_multi_node_from_rb(rb_tree_search(&tree, &key,
+                                             rb_test_multi_node_cmp_void));
+    assert(found == &nodes[6].node);
+
+    /* Remove every third node, which takes out some bucket heads, then
+     * the rest.
+     */
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i += 3) {
+        rb_tree_multi_remove(&tree, &nodes[i].node);
+        present[i] = false;
+        validate_multi_tree(&tree, nodes, present);
+    }
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        if (!present[i])
+            continue;
+        rb_tree_multi_remove(&tree, &nodes[i].node);
+        present[i] = false;
+        validate_multi_tree(&tree, nodes, present);
+    }
+    assert(rb_tree_is_empty(&tree));
+
+    /* Replacing a node keeps the tree valid without any comparisons */
+    struct rb_test_node plain_nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_test_node replacement;
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        plain_nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &plain_nodes[i].node, rb_test_node_cmp);
+    }
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i += 7) {
+        replacement.key = plain_nodes[i].key;
+        rb_tree_replace_node(&tree, &plain_nodes[i].node, &replacement.node);
+        rb_tree_validate(&tree);
+        plain_nodes[i] = replacement;
+        rb_tree_replace_node(&tree, &replacement.node, &plain_nodes[i].node);
+        rb_tree_validate(&tree);
+    }
+    validate_tree_order(&tree, ARRAY_SIZE(test_numbers));
+}
+
+static void
+test_bounds(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+
+    for (int key = 0; key <= 51; key++) {
+        struct rb_node *lower = NULL, *upper = NULL;
+        for (struct rb_node *n = rb_tree_last(&tree); n; n = rb_node_prev(n)) {
+            int n_key = rb_node_data(struct rb_test_node, n, node)->key;
+            if (n_key >= key)
+                lower = n;
+            if (n_key > key)
+                upper = n;
+        }
+
+        assert(rb_tree_lower_bound(&tree, &key,
+                                   rb_test_node_cmp_void) == lower);
+        assert(rb_tree_upper_bound(&tree, &key,
+                                   rb_test_node_cmp_void) == upper);
+
+        struct rb_node *first, *end;
+        rb_tree_equal_range(&tree, &key, rb_test_node_cmp_void, &first, &end);
+        assert(first == lower);
+        assert(end == upper);
+
+        for (int hi = key; hi <= 52; hi += 5) {
+            unsigned expected = 0, count = 0;
+            rb_tree_foreach(struct rb_test_node, n, &tree, node) {
+                if (n->key >= key && n->key < hi)
+                    expected++;
+            }
+            rb_tree_foreach_range(struct rb_test_node, n, &tree, node,
+                                  &key, &hi, rb_test_node_cmp_void) {
+                assert(n->key >= key && n->key < hi);
+                count++;
+            }
+            assert(count == expected);
+        }
+    }
+}
+
+static void
+test_search_batch(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+
+    /* More keys than fit in one batch, some of which aren't in the tree */
+    int keys[60];
+    const void *key_ptrs[ARRAY_SIZE(keys)];
+    struct rb_node *found[ARRAY_SIZE(keys)];
+    for (unsigned i = 0; i < ARRAY_SIZE(keys); i++) {
+        keys[i] = (int)(i * 7 % 61) - 5;
+        key_ptrs[i] = &keys[i];
+    }
+
+    rb_tree_search_batch(&tree, key_ptrs, ARRAY_SIZE(keys), found,
+                         rb_test_node_cmp_void);
+    for (unsigned i = 0; i < ARRAY_SIZE(keys); i++) {
+        assert(found[i] == rb_tree_search(&tree, &keys[i],
+                                          rb_test_node_cmp_void));
+    }
+
+    /* Searching an empty tree finds nothing */
+    rb_tree_init(&tree);
+    rb_tree_search_batch(&tree, key_ptrs, ARRAY_SIZE(keys), found,
+                         rb_test_node_cmp_void);
+    for (unsigned i = 0; i < ARRAY_SIZE(keys); i++)
+        assert(found[i] == NULL);
+}
+
+static void
+rb_test_shape_walk(struct rb_node *n, unsigned depth,
+                   struct rb_tree_shape *shape)
+{
+    if (n == NULL)
+        return;
+
+    shape->count++;
+    shape->depth_histogram[depth]++;
+    if (depth + 1 > shape->height)
+        shape->height = depth + 1;
+
+    rb_test_shape_walk(n->left, depth + 1, shape);
+    rb_test_shape_walk(n->right, depth + 1, shape);
+}
+
+static void
+test_stats(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+    struct rb_tree_shape shape, expected;
+
+    rb_tree_init(&tree);
+    rb_tree_shape_stats(&tree, &shape);
+    assert(shape.count == 0 && shape.height == 0 && shape.black_height == 0);
+
+    rb_tree_stats_reset();
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+
+    rb_tree_shape_stats(&tree, &shape);
+    memset(&expected, 0, sizeof(expected));
+    rb_test_shape_walk(tree.root, 0, &expected);
+    assert(shape.count == ARRAY_SIZE(test_numbers));
+    assert(shape.count == expected.count);
+    assert(shape.height == expected.height);
+    assert(memcmp(shape.depth_histogram, expected.depth_histogram,
+                  sizeof(shape.depth_histogram)) == 0);
+    assert(shape.black_height >= 1 && shape.height <= 2 * shape.black_height);
+
+    size_t depth_sum = 0;
+    for (unsigned d = 0; d < RB_TREE_SHAPE_MAX_DEPTH; d++)
+        depth_sum += d * shape.depth_histogram[d];
+    assert(shape.average_depth == (double)depth_sum / shape.count);
+
+    int key = 17;
+    rb_tree_search(&tree, &key, rb_test_node_cmp_void);
+    rb_tree_remove(&tree, &nodes[0].node);
+
+    struct rb_tree_stats stats;
+    rb_tree_stats_get(&stats);
+#ifdef RB_TREE_STATS
+    assert(stats.inserts == ARRAY_SIZE(test_numbers));
+    assert(stats.insert_compares > 0 && stats.rotations > 0);
+    assert(stats.searches == 1 && stats.search_compares > 0);
+    assert(stats.search_compares <= shape.height);
+    assert(stats.removes == 1);
+#else
+    assert(stats.inserts == 0 && stats.searches == 0);
+#endif
+
+    /* A batch of searches does exactly the same work as searching for each
+     * key one at a time.
+     */
+    int batch_keys[40];
+    const void *batch_key_ptrs[ARRAY_SIZE(batch_keys)];
+    struct rb_node *found[ARRAY_SIZE(batch_keys)];
+    for (unsigned i = 0; i < ARRAY_SIZE(batch_keys); i++) {
+        batch_keys[i] = i + 10;
+        batch_key_ptrs[i] = &batch_keys[i];
+    }
+
+    rb_tree_stats_reset();
+    for (unsigned i = 0; i < ARRAY_SIZE(batch_keys); i++)
+        rb_tree_search(&tree, &batch_keys[i], rb_test_node_cmp_void);
+    struct rb_tree_stats serial_stats;
+    rb_tree_stats_get(&serial_stats);
+
+    rb_tree_stats_reset();
+    rb_tree_search_batch(&tree, batch_key_ptrs, ARRAY_SIZE(batch_keys),
+                         found, rb_test_node_cmp_void);
+    rb_tree_stats_get(&stats);
+#ifdef RB_TREE_STATS
+    assert(stats.searches == ARRAY_SIZE(batch_keys));
+    assert(stats.searches == serial_stats.searches);
+    assert(stats.search_compares == serial_stats.search_compares);
+#else
+    assert(stats.searches == 0 && serial_stats.searches == 0);
+#endif
+}
+
+static void
+test_insert_hint(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    /* Hint with the previously inserted node, the last node, the first
+     * node, a random node and no node at all.
+     */
+    for (unsigned mode = 0; mode < 5; mode++) {
+        rb_tree_init(&tree);
+        for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+            struct rb_node *hint;
+            switch (mode) {
+            case 0:  hint = i > 0 ? &nodes[i - 1].node : NULL; break;
+            case 1:  hint = rb_tree_last(&tree);               break;
+            case 2:  hint = rb_tree_first(&tree);              break;
+            case 3:  hint = i > 0 ? &nodes[test_rand() % i].node : NULL;
+                     break;
+            default: hint = NULL;                              break;
+            }
+
+            nodes[i].key = test_numbers[i];
+            rb_tree_insert_hint(&tree, hint, &nodes[i].node,
+                                rb_test_node_cmp);
+            rb_tree_validate(&tree);
+            validate_tree_order(&tree, i + 1);
+        }
+    }
+
+    /* Appending in sorted order should always hit the fast path */
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++)
+        nodes[i].key = i;
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        rb_tree_insert_hint(&tree, rb_tree_last(&tree), &nodes[i].node,
+                            rb_test_node_cmp);
+    }
+    rb_tree_validate(&tree);
+    validate_tree_order(&tree, ARRAY_SIZE(test_numbers));
+}
+
+#define RB_TEST_NODE_KEY(n) ((n)->key)
+#define RB_TEST_KEY_CMP(a, b) ((a) - (b))
+
+RB_TREE_DEFINE(rb_test_typed, struct rb_test_node, node, int,
+               RB_TEST_NODE_KEY, RB_TEST_KEY_CMP)
+
+static void
+test_typed(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_test_typed_tree tree;
+
+    rb_test_typed_init(&tree);
+    assert(rb_test_typed_is_empty(&tree));
+    assert(rb_test_typed_first(&tree) == NULL);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_test_typed_insert(&tree, &nodes[i]);
+        rb_tree_validate(&tree.tree);
+        validate_tree_order(&tree.tree, i + 1);
+        validate_search(&tree.tree, 0, i);
+    }
+
+    for (int key = -1; key <= 100; key++) {
+        assert(rb_test_typed_search(&tree, key) ==
+               rb_test_typed_data(rb_tree_search(&tree.tree, &key,
+                                                 rb_test_node_cmp_void)));
+        assert(rb_test_typed_lower_bound(&tree, key) ==
+               rb_test_typed_data(rb_tree_lower_bound(&tree.tree, &key,
+                                                      rb_test_node_cmp_void)));
+        assert(rb_test_typed_upper_bound(&tree, key) ==
+               rb_test_typed_data(rb_tree_upper_bound(&tree.tree, &key,
+                                                      rb_test_node_cmp_void)));
+    }
+    assert(rb_test_typed_search(&tree, NON_EXISTANT_NUMBER) == NULL);
+
+    unsigned count = 0;
+    for (struct rb_test_node *n = rb_test_typed_first(&tree); n;
+         n = rb_test_typed_next(n))
+        count++;
+    assert(count == ARRAY_SIZE(test_numbers));
+    for (struct rb_test_node *n = rb_test_typed_last(&tree); n;
+         n = rb_test_typed_prev(n))
+        count--;
+    assert(count == 0);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        rb_test_typed_remove(&tree, &nodes[i]);
+        rb_tree_validate(&tree.tree);
+        validate_tree_order(&tree.tree, ARRAY_SIZE(test_numbers) - i - 1);
+    }
+    assert(rb_test_typed_is_empty(&tree));
+}
+
+struct rb_test_prefix_node {
+    struct rb_prefix_node node;
+    const char *key;
+};
+
+static int
+rb_test_prefix_node_cmp_void(const struct rb_node *n, const void *v)
+{
+    struct rb_test_prefix_node *tn =
+        rb_node_data(struct rb_test_prefix_node, n, node.node);
+    return strcmp((const char *)v, tn->key);
+}
+
+static int
+rb_test_prefix_node_cmp(const struct rb_node *n, const struct rb_node *m)
+{
+    struct rb_test_prefix_node *tm =
+        rb_node_data(struct rb_test_prefix_node, m, node.node);
+    return rb_test_prefix_node_cmp_void(n, tm->key);
+}
+
+static const char *test_strings[] = {
+    "application", "apple", "b", "applesauce", "apply", "", "applications",
+    "banana", "apple", "appl", "applicable", "zebra", "applesauce", "a",
+};
+
+static void
+test_prefix(void)
+{
+    struct rb_test_prefix_node nodes[ARRAY_SIZE(test_strings)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_strings); i++) {
+        nodes[i].key = test_strings[i];
+        nodes[i].node.prefix =
+            rb_key_prefix_from_bytes(test_strings[i], strlen(test_strings[i]));
+        rb_tree_insert_prefix(&tree, &nodes[i].node, rb_test_prefix_node_cmp);
+        rb_tree_validate(&tree);
+    }
+
+    /* The tree must be in strcmp order and stable for equal keys */
+    const char *prev_key = NULL;
+    unsigned count = 0;
+    for (struct rb_node *x = rb_tree_first(&tree); x; x = rb_node_next(x)) {
+        struct rb_test_prefix_node *n =
+            rb_node_data(struct rb_test_prefix_node, x, node.node);
+        assert(prev_key == NULL || strcmp(prev_key, n->key) <= 0);
+        prev_key = n->key;
+        count++;
+    }
+    assert(count == ARRAY_SIZE(test_strings));
+    assert(&nodes[1].node.node == rb_node_prev(&nodes[8].node.node));
+    assert(&nodes[3].node.node == rb_node_prev(&nodes[12].node.node));
+
+    static const char *queries[] = {
+        "apple", "appl", "applic", "applications", "applicationz", "", "b",
+        "ba", "zebra", "zz", "applesauce", "applesaucf",
+    };
+    for (unsigned i = 0; i < ARRAY_SIZE(queries); i++) {
+        const char *q = queries[i];
+        uint64_t prefix = rb_key_prefix_from_bytes(q, strlen(q));
+
+        struct rb_node *n = rb_tree_search_prefix(&tree, prefix, q,
+                                                  rb_test_prefix_node_cmp_void);
+        struct rb_node *m = rb_tree_search(&tree, q,
+                                           rb_test_prefix_node_cmp_void);
+        assert((n == NULL) == (m == NULL));
+        if (n)
+            assert(rb_test_prefix_node_cmp_void(n, q) == 0);
+
+        assert(rb_tree_lower_bound_prefix(&tree, prefix, q,
+                                          rb_test_prefix_node_cmp_void) ==
+               rb_tree_lower_bound(&tree, q, rb_test_prefix_node_cmp_void));
+    }
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_strings); i++) {
+        rb_tree_remove(&tree, &nodes[i].node.node);
+        rb_tree_validate(&tree);
+    }
+    assert(rb_tree_is_empty(&tree));
+}
+
+static void
+destroy_test_node(struct rb_node *n, void *data)
+{
+    unsigned *count = data;
+
+    /* Children must already be gone when a node is destroyed */
+    assert(n->left == NULL && n->right == NULL);
+    rb_node_data(struct rb_test_node, n, node)->key = -1;
+    (*count)++;
+}
+
+static void
+test_destroy(void)
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+
+    unsigned count = 0;
+    rb_tree_destroy(&tree, destroy_test_node, &count);
+    assert(rb_tree_is_empty(&tree));
+    assert(count == ARRAY_SIZE(test_numbers));
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++)
+        assert(nodes[i].key == -1);
+
+    /* Destroying an empty tree is a no-op */
+    rb_tree_destroy(&tree, destroy_test_node, &count);
+    assert(count == ARRAY_SIZE(test_numbers));
+
+    /* The safe iterators must allow removing the current node */
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    }
+    count = 0;
+    rb_tree_foreach_safe(struct rb_test_node, n, &tree, node) {
+        rb_tree_remove(&tree, &n->node);
+        count++;
+    }
+    assert(rb_tree_is_empty(&tree));
+    assert(count == ARRAY_SIZE(test_numbers));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++)
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+    rb_tree_foreach_rev_safe(struct rb_test_node, n, &tree, node) {
+        rb_tree_remove(&tree, &n->node);
+        count--;
+    }
+    assert(rb_tree_is_empty(&tree));
+    assert(count == 0);
+}
+
+int
+main()
+{
+    struct rb_test_node nodes[ARRAY_SIZE(test_numbers)];
+    struct rb_tree tree;
+
+    rb_tree_init(&tree);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        nodes[i].key = test_numbers[i];
+        rb_tree_insert(&tree, &nodes[i].node, rb_test_node_cmp);
+        rb_tree_validate(&tree);
+        validate_tree_order(&tree, i + 1);
+        validate_search(&tree, 0, i);
+    }
+
+    for (unsigned i = 0; i < ARRAY_SIZE(test_numbers); i++) {
+        rb_tree_remove(&tree, &nodes[i].node);
+        rb_tree_validate(&tree);
+        validate_tree_order(&tree, ARRAY_SIZE(test_numbers) - i - 1);
+        validate_search(&tree, i + 1, ARRAY_SIZE(test_numbers) - 1);
+    }
+
+    test_build_sorted();
+    test_bulk_load();
+    test_augmented();
+    test_interval_tree();
+    test_tree32();
+    test_pool();
+    test_latch_tree();
+    test_latch_tree_threaded();
+    test_ptree();
+    test_sharded_tree();
+    test_btree();
+    test_frozen_tree();
+    test_rel_tree();
+    test_tdtree();
+    test_join_split();
+    test_set_operations();
+    test_counted();
+    test_cached();
+    test_threaded();
+    test_multi();
+    test_bounds();
+    test_search_batch();
+    test_stats();
+    test_insert_hint();
+    test_typed();
+    test_prefix();
+    test_destroy();
+}